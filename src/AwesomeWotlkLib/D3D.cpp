@@ -2,13 +2,16 @@
 #include "D3D.h"
 #include <Detours/detours.h>
 #include <d3dcompiler.h>
+#include "unordered_dense/include/ankerl/unordered_dense.h"
+#include <array>
+#include <bitset>
+#include <filesystem>
 
 #ifdef _DEBUG
 //#include "Toolkit.h"
 #endif
 
 #pragma comment(lib, "d3d9.lib")
-#pragma comment(lib, "d3dcompiler.lib")
 
 namespace D3D {
 Present_t oPresent = nullptr;
@@ -24,6 +27,12 @@ CreateTexture_t oCreateTexture = nullptr;
 SetRenderTarget_t oSetRenderTarget = nullptr;
 Clear_t oClear = nullptr;
 Reset_t oReset = nullptr;
+SetSamplerState_t oSetSamplerState = nullptr;
+SetVertexShaderConstantF_t oSetVertexShaderConstantF = nullptr;
+SetPixelShaderConstantF_t oSetPixelShaderConstantF = nullptr;
+BeginStateBlock_t oBeginStateBlock = nullptr;
+EndStateBlock_t oEndStateBlock = nullptr;
+StateBlockApply_t oStateBlockApply = nullptr;
 
 namespace {
 void LogShaderError(ID3DBlob* pError, uint32_t type) {
@@ -35,6 +44,121 @@ void LogShaderError(ID3DBlob* pError, uint32_t type) {
 	}
 }
 
+// compiled shaders by source, entry point, profile and compile flags, kept on disk so a warm start never loads the compiler
+constexpr auto* SHADER_CACHE_DIR = L"Cache_AwesomeWotLK\\Shaders";
+constexpr uint32_t SHADER_CACHE_MAGIC = 0x53485343;
+constexpr uint32_t SHADER_CACHE_VERSION = 1; // bump whenever the entry layout changes
+constexpr UINT SHADER_COMPILE_FLAGS = 0;
+constexpr uint32_t MAX_SHADER_BYTECODE = 256 * 1024;
+
+struct ShaderCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint64_t checksum;
+	uint32_t size;
+	uint32_t pad;
+};
+
+static_assert(sizeof(ShaderCacheHeader) == 32);
+
+ankerl::unordered_dense::map<uint64_t, std::vector<uint8_t>> g_shaderBytecode;
+
+pD3DCompile GetCompiler() {
+	// loaded on the first cache miss only
+	static const pD3DCompile compile = []() -> pD3DCompile {
+		HMODULE module = LoadLibraryW(D3DCOMPILER_DLL_W);
+		return module ? reinterpret_cast<pD3DCompile>(GetProcAddress(module, "D3DCompile")) : nullptr;
+	}();
+	return compile;
+}
+
+uint64_t HashShader(const ResourceParams& p) {
+	using namespace ankerl::unordered_dense::detail;
+	const uint32_t params[] = {SHADER_CACHE_VERSION, D3D_COMPILER_VERSION, SHADER_COMPILE_FLAGS};
+	uint64_t key = wyhash::hash(p.shaderCode.data(), p.shaderCode.size());
+	key = wyhash::mix(key, wyhash::hash(p.entryPoint.data(), p.entryPoint.size()));
+	key = wyhash::mix(key, wyhash::hash(p.target.data(), p.target.size()));
+	return wyhash::mix(key, wyhash::hash(params, sizeof(params)));
+}
+
+std::filesystem::path GetShaderCachePath(uint64_t key) {
+	wchar_t name[32];
+	swprintf_s(name, L"%016llx.cso", key);
+	return std::filesystem::path(SHADER_CACHE_DIR) / name;
+}
+
+// the version token has to name the requested profile and the stream has to close with the end token
+bool IsBytecodeFor(const std::vector<uint8_t>& bytecode, const std::string& target) {
+	if (bytecode.size() < 2 * sizeof(DWORD) || bytecode.size() % sizeof(DWORD) || target.size() < 6) return false;
+	DWORD version, end;
+	std::memcpy(&version, bytecode.data(), sizeof(version));
+	std::memcpy(&end, bytecode.data() + bytecode.size() - sizeof(end), sizeof(end));
+	const DWORD type = target.starts_with("vs_") ? 0xFFFE0000 : 0xFFFF0000;
+	return version == (type | (static_cast<DWORD>(target[3] - '0') << 8) | static_cast<DWORD>(target[5] - '0')) && end == 0x0000FFFF;
+}
+
+bool LoadShaderFile(uint64_t key, const std::string& target, std::vector<uint8_t>& outBytecode) {
+	HANDLE file = CreateFileW(GetShaderCachePath(key).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	ShaderCacheHeader hdr{};
+	DWORD read = 0;
+	bool valid = ReadFile(file, &hdr, sizeof(hdr), &read, nullptr) && read == sizeof(hdr) && hdr.magic == SHADER_CACHE_MAGIC && hdr.version == SHADER_CACHE_VERSION && hdr.key == key && hdr.size <= MAX_SHADER_BYTECODE;
+	if (valid) {
+		outBytecode.resize(hdr.size);
+		valid = ReadFile(file, outBytecode.data(), hdr.size, &read, nullptr) && read == hdr.size;
+	}
+	CloseHandle(file);
+	return valid && ankerl::unordered_dense::detail::wyhash::hash(outBytecode.data(), outBytecode.size()) == hdr.checksum && IsBytecodeFor(outBytecode, target);
+}
+
+void SaveShaderFile(uint64_t key, const std::vector<uint8_t>& bytecode) {
+	std::error_code ec;
+	std::filesystem::create_directories(SHADER_CACHE_DIR, ec);
+	const std::filesystem::path path = GetShaderCachePath(key);
+	// another client may write the same entry at the same time, each goes through its own temporary
+	std::filesystem::path tmpPath = path;
+	tmpPath += L"." + std::to_wstring(GetCurrentProcessId()) + L".tmp";
+
+	HANDLE file = CreateFileW(tmpPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return;
+	const ShaderCacheHeader hdr{.magic = SHADER_CACHE_MAGIC, .version = SHADER_CACHE_VERSION, .key = key, .checksum = ankerl::unordered_dense::detail::wyhash::hash(bytecode.data(), bytecode.size()), .size = static_cast<uint32_t>(bytecode.size()), .pad = 0};
+	DWORD written = 0, payloadWritten = 0;
+	const bool ok = WriteFile(file, &hdr, sizeof(hdr), &written, nullptr) && written == sizeof(hdr) && WriteFile(file, bytecode.data(), static_cast<DWORD>(bytecode.size()), &payloadWritten, nullptr) && payloadWritten == bytecode.size();
+	CloseHandle(file);
+	if (!ok || !MoveFileExW(tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) DeleteFileW(tmpPath.c_str());
+}
+
+// recompile skips both caches, for bytecode the device turned down
+const std::vector<uint8_t>* GetShaderBytecode(const ResourceParams& p, uint32_t type, bool recompile) {
+	const uint64_t key = HashShader(p);
+	if (!recompile) {
+		auto it = g_shaderBytecode.find(key);
+		if (it != g_shaderBytecode.end()) return &it->second;
+	}
+
+	std::vector<uint8_t> bytecode;
+	if (recompile || !LoadShaderFile(key, p.target, bytecode)) {
+		const pD3DCompile compile = GetCompiler();
+		if (!compile) return nullptr;
+		ID3DBlob *pCode = nullptr, *pError = nullptr;
+		HRESULT hr = compile(p.shaderCode.data(), p.shaderCode.size(), nullptr, nullptr, nullptr, p.entryPoint.c_str(), p.target.c_str(), SHADER_COMPILE_FLAGS, 0, &pCode, &pError);
+		if (FAILED(hr)) {
+			LogShaderError(pError, type);
+			return nullptr;
+		}
+		if (pError) pError->Release();
+		const auto* data = static_cast<const uint8_t*>(pCode->GetBufferPointer());
+		bytecode.assign(data, data + pCode->GetBufferSize());
+		pCode->Release();
+		SaveShaderFile(key, bytecode);
+	}
+	auto& cached = g_shaderBytecode[key];
+	cached = std::move(bytecode);
+	return &cached;
+}
+
 enum class ResourceType : uint32_t {
 	Texture, RenderTarget, ShaderVertex,
 	ShaderPixel
@@ -87,6 +211,8 @@ void RestoreManagedResources() {
 	}
 }
 
+void UnregisterFromCleanup(IUnknown** ppRes) { std::erase_if(g_managedResources, [ppRes](const ManagedResource& managed) { return managed.ppResource == ppRes; }); }
+
 void RegisterForCleanup(IUnknown** ppRes, ResourceType type, const ResourceParams& p) {
 	for (auto& managed : g_managedResources) {
 		if (managed.ppResource == ppRes) {
@@ -127,6 +253,56 @@ constexpr ShaderEntry s_shaders_engine[]{
 	//{ { 0xFFFF0300, 0x05000051, 0xA00F0001, 0x00000000 }, 152, "ps_3_0",  "float4 main() : COLOR { return float4(0, 1, 0, 1); }" }, // Gray
 };
 
+constexpr uint32_t SHADOW_SAMPLERS = 16;
+constexpr uint32_t SHADOW_SAMPLER_STATES = D3DSAMP_DMAPOFFSET + 1;
+constexpr uint32_t SHADOW_CONSTANTS = 256;
+constexpr size_t STATE_BLOCK_APPLY_SLOT = 5; // IUnknown, GetDevice, Capture, Apply
+
+struct ConstantShadow {
+	std::array<std::array<float, 4>, SHADOW_CONSTANTS> values;
+	std::bitset<SHADOW_CONSTANTS> valid;
+
+	bool Matches(UINT reg, const float* data, UINT count) const {
+		if (!data || reg + count > SHADOW_CONSTANTS) return false;
+		for (UINT i = 0; i < count; ++i) { if (!valid[reg + i] || std::memcmp(values[reg + i].data(), data + i * 4, sizeof(float) * 4) != 0) return false; }
+		return true;
+	}
+
+	void Store(UINT reg, const float* data, UINT count) {
+		if (!data) return Invalidate(reg, count);
+		for (UINT i = 0; i < count && reg + i < SHADOW_CONSTANTS; ++i) {
+			std::memcpy(values[reg + i].data(), data + i * 4, sizeof(float) * 4);
+			valid.set(reg + i);
+		}
+	}
+
+	void Invalidate(UINT reg, UINT count) { for (UINT i = 0; i < count && reg + i < SHADOW_CONSTANTS; ++i) valid.reset(reg + i); }
+};
+
+struct StateShadow {
+	bool active = false; // only trusted while the device hooks below are in place
+	bool recording = false; // between BeginStateBlock and EndStateBlock binds are recorded, the device state stays as it was
+	std::array<IDirect3DBaseTexture9*, SHADOW_SAMPLERS> textures{};
+	std::bitset<SHADOW_SAMPLERS> texturesValid;
+	std::array<std::array<DWORD, SHADOW_SAMPLER_STATES>, SHADOW_SAMPLERS> samplerStates{};
+	std::array<std::bitset<SHADOW_SAMPLER_STATES>, SHADOW_SAMPLERS> samplerStatesValid;
+	ConstantShadow vsConstants;
+	ConstantShadow psConstants;
+
+	bool IsTrusted() const { return active && !recording; }
+
+	void Invalidate() {
+		texturesValid.reset();
+		for (auto& v : samplerStatesValid) v.reset();
+		vsConstants.valid.reset();
+		psConstants.valid.reset();
+	}
+};
+
+StateShadow g_stateShadow;
+StateCacheStats g_frameStats;
+StateCacheStats g_lastFrameStats;
+
 std::vector<VertexShaderInitCallback> g_vertexShaderCallbacks;
 std::vector<PixelShaderInitCallback> g_pixelShaderCallbacks;
 
@@ -152,6 +328,10 @@ std::vector<ResetCallback> g_resetCallbacks;
 
 HRESULT STDMETHODCALLTYPE hkPresent(IDirect3DDevice9* device, const RECT* pSrcRect, const RECT* pDestRect, HWND hDestWnd, const RGNDATA* pDirtyRegion) {
 	for (auto& cb : g_presentCallbacks) cb(device, pSrcRect, pDestRect, hDestWnd, pDirtyRegion);
+	// frame boundary - roll the counters and drop the shadow in case anything bypassed the hooks (state blocks, etc.)
+	g_lastFrameStats = g_frameStats;
+	g_frameStats = {};
+	g_stateShadow.Invalidate();
 	return oPresent(device, pSrcRect, pDestRect, hDestWnd, pDirtyRegion);
 }
 
@@ -177,7 +357,58 @@ HRESULT STDMETHODCALLTYPE hkDrawIndexedPrimitive(IDirect3DDevice9* device, D3DPR
 
 HRESULT STDMETHODCALLTYPE hkSetTexture(IDirect3DDevice9* device, DWORD stage, IDirect3DBaseTexture9* pTexture) {
 	for (auto& cb : g_setTextureCallbacks) cb(device, stage, pTexture);
-	return oSetTexture(device, stage, pTexture);
+	const HRESULT hr = oSetTexture(device, stage, pTexture);
+	if (!g_stateShadow.recording && stage < SHADOW_SAMPLERS) {
+		g_stateShadow.textures[stage] = pTexture;
+		g_stateShadow.texturesValid.set(stage, SUCCEEDED(hr));
+	}
+	return hr;
+}
+
+HRESULT STDMETHODCALLTYPE hkSetSamplerState(IDirect3DDevice9* device, DWORD sampler, D3DSAMPLERSTATETYPE type, DWORD value) {
+	const HRESULT hr = oSetSamplerState(device, sampler, type, value);
+	if (!g_stateShadow.recording && sampler < SHADOW_SAMPLERS && type < SHADOW_SAMPLER_STATES) {
+		g_stateShadow.samplerStates[sampler][type] = value;
+		g_stateShadow.samplerStatesValid[sampler].set(type, SUCCEEDED(hr));
+	}
+	return hr;
+}
+
+HRESULT STDMETHODCALLTYPE hkSetVertexShaderConstantF(IDirect3DDevice9* device, UINT startRegister, const float* data, UINT vector4fCount) {
+	const HRESULT hr = oSetVertexShaderConstantF(device, startRegister, data, vector4fCount);
+	if (g_stateShadow.recording) return hr;
+	if (SUCCEEDED(hr)) g_stateShadow.vsConstants.Store(startRegister, data, vector4fCount);
+	else g_stateShadow.vsConstants.Invalidate(startRegister, vector4fCount);
+	return hr;
+}
+
+HRESULT STDMETHODCALLTYPE hkSetPixelShaderConstantF(IDirect3DDevice9* device, UINT startRegister, const float* data, UINT vector4fCount) {
+	const HRESULT hr = oSetPixelShaderConstantF(device, startRegister, data, vector4fCount);
+	if (g_stateShadow.recording) return hr;
+	if (SUCCEEDED(hr)) g_stateShadow.psConstants.Store(startRegister, data, vector4fCount);
+	else g_stateShadow.psConstants.Invalidate(startRegister, vector4fCount);
+	return hr;
+}
+
+HRESULT STDMETHODCALLTYPE hkBeginStateBlock(IDirect3DDevice9* device) {
+	const HRESULT hr = oBeginStateBlock(device);
+	if (SUCCEEDED(hr)) g_stateShadow.recording = true;
+	return hr;
+}
+
+HRESULT STDMETHODCALLTYPE hkEndStateBlock(IDirect3DDevice9* device, IDirect3DStateBlock9** ppSB) {
+	const HRESULT hr = oEndStateBlock(device, ppSB);
+	g_stateShadow.recording = false;
+	g_stateShadow.Invalidate();
+	return hr;
+}
+
+// every state block of the runtime shares this one, it rebinds whatever the block captured behind the device hooks
+HRESULT STDMETHODCALLTYPE hkStateBlockApply(IDirect3DStateBlock9* block) {
+	const HRESULT hr = oStateBlockApply(block);
+	g_stateShadow.Invalidate();
+	++g_frameStats.stateBlocks;
+	return hr;
 }
 
 HRESULT STDMETHODCALLTYPE hkSetRenderState(IDirect3DDevice9* device, D3DRENDERSTATETYPE state, DWORD value) {
@@ -212,21 +443,64 @@ HRESULT STDMETHODCALLTYPE hkClear(IDirect3DDevice9* device, DWORD count, const D
 
 HRESULT STDMETHODCALLTYPE hkReset(IDirect3DDevice9* device, D3DPRESENT_PARAMETERS* pPP) {
 	for (auto& cb : g_resetCallbacks) cb(device, pPP);
-	return oReset(device, pPP);
+	g_stateShadow.Invalidate();
+	const HRESULT hr = oReset(device, pPP);
+	g_stateShadow.Invalidate(); // Reset restores the default device state
+	return hr;
 }
 
 int __fastcall CGxDevice__DeviceCreateHk(void* pThis, void* edx, IDirect3DDevice9* dev, int pCreateInfo) {
 	const int result = CGxDevice::DeviceCreateFn(pThis, dev, pCreateInfo);
 	if (result) {
 		if (IDirect3DDevice9* device = GetDevice()) {
+			g_stateShadow.active = false;
+			g_stateShadow.recording = false;
+			g_stateShadow.Invalidate();
 			__try {
 				if (IDirect3DDevice9Vtbl* vtbl = *reinterpret_cast<IDirect3DDevice9Vtbl**>(device)) {
 					DetourTransactionBegin();
 
-					if (!g_presentCallbacks.empty()) {
+					// always hooked, these feed the state shadow
+					if (!oPresent) {
 						oPresent = reinterpret_cast<Present_t>(vtbl->Present);
 						Hooks::Detour(&oPresent, hkPresent);
 					}
+					if (!oSetTexture) {
+						oSetTexture = reinterpret_cast<SetTexture_t>(vtbl->SetTexture);
+						Hooks::Detour(&oSetTexture, hkSetTexture);
+					}
+					if (!oSetSamplerState) {
+						oSetSamplerState = reinterpret_cast<SetSamplerState_t>(vtbl->SetSamplerState);
+						Hooks::Detour(&oSetSamplerState, hkSetSamplerState);
+					}
+					if (!oSetVertexShaderConstantF) {
+						oSetVertexShaderConstantF = reinterpret_cast<SetVertexShaderConstantF_t>(vtbl->SetVertexShaderConstantF);
+						Hooks::Detour(&oSetVertexShaderConstantF, hkSetVertexShaderConstantF);
+					}
+					if (!oSetPixelShaderConstantF) {
+						oSetPixelShaderConstantF = reinterpret_cast<SetPixelShaderConstantF_t>(vtbl->SetPixelShaderConstantF);
+						Hooks::Detour(&oSetPixelShaderConstantF, hkSetPixelShaderConstantF);
+					}
+					if (!oReset) {
+						oReset = reinterpret_cast<Reset_t>(vtbl->Reset);
+						Hooks::Detour(&oReset, hkReset);
+					}
+					if (!oBeginStateBlock) {
+						oBeginStateBlock = reinterpret_cast<BeginStateBlock_t>(vtbl->BeginStateBlock);
+						Hooks::Detour(&oBeginStateBlock, hkBeginStateBlock);
+					}
+					if (!oEndStateBlock) {
+						oEndStateBlock = reinterpret_cast<EndStateBlock_t>(vtbl->EndStateBlock);
+						Hooks::Detour(&oEndStateBlock, hkEndStateBlock);
+					}
+					// Apply lives on the state block vtable, a throwaway block leads to it
+					IDirect3DStateBlock9* probe = nullptr;
+					if (!oStateBlockApply && SUCCEEDED(device->CreateStateBlock(D3DSBT_VERTEXSTATE, &probe)) && probe) {
+						oStateBlockApply = reinterpret_cast<StateBlockApply_t>((*reinterpret_cast<void***>(probe))[STATE_BLOCK_APPLY_SLOT]);
+						Hooks::Detour(&oStateBlockApply, hkStateBlockApply);
+					}
+					if (probe) probe->Release();
+
 					if (!g_beginSceneCallbacks.empty()) {
 						oBeginScene = reinterpret_cast<BeginScene_t>(vtbl->BeginScene);
 						Hooks::Detour(&oBeginScene, hkBeginScene);
@@ -243,10 +517,6 @@ int __fastcall CGxDevice__DeviceCreateHk(void* pThis, void* edx, IDirect3DDevice
 						oDrawIndexedPrimitive = reinterpret_cast<DrawIndexedPrimitive_t>(vtbl->DrawIndexedPrimitive);
 						Hooks::Detour(&oDrawIndexedPrimitive, hkDrawIndexedPrimitive);
 					}
-					if (!g_setTextureCallbacks.empty()) {
-						oSetTexture = reinterpret_cast<SetTexture_t>(vtbl->SetTexture);
-						Hooks::Detour(&oSetTexture, hkSetTexture);
-					}
 					if (!g_setRenderStateCallbacks.empty()) {
 						oSetRenderState = reinterpret_cast<SetRenderState_t>(vtbl->SetRenderState);
 						Hooks::Detour(&oSetRenderState, hkSetRenderState);
@@ -271,11 +541,8 @@ int __fastcall CGxDevice__DeviceCreateHk(void* pThis, void* edx, IDirect3DDevice
 						oClear = reinterpret_cast<Clear_t>(vtbl->Clear);
 						Hooks::Detour(&oClear, hkClear);
 					}
-					if (!g_resetCallbacks.empty()) {
-						oReset = reinterpret_cast<Reset_t>(vtbl->Reset);
-						Hooks::Detour(&oReset, hkReset);
-					}
-					DetourTransactionCommit();
+					// without the Apply hook a state block would leave the shadow stale
+					g_stateShadow.active = DetourTransactionCommit() == NO_ERROR && oStateBlockApply;
 				}
 			}
 			__except (EXCEPTION_EXECUTE_HANDLER) {
@@ -288,17 +555,20 @@ int __fastcall CGxDevice__DeviceCreateHk(void* pThis, void* edx, IDirect3DDevice
 }
 
 int __fastcall CGxDeviceD3d__IDestroyD3dHk(int* pThis) {
+	g_stateShadow.Invalidate();
 	for (auto& cb : g_onDestroyCallbacks) cb();
 	return CGxDevice::IDestroyD3dFn(pThis);
 }
 
 int __fastcall CGxDeviceD3d__IReleaseD3dResourcesHk(void* pThis, void* edx, int res) {
+	g_stateShadow.Invalidate();
 	CleanupManagedResources();
 	for (auto& cb : g_onReleaseCallbacks) cb();
 	return CGxDevice::IReleaseD3dResourcesFn(pThis, res);
 }
 
 int __fastcall CGxDevice__NotifyOnDeviceRestoredHk(void* pThis) {
+	g_stateShadow.Invalidate();
 	RestoreManagedResources();
 	for (auto& cb : g_onRestoreCallbacks) cb();
 	return CGxDevice::NotifyOnDeviceRestoredFn(pThis);
@@ -306,6 +576,7 @@ int __fastcall CGxDevice__NotifyOnDeviceRestoredHk(void* pThis) {
 
 int __fastcall CGxDeviceD3d__DeviceSetFormatHk(char* lpParam, void* edx, const void* GxDeviceFormat) {
 	const int result = CGxDevice::DeviceSetFormatFn(lpParam, GxDeviceFormat);
+	g_stateShadow.Invalidate();
 	RestoreManagedResources();
 	for (auto& cb : g_onRestoreCallbacks) cb();
 	return result;
@@ -321,6 +592,24 @@ void __fastcall CGxDeviceD3d__IShaderCreatePixelHk(int pThis, void* edx, CGxDevi
 	CGxDevice::IShaderCreatePixelFn(pThis, shaderData);
 	for (auto& cb : g_pixelShaderCallbacks) cb(shaderData);
 }
+
+// counts of the last completed frame
+int lua_GetD3DStateCacheStats(lua_State* L) {
+	const StateCacheStats& st = g_lastFrameStats;
+	const uint32_t binds = st.issued + st.filtered;
+	Lua::lua_pushnumber(L, binds ? static_cast<lua_Number>(st.filtered) / static_cast<lua_Number>(binds) : 0.0);
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.issued));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.filtered));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.stateBlocks));
+	Lua::lua_pushboolean(L, g_stateShadow.active);
+	return 5;
+}
+
+int lua_opend3dlib(lua_State* L) {
+	Lua::lua_pushcfunction(L, lua_GetD3DStateCacheStats);
+	Lua::lua_setglobal(L, "GetD3DStateCacheStats");
+	return 0;
+}
 }
 
 std::span<const ShaderEntry> s_shaders{s_shaders_engine};
@@ -367,6 +656,47 @@ void RegisterVertexShaderInit(const VertexShaderInitCallback& callback) { if (ca
 void RegisterPixelShaderInit(const PixelShaderInitCallback& callback) { if (callback) g_pixelShaderCallbacks.push_back(callback); }
 
 
+HRESULT SetTextureCached(IDirect3DDevice9* device, DWORD stage, IDirect3DBaseTexture9* texture) {
+	if (g_stateShadow.IsTrusted() && stage < SHADOW_SAMPLERS && g_stateShadow.texturesValid[stage] && g_stateShadow.textures[stage] == texture) {
+		++g_frameStats.filtered;
+		return D3D_OK;
+	}
+	++g_frameStats.issued;
+	return device->SetTexture(stage, texture);
+}
+
+HRESULT SetSamplerStateCached(IDirect3DDevice9* device, DWORD sampler, D3DSAMPLERSTATETYPE type, DWORD value) {
+	if (g_stateShadow.IsTrusted() && sampler < SHADOW_SAMPLERS && type < SHADOW_SAMPLER_STATES && g_stateShadow.samplerStatesValid[sampler][type] && g_stateShadow.samplerStates[sampler][type] == value) {
+		++g_frameStats.filtered;
+		return D3D_OK;
+	}
+	++g_frameStats.issued;
+	return device->SetSamplerState(sampler, type, value);
+}
+
+HRESULT SetVertexShaderConstantFCached(IDirect3DDevice9* device, UINT startRegister, const float* data, UINT vector4fCount) {
+	if (g_stateShadow.IsTrusted() && g_stateShadow.vsConstants.Matches(startRegister, data, vector4fCount)) {
+		++g_frameStats.filtered;
+		return D3D_OK;
+	}
+	++g_frameStats.issued;
+	return device->SetVertexShaderConstantF(startRegister, data, vector4fCount);
+}
+
+HRESULT SetPixelShaderConstantFCached(IDirect3DDevice9* device, UINT startRegister, const float* data, UINT vector4fCount) {
+	if (g_stateShadow.IsTrusted() && g_stateShadow.psConstants.Matches(startRegister, data, vector4fCount)) {
+		++g_frameStats.filtered;
+		return D3D_OK;
+	}
+	++g_frameStats.issued;
+	return device->SetPixelShaderConstantF(startRegister, data, vector4fCount);
+}
+
+void InvalidateStateCache() { g_stateShadow.Invalidate(); }
+
+StateCacheStats GetStateCacheStats() { return g_lastFrameStats; }
+
+
 IDirect3DDevice9* GetDevice() {
 	__try {
 		const uintptr_t pDevicePtr = *reinterpret_cast<uintptr_t*>(0x00C5DF88);
@@ -380,20 +710,17 @@ IDirect3DDevice9* GetDevice() {
 
 IDirect3DVertexShader9* CompileVertexShader(const ResourceParams& p) {
 	if (p.shaderCode.empty()) return nullptr;
-	ID3DBlob *pCode = nullptr, *pError = nullptr;
-	HRESULT hr = D3DCompile(p.shaderCode.data(), p.shaderCode.size(), nullptr, nullptr, nullptr, p.entryPoint.c_str(), p.target.c_str(), 0, 0, &pCode, &pError);
-	if (FAILED(hr)) {
-		LogShaderError(pError, 1);
-		return nullptr;
-	}
-	IDirect3DVertexShader9* shader = nullptr;
 	IDirect3DDevice9* device = GetDevice();
-	if (!device) {
-		pCode->Release();
-		return nullptr;
+	if (!device) return nullptr;
+	IDirect3DVertexShader9* shader = nullptr;
+	HRESULT hr = E_FAIL;
+	// a cached entry the device turns down is compiled afresh once
+	for (bool recompile : {false, true}) {
+		const std::vector<uint8_t>* bytecode = GetShaderBytecode(p, 1, recompile);
+		if (!bytecode) return nullptr;
+		hr = device->CreateVertexShader(reinterpret_cast<const DWORD*>(bytecode->data()), &shader);
+		if (SUCCEEDED(hr)) break;
 	}
-	hr = device->CreateVertexShader(static_cast<const DWORD*>(pCode->GetBufferPointer()), &shader);
-	pCode->Release();
 	if (SUCCEEDED(hr)) {
 		if (p.autoCleanup && p.ppResourceAddress) {
 			*p.ppResourceAddress = reinterpret_cast<IUnknown*>(shader);
@@ -406,20 +733,17 @@ IDirect3DVertexShader9* CompileVertexShader(const ResourceParams& p) {
 
 IDirect3DPixelShader9* CompilePixelShader(const ResourceParams& p) {
 	if (p.shaderCode.empty()) return nullptr;
-	ID3DBlob *pCode = nullptr, *pError = nullptr;
-	HRESULT hr = D3DCompile(p.shaderCode.data(), p.shaderCode.size(), nullptr, nullptr, nullptr, p.entryPoint.c_str(), p.target.c_str(), 0, 0, &pCode, &pError);
-	if (FAILED(hr)) {
-		LogShaderError(pError, 0);
-		return nullptr;
-	}
-	IDirect3DPixelShader9* shader = nullptr;
 	IDirect3DDevice9* device = GetDevice();
-	if (!device) {
-		pCode->Release();
-		return nullptr;
+	if (!device) return nullptr;
+	IDirect3DPixelShader9* shader = nullptr;
+	HRESULT hr = E_FAIL;
+	// a cached entry the device turns down is compiled afresh once
+	for (bool recompile : {false, true}) {
+		const std::vector<uint8_t>* bytecode = GetShaderBytecode(p, 0, recompile);
+		if (!bytecode) return nullptr;
+		hr = device->CreatePixelShader(reinterpret_cast<const DWORD*>(bytecode->data()), &shader);
+		if (SUCCEEDED(hr)) break;
 	}
-	hr = device->CreatePixelShader(static_cast<const DWORD*>(pCode->GetBufferPointer()), &shader);
-	pCode->Release();
 	if (SUCCEEDED(hr)) {
 		if (p.autoCleanup && p.ppResourceAddress) {
 			*p.ppResourceAddress = reinterpret_cast<IUnknown*>(shader);
@@ -470,6 +794,13 @@ bool CreateRenderTarget(IDirect3DSurface9** ppSurface, ResourceParams p) {
 	}
 	return false;
 }
+
+void DestroyManagedResource(IUnknown** ppResource) {
+	if (!ppResource) return;
+	UnregisterFromCleanup(ppResource);
+	if (*ppResource) (*ppResource)->Release();
+	*ppResource = nullptr;
+}
 }
 
 void D3D::initialize() {
@@ -480,4 +811,5 @@ void D3D::initialize() {
 	Hooks::Detour(&CGxDevice::IReleaseD3dResourcesFn, CGxDeviceD3d__IReleaseD3dResourcesHk);
 	Hooks::Detour(&CGxDevice::IShaderCreateVertexFn, CGxDeviceD3d__IShaderCreateVertexHk);
 	Hooks::Detour(&CGxDevice::IShaderCreatePixelFn, CGxDeviceD3d__IShaderCreatePixelHk);
+	Hooks::FrameXML::registerLuaLib(lua_opend3dlib);
 }
@@ -38,6 +38,12 @@ using CreateTexture_t = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, UINT, UIN
 using SetRenderTarget_t = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, DWORD, IDirect3DSurface9*);
 using Clear_t = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, DWORD, const D3DRECT*, DWORD, D3DCOLOR, float, DWORD);
 using Reset_t = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, D3DPRESENT_PARAMETERS*);
+using SetSamplerState_t = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, DWORD, D3DSAMPLERSTATETYPE, DWORD);
+using SetVertexShaderConstantF_t = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, UINT, const float*, UINT);
+using SetPixelShaderConstantF_t = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, UINT, const float*, UINT);
+using BeginStateBlock_t = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*);
+using EndStateBlock_t = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, IDirect3DStateBlock9**);
+using StateBlockApply_t = HRESULT(STDMETHODCALLTYPE*)(IDirect3DStateBlock9*);
 
 extern Present_t oPresent;
 extern BeginScene_t oBeginScene;
@@ -52,6 +58,12 @@ extern CreateTexture_t oCreateTexture;
 extern SetRenderTarget_t oSetRenderTarget;
 extern Clear_t oClear;
 extern Reset_t oReset;
+extern SetSamplerState_t oSetSamplerState;
+extern SetVertexShaderConstantF_t oSetVertexShaderConstantF;
+extern SetPixelShaderConstantF_t oSetPixelShaderConstantF;
+extern BeginStateBlock_t oBeginStateBlock;
+extern EndStateBlock_t oEndStateBlock;
+extern StateBlockApply_t oStateBlockApply;
 
 void RegisterPresentCallback(const PresentCallback& callback);
 void RegisterBeginSceneCallback(const BeginSceneCallback& callback);
@@ -72,6 +84,22 @@ void RegisterOnDestroy(const ResourceCallback& callback);
 void RegisterOnRelease(const ResourceCallback& callback);
 void RegisterOnRestore(const ResourceCallback& callback);
 
+// shadowed state setters, calls that would not change the currently bound state are dropped
+// the shadow is fed by the device hooks, so engine-side binds are seen as well; it is reset every frame, on Reset, on device loss
+// and whenever a state block is applied. binds recorded into a state block are passed through untouched
+struct StateCacheStats {
+	uint32_t issued = 0;
+	uint32_t filtered = 0;
+	uint32_t stateBlocks = 0; // applied state blocks, each one drops the shadow
+};
+
+HRESULT SetTextureCached(IDirect3DDevice9* device, DWORD stage, IDirect3DBaseTexture9* texture);
+HRESULT SetSamplerStateCached(IDirect3DDevice9* device, DWORD sampler, D3DSAMPLERSTATETYPE type, DWORD value);
+HRESULT SetVertexShaderConstantFCached(IDirect3DDevice9* device, UINT startRegister, const float* data, UINT vector4fCount);
+HRESULT SetPixelShaderConstantFCached(IDirect3DDevice9* device, UINT startRegister, const float* data, UINT vector4fCount);
+void InvalidateStateCache();
+StateCacheStats GetStateCacheStats(); // last completed frame
+
 
 struct ResourceParams {
 	UINT width = 0, height = 0, levels = 1, surfLevel = 0;
@@ -238,4 +266,6 @@ IDirect3DPixelShader9* CompilePixelShader(const ResourceParams& p);
 
 bool CreateTexture(IDirect3DTexture9** ppTexture, ResourceParams p);
 bool CreateRenderTarget(IDirect3DSurface9** ppSurface, ResourceParams p);
+// drops an autoCleanup resource from the restore list and releases it, required before its owner goes away
+void DestroyManagedResource(IUnknown** ppResource);
 }
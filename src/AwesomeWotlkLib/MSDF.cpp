@@ -2,10 +2,16 @@
 #include "MSDFFont.h"
 #include "MSDFCache.h"
 #include "MSDFManager.h"
+#include "MSDFDedup.h"
+#include "MSDFBackground.h"
+#include "MSDFBitmapCache.h"
+#include "MSDFSharedMemory.h"
 #include "MSDFShaders.h"
 #include "Utils.h"
 #include "Hooks.h"
 #include <ranges>
+#include <fstream>
+#include <deque>
 
 namespace {
 uint32_t g_runtimeVBSize = 0;
@@ -48,20 +54,109 @@ enum EMSDFMode : uint32_t {
 };
 
 CVar* s_cvar_MSDFMode;
+CVar* s_cvar_MSDFAtlasBudget;
+CVar* s_cvar_MSDFArenaBudget;
+CVar* s_cvar_MSDFCacheBudget;
+CVar* s_cvar_MSDFCacheDedup;
+CVar* s_cvar_MSDFBitmapCache;
+CVar* s_cvar_MSDFSharedMemory;
+CVar* s_cvar_MSDFWarmupBudget;
+CVar* s_cvar_MSDFBackgroundPregen;
+CVar* s_cvar_MSDFBackgroundIdle;
 EMSDFMode g_MSDFMode = MSDF_ENABLED;
-std::vector<uint8_t> s_prefetchPayload;
+int g_MSDFAtlasBudget = MSDF::MAX_ATLAS_PAGES * MSDF::ATLAS_PAGE_MB;
+int g_MSDFArenaBudget = MSDFManager::DEFAULT_ARENA_BUDGET_MB;
+int g_MSDFCacheBudget = MSDFCache::DEFAULT_CACHE_BUDGET_MB;
+int g_MSDFCacheDedup = 1;
+int g_MSDFBitmapCache = 1;
+int g_MSDFSharedMemory = MSDFSharedMemory::DEFAULT_SIZE_MB;
+int g_MSDFWarmupBudget = MSDFFont::DEFAULT_WARMUP_BUDGET_MS;
+int g_MSDFBackgroundPregen = MSDFBackground::DEFAULT_BUDGET_PERCENT;
+int g_MSDFBackgroundIdle = MSDFBackground::DEFAULT_IDLE_SECONDS;
+CodepointSet s_prefetchPayload;
+
+// replays a chat log through DEFAULT_CHAT_FRAME to stress glyph streaming and atlas eviction
+struct StressReplay {
+	std::deque<std::string> lines;
+	uint32_t linesPerFrame = 8;
+	LARGE_INTEGER lastTick{};
+	double totalMs = 0.0;
+	double peakMs = 0.0;
+	uint32_t frames = 0;
+};
+
+StressReplay s_stressReplay;
+
+// any addon can call the replay, so it only reads plain file names from the client's log and cache folders
+bool IsReplayablePath(std::string_view path) {
+	for (std::string_view dir : {std::string_view("Logs"), std::string_view("Cache_AwesomeWotLK")}) {
+		if (path.size() <= dir.size() + 1 || _strnicmp(path.data(), dir.data(), dir.size()) != 0) continue;
+		if (path[dir.size()] != '\\' && path[dir.size()] != '/') continue;
+		const std::string_view name = path.substr(dir.size() + 1);
+		if (name.find_first_of("\\/:") != std::string_view::npos || name.find("..") != std::string_view::npos) return false;
+		// device names like CON resolve in any folder
+		std::error_code ec;
+		return std::filesystem::is_regular_file(std::filesystem::path(path), ec);
+	}
+	return false;
+}
 
 void __cdecl PrefetchCodepoints(CGxString* pThis) {
-	if (s_prefetchPayload.empty()) return;
-	if (!pThis || reinterpret_cast<uintptr_t>(pThis) & 1) return;
+	if (s_prefetchPayload.Empty()) return;
+	if (!pThis || reinterpret_cast<uintptr_t>(pThis) & 1) {
+		s_prefetchPayload.Clear();
+		return;
+	}
 
-	// sort everything in a batch (no idea if 1 batch == 1 face, though)
+	// everything in a batch, deduplicated and in block order (no idea if 1 batch == 1 face, though)
 	if (MSDFFont* fontHandle = MSDFFont::Get(pThis->GetFontFace())) {
-		std::ranges::sort(s_prefetchPayload);
-		s_prefetchPayload.erase(std::ranges::unique(s_prefetchPayload).begin(), s_prefetchPayload.end());
-		for (uint32_t codepoint : s_prefetchPayload) { fontHandle->GetGlyph(codepoint); }
+		const uint64_t misses = MSDF::g_atlasStats.misses;
+		s_prefetchPayload.Drain([fontHandle](uint32_t codepoint) { fontHandle->GetGlyph(codepoint); });
+		MSDF::g_atlasStats.prefetched += MSDF::g_atlasStats.misses - misses;
+	}
+	else { s_prefetchPayload.Clear(); }
+}
+
+// repeated strings (unit names, damage numbers, timestamps) replay the resolved layout instead of going through glyph lookups and metric math again
+bool ApplyGlyphRun(const GlyphRun* run, TSGrowableArray<CGxFontVertex>& verts) {
+	if (!run) return false;
+
+	// verify first, so a mismatch leaves the quads intact for the full path
+	for (uint32_t q = 0; q < verts.m_count; q += 4) {
+		const CGxFontVertex& v = verts.m_data[q];
+		const uint32_t codepoint = run->quads[q >> 2].codepoint;
+		if (codepoint && (v.u <= 1.0f || static_cast<uint32_t>(v.u - 1.0f) != codepoint)) return false;
+	}
+
+	for (uint32_t q = 0; q < verts.m_count; q += 4) {
+		const GlyphQuad& gq = run->quads[q >> 2];
+		if (!gq.codepoint) continue;
+
+		CGxFontVertex* vBase = &verts.m_data[q];
+		const double newLeft = static_cast<double>(vBase[0].pos.X) + gq.left;
+		const double newRight = newLeft + gq.width;
+		const double newTop = static_cast<double>(vBase[1].pos.Y) + gq.top;
+		const double newBottom = newTop - gq.height;
+
+		vBase[0].pos.X = static_cast<float>(newLeft);
+		vBase[0].pos.Y = static_cast<float>(newBottom);
+		vBase[1].pos.X = static_cast<float>(newLeft);
+		vBase[1].pos.Y = static_cast<float>(newTop);
+		vBase[2].pos.X = static_cast<float>(newRight);
+		vBase[2].pos.Y = static_cast<float>(newBottom);
+		vBase[3].pos.X = static_cast<float>(newRight);
+		vBase[3].pos.Y = static_cast<float>(newTop);
+
+		vBase[0].u = gq.u0;
+		vBase[0].v = gq.v0;
+		vBase[1].u = gq.u0;
+		vBase[1].v = gq.v1;
+		vBase[2].u = gq.u1;
+		vBase[2].v = gq.v0;
+		vBase[3].u = gq.u1;
+		vBase[3].v = gq.v1;
 	}
-	s_prefetchPayload.clear();
+	return true;
 }
 
 void __fastcall ProcessGeometry(CGxString* pThis) {
@@ -82,62 +177,98 @@ void __fastcall ProcessGeometry(CGxString* pThis) {
 	const double fontSizeMult = pThis->m_fontSizeMult;
 	const double fontOffs = !is3d ? ((flags & 8) ? 4.5 : ((flags & 1) ? 2.5 : 0.0)) : 0.0;
 	const double baselineOffs = (fontOffs > 0.0) ? 1.0 : 0.0;
-	const double scale = (is3d ? fontSizeMult : CGxuFont::GetFontEffectiveHeight(is3d, fontSizeMult) * 0.98) / MSDF::SDF_RENDER_SIZE; // 0.98 compensation
-	const double pad = MSDF::SDF_SPREAD * scale;
-
-	for (uint32_t q = 0; q < verts.m_count; q += 4) {
-		CGxFontVertex* vBase = &verts.m_data[q];
-		if (vBase[0].u > 1.0f) {
-			const uint32_t codepoint = vBase[0].u - 1.0f;
-
-			const GlyphMetrics* gm = fontHandle->GetGlyph(codepoint);
-			if (!gm) continue;
-
-			CGxGlyphCacheEntry* entry = fontObj->GetOrCreateGlyphEntry(codepoint);
-			if (!entry) continue;
-
-			CGxFontVertex* vert0 = &vBase[0];
-			CGxFontVertex* vert1 = &vBase[1];
-			CGxFontVertex* vert2 = &vBase[2];
-			CGxFontVertex* vert3 = &vBase[3];
-
-			const double leftOffs = fontObj->GetBearingX(entry, is3d, fontSizeMult);
-			const double bitmapLeft = is3d ? leftOffs : gm->bitmapLeft * scale - leftOffs;
-
-			// no clue where this  + 1.0  comes from, but it works, I guess?..
-			const double newLeft = static_cast<double>(vert0->pos.X) + (bitmapLeft != leftOffs ? bitmapLeft + 1.0 : 0.0) - pad + fontOffs * 0.5;
-			const double newRight = newLeft + (gm->width * scale);
-
-			const double newTop = static_cast<double>(vert1->pos.Y) + (gm->bitmapTop * scale) + pad - baselineOffs;
-			const double newBottom = newTop - (gm->height * scale);
-
-			vert0->pos.X = static_cast<float>(newLeft);
-			vert0->pos.Y = static_cast<float>(newBottom);
-			vert1->pos.X = static_cast<float>(newLeft);
-			vert1->pos.Y = static_cast<float>(newTop);
-			vert2->pos.X = static_cast<float>(newRight);
-			vert2->pos.Y = static_cast<float>(newBottom);
-			vert3->pos.X = static_cast<float>(newRight);
-			vert3->pos.Y = static_cast<float>(newTop);
-
-			const float u0 = gm->u0;
-			const float u1 = gm->u1;
-			const float v0 = gm->v0;
-			const float v1 = gm->v1;
-
-			// encode target msdf atlas page ifx into the sign bits preserving the mantissa part bit-perfect
-			const float uSign = (gm->atlasPageIndex & 1) ? -1.0f : 1.0f;
-			const float vSign = (gm->atlasPageIndex & 2) ? -1.0f : 1.0f;
-
-			vert0->u = u0 * uSign;
-			vert0->v = v0 * vSign;
-			vert1->u = u0 * uSign;
-			vert1->v = v1 * vSign;
-			vert2->u = u1 * uSign;
-			vert2->v = v0 * vSign;
-			vert3->u = u1 * uSign;
-			vert3->v = v1 * vSign;
+	const double targetHeight = is3d ? fontSizeMult : CGxuFont::GetFontEffectiveHeight(is3d, fontSizeMult) * 0.98; // 0.98 compensation
+
+	const uint32_t quadCount = verts.m_count / 4;
+	const uint64_t runKey = MSDFFont::HashGlyphRun(pThis->m_text, quadCount, targetHeight, fontSizeMult, flags, is3d, fontObj);
+
+	const GlyphRun* cachedRun = fontHandle->FindGlyphRun(runKey, quadCount);
+	if (ApplyGlyphRun(cachedRun, verts)) { MSDFFont::TouchPages(cachedRun->pageMask); }
+	else {
+		const size_t evictionsBefore = fontHandle->GetAtlasEvictionCount();
+		GlyphRun* run = fontHandle->CreateGlyphRun(runKey);
+		run->quads.resize(quadCount);
+		bool resolved = true;
+
+		for (uint32_t q = 0; q < verts.m_count; q += 4) {
+			CGxFontVertex* vBase = &verts.m_data[q];
+			if (vBase[0].u > 1.0f) {
+				const uint32_t codepoint = vBase[0].u - 1.0f;
+
+				// the engine quad stays as it is for this draw
+				const GlyphMetrics* gm = fontHandle->GetGlyph(codepoint);
+				if (!gm) {
+					resolved = false;
+					continue;
+				}
+
+				CGxGlyphCacheEntry* entry = fontObj->GetOrCreateGlyphEntry(codepoint);
+				if (!entry) {
+					resolved = false;
+					continue;
+				}
+
+				// glyphs of one string may come from different quality tiers
+				const MSDF::QualityTier& tier = MSDF::GetTier(gm->tier);
+				const double scale = targetHeight / tier.renderSize;
+				const double pad = tier.spread * scale;
+
+				CGxFontVertex* vert0 = &vBase[0];
+				CGxFontVertex* vert1 = &vBase[1];
+				CGxFontVertex* vert2 = &vBase[2];
+				CGxFontVertex* vert3 = &vBase[3];
+
+				const double leftOffs = fontObj->GetBearingX(entry, is3d, fontSizeMult);
+				const double bitmapLeft = is3d ? leftOffs : gm->bitmapLeft * scale - leftOffs;
+
+				// no clue where this  + 1.0  comes from, but it works, I guess?..
+				const double left = (bitmapLeft != leftOffs ? bitmapLeft + 1.0 : 0.0) - pad + fontOffs * 0.5;
+				const double width = gm->width * scale;
+				const double top = (gm->bitmapTop * scale) + pad - baselineOffs;
+				const double height = gm->height * scale;
+
+				const double newLeft = static_cast<double>(vert0->pos.X) + left;
+				const double newRight = newLeft + width;
+
+				const double newTop = static_cast<double>(vert1->pos.Y) + top;
+				const double newBottom = newTop - height;
+
+				vert0->pos.X = static_cast<float>(newLeft);
+				vert0->pos.Y = static_cast<float>(newBottom);
+				vert1->pos.X = static_cast<float>(newLeft);
+				vert1->pos.Y = static_cast<float>(newTop);
+				vert2->pos.X = static_cast<float>(newRight);
+				vert2->pos.Y = static_cast<float>(newBottom);
+				vert3->pos.X = static_cast<float>(newRight);
+				vert3->pos.Y = static_cast<float>(newTop);
+
+				// u and v in [0, 1] - the tier's spread and the target atlas page ride along as integer offsets of 2 * spread and 2 * page,
+				// below 16 the float keeps well under a hundredth of a texel at 2048
+				const float uOffs = 2.0f * static_cast<float>(tier.spread);
+				const float vOffs = 2.0f * static_cast<float>(gm->atlasPageIndex);
+
+				const float u0 = gm->u0 + uOffs;
+				const float u1 = gm->u1 + uOffs;
+				const float v0 = gm->v0 + vOffs;
+				const float v1 = gm->v1 + vOffs;
+
+				vert0->u = u0;
+				vert0->v = v0;
+				vert1->u = u0;
+				vert1->v = v1;
+				vert2->u = u1;
+				vert2->v = v0;
+				vert3->u = u1;
+				vert3->v = v1;
+
+				if (gm->width > 0) run->pageMask |= 1u << gm->atlasPageIndex;
+				run->quads[q >> 2] = {.codepoint = codepoint, .left = left, .top = top, .width = width, .height = height, .u0 = u0, .v0 = v0, .u1 = u1, .v1 = v1};
+			}
 		}
+		// a page got evicted mid-string, the earlier quads may point at the wiped page
+		if (fontHandle->GetAtlasEvictionCount() != evictionsBefore) run->evictionCount = ~0u;
+		// a replay would keep the raw engine quad forever, the glyph may well load on a later frame
+		if (!resolved) fontHandle->DropGlyphRun(runKey);
 	}
 	pThis->m_flags &= ~0x40000000;
 
@@ -174,8 +305,8 @@ void __fastcall CGxString__WriteGeometryHk(CGxString* pThis, void* edx, int dest
 	if (!fontHandle) {
 		if (IDirect3DDevice9* device = D3D::GetDevice()) {
 			constexpr float resetControl[4] = {0, 0, 0, 0};
-			device->SetPixelShaderConstantF(MSDF::SDF_SAMPLER_SLOT, resetControl, 1);
-			device->SetVertexShaderConstantF(MSDF::SDF_SAMPLER_SLOT, resetControl, 1);
+			D3D::SetPixelShaderConstantFCached(device, MSDF::SDF_SAMPLER_SLOT, resetControl, 1);
+			D3D::SetVertexShaderConstantFCached(device, MSDF::SDF_SAMPLER_SLOT, resetControl, 1);
 		}
 		return;
 	}
@@ -183,24 +314,25 @@ void __fastcall CGxString__WriteGeometryHk(CGxString* pThis, void* edx, int dest
 	IDirect3DDevice9* device = D3D::GetDevice();
 	if (!device) return;
 
-	for (uint32_t pageIdx = 0; pageIdx < fontHandle->GetAtlasPageCount(); ++pageIdx) {
-		auto* atlasTexture = fontHandle->GetAtlasPage(pageIdx);
+	// the pages are pooled across fonts, every MSDF string binds all of them
+	for (uint32_t pageIdx = 0; pageIdx < MSDFFont::GetAtlasPageCount(); ++pageIdx) {
+		auto* atlasTexture = MSDFFont::GetAtlasPage(pageIdx);
 		if (atlasTexture && atlasTexture->texture) {
 			uint32_t slot = (/* max d3d9 tex slots */ 15 - MSDF::MAX_ATLAS_PAGES + 1) + pageIdx;
-			device->SetTexture(slot, atlasTexture->texture);
-			device->SetSamplerState(slot, D3DSAMP_ADDRESSU, D3DTADDRESS_CLAMP);
-			device->SetSamplerState(slot, D3DSAMP_ADDRESSV, D3DTADDRESS_CLAMP);
-			device->SetSamplerState(slot, D3DSAMP_MINFILTER, D3DTEXF_LINEAR);
-			device->SetSamplerState(slot, D3DSAMP_MAGFILTER, D3DTEXF_LINEAR);
-			device->SetSamplerState(slot, D3DSAMP_MIPFILTER, D3DTEXF_NONE);
+			D3D::SetTextureCached(device, slot, atlasTexture->texture);
+			D3D::SetSamplerStateCached(device, slot, D3DSAMP_ADDRESSU, D3DTADDRESS_CLAMP);
+			D3D::SetSamplerStateCached(device, slot, D3DSAMP_ADDRESSV, D3DTADDRESS_CLAMP);
+			D3D::SetSamplerStateCached(device, slot, D3DSAMP_MINFILTER, D3DTEXF_LINEAR);
+			D3D::SetSamplerStateCached(device, slot, D3DSAMP_MAGFILTER, D3DTEXF_LINEAR);
+			D3D::SetSamplerStateCached(device, slot, D3DSAMP_MIPFILTER, D3DTEXF_NONE);
 		}
 	}
 
 	const uint32_t flags = pThis->m_fontObj->m_atlasPages[0].m_flags;
 	const bool is3d = pThis->m_flags & 0x80;
 	const float controlFlag[4] = {is3d ? pThis->m_fontObj->m_rasterTargetSize : static_cast<float>(CGxuFont::GetFontEffectiveHeight(is3d, pThis->m_fontSizeMult)), is3d ? 0.0f : ((flags & 8) ? 2.0f : ((flags & 1) ? 1.0f : 0.0f)), MSDF::SDF_SPREAD, MSDF::ATLAS_SIZE};
-	device->SetPixelShaderConstantF(MSDF::SDF_SAMPLER_SLOT, controlFlag, 1);
-	device->SetVertexShaderConstantF(MSDF::SDF_SAMPLER_SLOT, controlFlag, 1);
+	D3D::SetPixelShaderConstantFCached(device, MSDF::SDF_SAMPLER_SLOT, controlFlag, 1);
+	D3D::SetVertexShaderConstantFCached(device, MSDF::SDF_SAMPLER_SLOT, controlFlag, 1);
 }
 
 void __fastcall CGxuFontRenderBatchHk(CGxuFont* pThis) {
@@ -208,8 +340,8 @@ void __fastcall CGxuFontRenderBatchHk(CGxuFont* pThis) {
 	if (IDirect3DDevice9* device = D3D::GetDevice()) {
 		// reset since font PS also handles UI elements
 		constexpr float resetControl[4] = {0, 0, 0, 0};
-		device->SetPixelShaderConstantF(MSDF::SDF_SAMPLER_SLOT, resetControl, 1);
-		device->SetVertexShaderConstantF(MSDF::SDF_SAMPLER_SLOT, resetControl, 1);
+		D3D::SetPixelShaderConstantFCached(device, MSDF::SDF_SAMPLER_SLOT, resetControl, 1);
+		D3D::SetVertexShaderConstantFCached(device, MSDF::SDF_SAMPLER_SLOT, resetControl, 1);
 	}
 }
 
@@ -244,7 +376,8 @@ int __fastcall CGxString__InitializeTextLineHk(CGxString* pThis, void* edx, char
 	// all of thes will then get sorted to ensure sequentiality
 	// == minimal syscall churn @ GetGlyph -> cold cache path == fewer stutters
 	if (pThis->m_flags & 0x40000000) return result;
-	for (char* p = pThis->m_text; *p; ++p) { s_prefetchPayload.push_back(static_cast<uint8_t>(*p)); }
+	// decode, raw utf-8 bytes would prefetch latin-1 junk for every cjk lead byte
+	if (pThis->m_text) s_prefetchPayload.AddUtf8(pThis->m_text, std::strlen(pThis->m_text));
 	pThis->m_flags |= 0x40000000;
 	return result;
 }
@@ -423,13 +556,17 @@ int __cdecl FreeType_NewMemoryFaceHk(FT_Library library, const FT_Byte* file_bas
 int __cdecl FreeType_SetPixelSizesHk(FT_Face face, FT_UInt pixel_width, FT_UInt pixel_height) { return FT_Set_Pixel_Sizes(face, pixel_width, pixel_height); }
 
 int __cdecl FreeType_LoadGlyphHk(FT_Face face, FT_ULong glyph_index, FT_Int32 load_flags) {
-	return FT_Load_Glyph(face, glyph_index, (MSDFFont::Get(face) || load_flags != 8386) ? (FT_LOAD_RENDER | FT_LOAD_NO_HINTING) : (FT_LOAD_RENDER | FT_LOAD_MONOCHROME | FT_LOAD_TARGET_MONO));
+	if (MSDFFont::Get(face)) return FT_Load_Glyph(face, glyph_index, FT_LOAD_RENDER | FT_LOAD_NO_HINTING);
+	return MSDFBitmapCache::LoadGlyph(face, glyph_index, load_flags != 8386 ? (FT_LOAD_RENDER | FT_LOAD_NO_HINTING) : (FT_LOAD_RENDER | FT_LOAD_MONOCHROME | FT_LOAD_TARGET_MONO));
 	// no idea how to map the 2004 bitmask to the modern format, this could be wrong potentially
 }
 
 FT_UInt __cdecl FreeType_GetCharIndexHk(FT_Face face, FT_ULong charcode) { return FT_Get_Char_Index(face, charcode); }
 
-int __cdecl FreeType_GetKerningHk(FT_Face face, FT_UInt left_glyph, FT_UInt right_glyph, FT_UInt kern_mode, FT_Vector* akerning) { return FT_Get_Kerning(face, left_glyph, right_glyph, kern_mode, akerning); }
+int __cdecl FreeType_GetKerningHk(FT_Face face, FT_UInt left_glyph, FT_UInt right_glyph, FT_UInt kern_mode, FT_Vector* akerning) {
+	if (MSDFFont* fontHandle = MSDFFont::Get(face)) return fontHandle->GetKerning(left_glyph, right_glyph, kern_mode, akerning);
+	return FT_Get_Kerning(face, left_glyph, right_glyph, kern_mode, akerning);
+}
 
 int __cdecl FreeType_Done_FaceHk(FT_Face face) {
 	MSDFFont::Unregister(face);
@@ -455,15 +592,9 @@ int __cdecl FreeType_NewFaceHk(int* library, int face_descriptor_ptr) {
 
 int __cdecl FreeType_InitHk(void* memory, FT_Library* alibrary) {
 	if (!MSDF::INITIALIZED) {
-		std::string localeStr = MSDF::GetGameLocale();
-		const char* locale = localeStr.c_str();
-		MSDF::IS_CJK = locale && (strcmp(locale, "zhCN") == 0 || strcmp(locale, "zhTW") == 0 || strcmp(locale, "koKR") == 0);
-
 		MSDF::INITIALIZED = true;
 		MSDF::ALLOW_UNSAFE_FONTS = g_MSDFMode == MSDF_ENABLED_UNSAFE;
 
-		if (MSDF::IS_CJK) return FreeType::InitFn(memory, alibrary);
-
 		DetourTransactionBegin();
 		DetourUpdateThread(GetCurrentThread());
 		Hooks::Detour(&FreeType::NewMemoryFaceFn, FreeType_NewMemoryFaceHk);
@@ -497,7 +628,9 @@ int __cdecl FreeType_InitHk(void* memory, FT_Library* alibrary) {
 		Hooks::Detour(&CGxString::InitializeTextLineFn, CGxString__InitializeTextLineHk);
 		DetourTransactionCommit();
 
-		D3D::RegisterOnDestroy(MSDFFont::ClearAllCache);
+		D3D::RegisterOnDestroy(MSDFFont::OnDeviceDestroy);
+		D3D::RegisterOnRelease(MSDFFont::OnDeviceRelease);
+		D3D::RegisterOnRestore(MSDFFont::OnDeviceRestore);
 
 		D3D::RegisterPixelShaderInit([](CGxDevice::ShaderData* shaderData) {
 			if (shaderData != MSDF::g_FontPixelShader && MSDF::g_FontPixelShader != nullptr) return;
@@ -533,11 +666,8 @@ int __cdecl FreeType_InitHk(void* memory, FT_Library* alibrary) {
 			MSDF::g_FontVertexShader->compilation_flags = 1;
 		}
 
-		s_prefetchPayload.reserve(16383);
-
 		CGxDevice::InitFontIndexBufferFn(); // engine has already run it at this point
 	}
-	else if (MSDF::IS_CJK) { return FreeType::InitFn(memory, alibrary); }
 	if (const FT_Error error = FT_Init_FreeType(&MSDF::g_realFtLibrary)) return error;
 
 	if (alibrary) *alibrary = MSDF::g_realFtLibrary;
@@ -561,6 +691,301 @@ int CVarHandler_MSDFMode(CVar* cvar, const char*, const char* value, void*) {
 	}
 	return 1;
 }
+
+int CVarHandler_MSDFAtlasBudget(CVar* cvar, const char*, const char* value, void*) {
+	cvar->Sync(value, &g_MSDFAtlasBudget, static_cast<int>(MSDF::ATLAS_PAGE_MB), static_cast<int>(MSDF::MAX_ATLAS_PAGES * MSDF::ATLAS_PAGE_MB), "%d");
+	const uint32_t pages = std::clamp(static_cast<uint32_t>(g_MSDFAtlasBudget) / MSDF::ATLAS_PAGE_MB, 1u, MSDF::MAX_ATLAS_PAGES);
+	if (pages < MSDF::ATLAS_BUDGET_PAGES) MSDFFont::ClearAllCache(); // drop the pages above the new budget, strings rebuild on the next frame
+	MSDF::ATLAS_BUDGET_PAGES = pages;
+	return 1;
+}
+
+int CVarHandler_MSDFArenaBudget(CVar* cvar, const char*, const char* value, void*) {
+	cvar->Sync(value, &g_MSDFArenaBudget, static_cast<int>(MSDFManager::MIN_ARENA_BUDGET_MB), static_cast<int>(MSDFManager::MAX_ARENA_BUDGET_MB), "%d");
+	MSDFManager::SetArenaBudget(static_cast<size_t>(g_MSDFArenaBudget) * 1024 * 1024);
+	return 1;
+}
+
+int CVarHandler_MSDFCacheBudget(CVar* cvar, const char*, const char* value, void*) {
+	cvar->Sync(value, &g_MSDFCacheBudget, static_cast<int>(MSDFCache::MIN_CACHE_BUDGET_MB), static_cast<int>(MSDFCache::MAX_CACHE_BUDGET_MB), "%d");
+	MSDFCache::SetCacheBudget(static_cast<uint64_t>(g_MSDFCacheBudget) * 1024 * 1024);
+	return 1;
+}
+
+int CVarHandler_MSDFCacheDedup(CVar* cvar, const char*, const char* value, void*) {
+	cvar->Sync(value, &g_MSDFCacheDedup, 0, 1, "%d");
+	MSDFDedup::SetEnabled(g_MSDFCacheDedup != 0);
+	return 1;
+}
+
+int CVarHandler_MSDFBitmapCache(CVar* cvar, const char*, const char* value, void*) {
+	cvar->Sync(value, &g_MSDFBitmapCache, 0, 1, "%d");
+	MSDFBitmapCache::SetEnabled(g_MSDFBitmapCache != 0);
+	return 1;
+}
+
+int CVarHandler_MSDFSharedMemory(CVar* cvar, const char*, const char* value, void*) {
+	cvar->Sync(value, &g_MSDFSharedMemory, 0, static_cast<int>(MSDFSharedMemory::MAX_SIZE_MB), "%d");
+	MSDFSharedMemory::SetSize(static_cast<uint32_t>(g_MSDFSharedMemory));
+	return 1;
+}
+
+int CVarHandler_MSDFWarmupBudget(CVar* cvar, const char*, const char* value, void*) {
+	cvar->Sync(value, &g_MSDFWarmupBudget, 0, static_cast<int>(MSDFFont::MAX_WARMUP_BUDGET_MS), "%d");
+	MSDFFont::SetWarmupBudget(static_cast<uint32_t>(g_MSDFWarmupBudget));
+	return 1;
+}
+
+int CVarHandler_MSDFBackgroundPregen(CVar* cvar, const char*, const char* value, void*) {
+	cvar->Sync(value, &g_MSDFBackgroundPregen, 0, static_cast<int>(MSDFBackground::MAX_BUDGET_PERCENT), "%d");
+	MSDFBackground::SetBudget(static_cast<uint32_t>(g_MSDFBackgroundPregen));
+	return 1;
 }
 
-void MSDF::initialize() { Hooks::FrameXML::registerCVar(&s_cvar_MSDFMode, "MSDFMode", nullptr, "1", CVarHandler_MSDFMode); };
+int CVarHandler_MSDFBackgroundIdle(CVar* cvar, const char*, const char* value, void*) {
+	cvar->Sync(value, &g_MSDFBackgroundIdle, 0, static_cast<int>(MSDFBackground::MAX_IDLE_SECONDS), "%d");
+	MSDFBackground::SetIdleDelay(static_cast<uint32_t>(g_MSDFBackgroundIdle));
+	return 1;
+}
+
+void CacheCollectorTick() {
+	if (g_MSDFMode != MSDF_DISABLED) MSDFCache::GarbageCollectorTick();
+}
+
+void BackgroundPregenTick() {
+	if (g_MSDFMode != MSDF_DISABLED) MSDFBackground::Tick();
+}
+
+void StressReplayTick() {
+	StressReplay& sr = s_stressReplay;
+	if (sr.lines.empty()) return;
+
+	LARGE_INTEGER now, freq;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&freq);
+	if (sr.lastTick.QuadPart) {
+		const double ms = static_cast<double>(now.QuadPart - sr.lastTick.QuadPart) * 1000.0 / static_cast<double>(freq.QuadPart);
+		sr.totalMs += ms;
+		sr.peakMs = std::max(sr.peakMs, ms);
+		++sr.frames;
+	}
+	sr.lastTick = now;
+
+	lua_State* L = Lua::GetLuaState();
+	Lua::lua_getglobal(L, "DEFAULT_CHAT_FRAME");
+	if (!Lua::lua_istable(L, -1)) {
+		Lua::lua_pop(L, 1);
+		sr.lines.clear();
+		return;
+	}
+	for (uint32_t i = 0; i < sr.linesPerFrame && !sr.lines.empty(); ++i) {
+		Lua::lua_getfield(L, -1, "AddMessage");
+		Lua::lua_pushvalue(L, -2);
+		Lua::lua_pushstring(L, sr.lines.front().c_str());
+		if (Lua::lua_pcall(L, 2, 0, 0) != 0) Lua::lua_pop(L, 1);
+		sr.lines.pop_front();
+	}
+	Lua::lua_pop(L, 1);
+}
+
+int lua_MSDFStressReplay(lua_State* L) {
+	const char* path = Lua::luaL_checkstring(L, 1);
+	if (!IsReplayablePath(path)) return 0;
+	const int linesPerFrame = Lua::lua_isnumber(L, 2) ? static_cast<int>(Lua::lua_tonumber(L, 2)) : 8;
+
+	std::ifstream file(path, std::ios::binary);
+	if (!file) return 0;
+
+	StressReplay& sr = s_stressReplay;
+	sr = {};
+	sr.linesPerFrame = static_cast<uint32_t>(std::clamp(linesPerFrame, 1, 512));
+	for (std::string line; std::getline(file, line);) {
+		if (!line.empty() && line.back() == '\r') line.pop_back();
+		if (!line.empty()) sr.lines.push_back(std::move(line));
+	}
+	MSDF::g_atlasStats = {};
+	MSDF::g_arenaStats = {};
+	MSDF::g_dedupStats = {};
+	MSDF::g_sharedStats = {};
+	MSDF::g_geometryStats.Reset();
+	MSDFFont::ResetGeometryStats();
+	for (MSDF::TierStats& st : MSDF::g_tierStats) st.Reset();
+	MSDF::g_bitmapStats = {};
+	MSDF::g_backgroundStats = {};
+	ScopedFileLock::s_waitMs = 0;
+
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(sr.lines.size()));
+	return 1;
+}
+
+int lua_GetMSDFStats(lua_State* L) {
+	const MSDF::AtlasStats& st = MSDF::g_atlasStats;
+	const StressReplay& sr = s_stressReplay;
+	const uint64_t lookups = st.hits + st.misses;
+
+	Lua::lua_pushnumber(L, lookups ? static_cast<lua_Number>(st.hits) / static_cast<lua_Number>(lookups) : 1.0);
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.hits));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.misses));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.diskLoads));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.generated));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.evictions));
+	Lua::lua_pushnumber(L, sr.frames ? sr.totalMs / sr.frames : 0.0);
+	Lua::lua_pushnumber(L, sr.peakMs);
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(sr.lines.size()));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.warmed));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.prefetched));
+	return 11;
+}
+
+int lua_GetMSDFArenaStats(lua_State* L) {
+	const MSDF::ArenaStats& st = MSDF::g_arenaStats;
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.hits));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.misses));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.evictions));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.remaps));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.checksumFailures));
+	return 5;
+}
+
+int lua_GetMSDFDedupStats(lua_State* L) {
+	const MSDF::DedupStats& st = MSDF::g_dedupStats;
+	// payloads requested per payload actually generated
+	Lua::lua_pushnumber(L, st.sharedStores ? static_cast<lua_Number>(st.sharedHits + st.sharedStores) / static_cast<lua_Number>(st.sharedStores) : 1.0);
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.sharedHits));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.sharedStores));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(MSDFDedup::GetPayloadCount()));
+	return 4;
+}
+
+int lua_GetMSDFSharedStats(lua_State* L) {
+	const MSDF::SharedMemoryStats& st = MSDF::g_sharedStats;
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.hits));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.published));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(MSDFSharedMemory::GetUsedBytes()) / (1024.0 * 1024.0));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(MSDFSharedMemory::GetSizeBytes()) / (1024.0 * 1024.0));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(ScopedFileLock::s_waitMs.load()));
+	return 5;
+}
+
+int lua_GetMSDFGeometryStats(lua_State* L) {
+	// with a family name, only the fonts of that family
+	MSDF::GeometryStats family;
+	if (Lua::lua_isstring(L, 1) && !MSDFFont::GetGeometryStats(Lua::lua_tostring(L, 1), family)) return 0;
+	const MSDF::GeometryStats& st = Lua::lua_isstring(L, 1) ? family : MSDF::g_geometryStats;
+	const uint64_t simple = st.simple.load();
+	const uint64_t resolved = st.resolved.load();
+	Lua::lua_pushnumber(L, simple + resolved ? static_cast<lua_Number>(simple) / static_cast<lua_Number>(simple + resolved) : 0.0);
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(simple));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(resolved));
+	// average geometry pass per glyph, ms
+	Lua::lua_pushnumber(L, simple ? st.simpleMicros.load() / 1000.0 / simple : 0.0);
+	Lua::lua_pushnumber(L, resolved ? st.resolvedMicros.load() / 1000.0 / resolved : 0.0);
+	return 5;
+}
+
+int lua_GetMSDFTierStats(lua_State* L) {
+	const int tier = static_cast<int>(Lua::luaL_checknumber(L, 1)) - 1;
+	if (tier < 0 || tier >= static_cast<int>(MSDF::QUALITY_TIER_COUNT)) return 0;
+	const MSDF::TierStats& st = MSDF::g_tierStats[tier];
+	const uint64_t glyphs = st.glyphs.load();
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(glyphs));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.bytes.load()));
+	// average generation per glyph, ms
+	Lua::lua_pushnumber(L, glyphs ? st.micros.load() / 1000.0 / glyphs : 0.0);
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(MSDF::GetTier(static_cast<uint8_t>(tier)).renderSize));
+	return 4;
+}
+
+int lua_GetMSDFBitmapStats(lua_State* L) {
+	const MSDF::BitmapStats& st = MSDF::g_bitmapStats;
+	const uint64_t loads = st.hits + st.rendered;
+	Lua::lua_pushnumber(L, loads ? static_cast<lua_Number>(st.hits) / static_cast<lua_Number>(loads) : 0.0);
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.hits));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.rendered));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.stored));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(MSDFBitmapCache::GetCacheCount()));
+	return 5;
+}
+
+int lua_GetMSDFBackgroundStats(lua_State* L) {
+	const MSDF::BackgroundStats& st = MSDF::g_backgroundStats;
+	uint32_t fontsDone = 0, fonts = 0;
+	double current = 0.0;
+	MSDFBackground::GetProgress(fontsDone, fonts, current);
+	Lua::lua_pushboolean(L, MSDFBackground::IsRunning());
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.generated));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(st.pauses));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(fontsDone));
+	Lua::lua_pushnumber(L, static_cast<lua_Number>(fonts));
+	Lua::lua_pushnumber(L, current);
+	return 6;
+}
+
+void PrintToChat(lua_State* L, const char* text) {
+	Lua::lua_getglobal(L, "DEFAULT_CHAT_FRAME");
+	if (Lua::lua_istable(L, -1)) {
+		Lua::lua_getfield(L, -1, "AddMessage");
+		Lua::lua_pushvalue(L, -2);
+		Lua::lua_pushstring(L, text);
+		if (Lua::lua_pcall(L, 2, 0, 0) != 0) Lua::lua_pop(L, 1);
+	}
+	Lua::lua_pop(L, 1);
+}
+
+// rewrites every font's cache and may wait seconds on another client's locks, so it is a typed and confirmed command
+int MSDFPackCommand(lua_State* L) {
+	const char* arg = Lua::lua_isstring(L, 1) ? Lua::lua_tostring(L, 1) : "";
+	if (_stricmp(arg, "confirm") != 0) {
+		PrintToChat(L, "MSDF: packs the glyph cache of every loaded font into archives, the game may freeze for a few seconds. Type /msdfpack confirm to go ahead.");
+		return 0;
+	}
+	uint32_t glyphs = 0;
+	const uint32_t archives = MSDFFont::PackArchives(glyphs);
+	char buf[128];
+	snprintf(buf, sizeof(buf), "MSDF: packed %u glyphs into %u archives.", glyphs, archives);
+	PrintToChat(L, buf);
+	return 0;
+}
+
+void OnEnterWorld() { Lua::RegisterSlashCommand("MSDFPACK", "/msdfpack", MSDFPackCommand); }
+
+int lua_openmsdflib(lua_State* L) {
+	Lua::lua_pushcfunction(L, lua_GetMSDFStats);
+	Lua::lua_setglobal(L, "GetMSDFStats");
+	Lua::lua_pushcfunction(L, lua_GetMSDFArenaStats);
+	Lua::lua_setglobal(L, "GetMSDFArenaStats");
+	Lua::lua_pushcfunction(L, lua_GetMSDFDedupStats);
+	Lua::lua_setglobal(L, "GetMSDFDedupStats");
+	Lua::lua_pushcfunction(L, lua_GetMSDFSharedStats);
+	Lua::lua_setglobal(L, "GetMSDFSharedStats");
+	Lua::lua_pushcfunction(L, lua_GetMSDFGeometryStats);
+	Lua::lua_setglobal(L, "GetMSDFGeometryStats");
+	Lua::lua_pushcfunction(L, lua_GetMSDFTierStats);
+	Lua::lua_setglobal(L, "GetMSDFTierStats");
+	Lua::lua_pushcfunction(L, lua_GetMSDFBitmapStats);
+	Lua::lua_setglobal(L, "GetMSDFBitmapStats");
+	Lua::lua_pushcfunction(L, lua_GetMSDFBackgroundStats);
+	Lua::lua_setglobal(L, "GetMSDFBackgroundStats");
+	Lua::lua_pushcfunction(L, lua_MSDFStressReplay);
+	Lua::lua_setglobal(L, "MSDFStressReplay");
+	return 0;
+}
+}
+
+void MSDF::initialize() {
+	Hooks::FrameXML::registerCVar(&s_cvar_MSDFMode, "MSDFMode", nullptr, "1", CVarHandler_MSDFMode);
+	Hooks::FrameXML::registerCVar(&s_cvar_MSDFAtlasBudget, "MSDFAtlasBudget", nullptr, "64", CVarHandler_MSDFAtlasBudget);
+	Hooks::FrameXML::registerCVar(&s_cvar_MSDFArenaBudget, "MSDFArenaBudget", nullptr, "64", CVarHandler_MSDFArenaBudget);
+	Hooks::FrameXML::registerCVar(&s_cvar_MSDFCacheBudget, "MSDFCacheBudget", nullptr, "512", CVarHandler_MSDFCacheBudget);
+	Hooks::FrameXML::registerCVar(&s_cvar_MSDFCacheDedup, "MSDFCacheDedup", nullptr, "1", CVarHandler_MSDFCacheDedup);
+	Hooks::FrameXML::registerCVar(&s_cvar_MSDFBitmapCache, "MSDFBitmapCache", nullptr, "1", CVarHandler_MSDFBitmapCache);
+	Hooks::FrameXML::registerCVar(&s_cvar_MSDFSharedMemory, "MSDFSharedMemory", nullptr, "0", CVarHandler_MSDFSharedMemory);
+	Hooks::FrameXML::registerCVar(&s_cvar_MSDFWarmupBudget, "MSDFWarmupBudget", nullptr, "50", CVarHandler_MSDFWarmupBudget);
+	Hooks::FrameXML::registerCVar(&s_cvar_MSDFBackgroundPregen, "MSDFBackgroundPregen", nullptr, "25", CVarHandler_MSDFBackgroundPregen);
+	Hooks::FrameXML::registerCVar(&s_cvar_MSDFBackgroundIdle, "MSDFBackgroundIdle", nullptr, "60", CVarHandler_MSDFBackgroundIdle);
+	Hooks::FrameXML::registerLuaLib(lua_openmsdflib);
+	Hooks::FrameScript::registerOnEnter(OnEnterWorld);
+	Hooks::FrameScript::registerOnUpdate(StressReplayTick);
+	Hooks::FrameScript::registerOnUpdate(CacheCollectorTick);
+	Hooks::FrameScript::registerOnUpdate(BackgroundPregenTick);
+};
@@ -9,6 +9,8 @@
 #include <msdfgen.h>
 #include <msdfgen-ext.h>
 
+#include <atomic>
+
 struct GlyphMetrics {
 	uint16_t width = 0;
 	uint16_t height = 0;
@@ -16,6 +18,8 @@ struct GlyphMetrics {
 	FT_Int bitmapLeft = 0;
 	float u0 = 0.0f, v0 = 0.0f, u1 = 0.0f, v1 = 0.0f;
 	uint16_t atlasPageIndex = 0;
+	uint8_t tier = 0;
+	uint8_t uses = 0; // lookups this session, saturating, feeds the warmup profile
 	const uint8_t* pixelData = nullptr;
 };
 
@@ -25,8 +29,11 @@ struct GlyphMetricsToStore {
 	uint16_t height = 0;
 	FT_Int bitmapTop = 0;
 	FT_Int bitmapLeft = 0;
+	uint8_t tier = 0;
 	std::vector<uint8_t> ownedPixelData;
 	uint32_t dataSize = 0;
+	uint32_t sharedId = 0;    // MSDFDedup payload the glyph refers to, 0 - pixels stored with the glyph
+	uint64_t outlineHash = 0; // MSDFDedup key, 0 - not shareable
 };
 
 class MSDFCache;
@@ -49,9 +56,80 @@ inline CGxDevice::ShaderData*& g_FontVertexShader = *reinterpret_cast<CGxDevice:
 inline FT_Library g_realFtLibrary = nullptr;
 inline msdfgen::FreetypeHandle* g_msdfFreetype = nullptr;
 
-inline constexpr uint32_t MAX_ATLAS_PAGES = 4;
+inline constexpr uint32_t MAX_ATLAS_PAGES = 8; // bound to samplers s8 - s15, the font shader keeps s0 for the game texture
+inline constexpr size_t CJK_CACHE_THRESHOLD = 20000;
+inline constexpr uint32_t ATLAS_PAGE_MB = ATLAS_SIZE * ATLAS_SIZE * 4 / (1024 * 1024);
+inline uint32_t ATLAS_BUDGET_PAGES = MAX_ATLAS_PAGES; // shared by every font, driven by MSDFAtlasBudget
+
+struct AtlasStats {
+	uint64_t hits = 0;      // resolved from the in-memory glyph pool
+	uint64_t misses = 0;    // had to be streamed in or generated
+	uint64_t diskLoads = 0; // streamed from the disk cache
+	uint64_t generated = 0; // rendered from the outline
+	uint64_t evictions = 0; // atlas pages recycled
+	uint64_t warmed = 0;    // uploaded up front from the warmup profile
+	uint64_t prefetched = 0; // misses resolved by the text prefetch before the string was laid out
+};
+
+inline AtlasStats g_atlasStats;
+
+struct ArenaStats {
+	uint64_t hits = 0;      // block already mapped in an arena slot
+	uint64_t misses = 0;    // block had to be mapped
+	uint64_t evictions = 0; // least recently used slot unmapped to make room
+	uint64_t remaps = 0;    // misses on blocks verified earlier in the session
+	uint64_t checksumFailures = 0; // blocks whose tables failed CRC32C and fell back to per-entry validation
+};
+
+inline ArenaStats g_arenaStats;
+
+struct DedupStats {
+	uint64_t sharedHits = 0;   // payloads reused from the shared store instead of generated
+	uint64_t sharedStores = 0; // payloads generated and added to the shared store
+};
+
+inline DedupStats g_dedupStats;
+
+struct SharedMemoryStats {
+	uint64_t hits = 0;      // glyphs taken from another client's shared memory store
+	uint64_t published = 0; // glyphs this client added to the shared memory store
+};
+
+inline SharedMemoryStats g_sharedStats;
+
+// written from the pregen workers as well, hence atomic
+struct GeometryStats {
+	std::atomic<uint64_t> simple{0};         // outlines that needed no resolution and skipped the Skia pass
+	std::atomic<uint64_t> resolved{0};       // outlines simplified through Skia
+	std::atomic<uint64_t> simpleMicros{0};   // classification of the simple outlines
+	std::atomic<uint64_t> resolvedMicros{0}; // classification and the Skia pass of the resolved ones
+
+	void Reset() { simple = 0; resolved = 0; simpleMicros = 0; resolvedMicros = 0; }
+	void Add(const GeometryStats& other) {
+		simple += other.simple;
+		resolved += other.resolved;
+		simpleMicros += other.simpleMicros;
+		resolvedMicros += other.resolvedMicros;
+	}
+};
+
+inline GeometryStats g_geometryStats;
+
+struct BitmapStats {
+	uint64_t hits = 0;     // engine bitmaps served from the bitmap cache
+	uint64_t rendered = 0; // rasterized by FreeType
+	uint64_t stored = 0;   // rasterized and added to the bitmap cache
+};
+
+inline BitmapStats g_bitmapStats;
+
+struct BackgroundStats {
+	uint64_t generated = 0; // glyphs rendered by the idle-time workers and stored
+	uint64_t pauses = 0;    // times the workers were held for combat, frame time or activity
+};
+
+inline BackgroundStats g_backgroundStats;
 
-inline bool IS_CJK = false;
 inline bool INITIALIZED = false;
 inline bool ALLOW_UNSAFE_FONTS = false; // due to how distance fields are calculated, some fonts with self-intersecting contours (e.g. diediedie) will break
 
@@ -62,10 +140,66 @@ inline const bool IS_WIN10 = []() {
 	return (GetProcAddress(hKernel, "VirtualAlloc2") != nullptr && GetProcAddress(hKernel, "MapViewOfFile3") != nullptr && GetProcAddress(hKernel, "UnmapViewOfFile2") != nullptr);
 }();
 
+// quality tiers, spread scales with the render size so every tier keeps the same distance range per em
+// the tier index is stored in the disk cache - changing this table requires a cache version bump
+struct QualityTier {
+	uint32_t renderSize;
+	uint32_t spread;
+};
+
+inline constexpr QualityTier QUALITY_TIERS[] = {
+	{SDF_RENDER_SIZE, SDF_SPREAD},                                // latin, cyrillic, display text
+	{SDF_RENDER_SIZE * 3 / 4, SDF_SPREAD * 3 / 4},                // ideographs, kana
+	{SDF_RENDER_SIZE / 2, SDF_SPREAD / 2},                        // hangul syllables, jamo, radicals, bopomofo
+};
+inline constexpr uint32_t QUALITY_TIER_COUNT = sizeof(QUALITY_TIERS) / sizeof(QUALITY_TIERS[0]);
+
+inline uint8_t GetQualityTier(uint32_t codepoint) {
+	if ((codepoint >= 0x3040 && codepoint <= 0x30FF)      // kana
+		|| (codepoint >= 0x3400 && codepoint <= 0x4DBF)   // ext A
+		|| (codepoint >= 0x4E00 && codepoint <= 0x9FFF)   // unified ideographs
+		|| (codepoint >= 0xF900 && codepoint <= 0xFAFF)   // compat ideographs
+		|| (codepoint >= 0x20000 && codepoint <= 0x3134F) // ext B-G
+	) return 1;
+	if ((codepoint >= 0x1100 && codepoint <= 0x11FF)      // jamo
+		|| (codepoint >= 0x2E80 && codepoint <= 0x2FDF)   // radicals
+		|| (codepoint >= 0x3100 && codepoint <= 0x31BF)   // bopomofo, compat jamo
+		|| (codepoint >= 0xAC00 && codepoint <= 0xD7AF)   // hangul syllables
+	) return 2;
+	return 0;
+}
+
+inline const QualityTier& GetTier(uint8_t tier) { return QUALITY_TIERS[tier < QUALITY_TIER_COUNT ? tier : 0]; }
+
+// measured per tier, written from the background workers as well, hence atomic
+struct TierStats {
+	std::atomic<uint64_t> glyphs{0}; // generated at the tier
+	std::atomic<uint64_t> bytes{0};  // payload those produced
+	std::atomic<uint64_t> micros{0}; // whole generation, outline to packed texels
+
+	void Reset() { glyphs = 0; bytes = 0; micros = 0; }
+};
+
+inline TierStats g_tierStats[QUALITY_TIER_COUNT];
+
 inline std::string GetGameLocale() {
 	CVar* locale = CVar::Get("locale");
 	return (locale && locale->m_str) ? locale->m_str : std::string{};
 }
 
+struct CodepointRange {
+	uint32_t first;
+	uint32_t last;
+	const char* name;
+};
+
+// standard pre-generation range of the client locale, also what a font is validated against
+inline CodepointRange GetLocaleRange(const std::string& locale) {
+	if (locale == "zhCN" || locale == "zhTW") return {0x0020, 0x9FFF, "CJK Unified Ideographs (Chinese)"};
+	if (locale == "koKR") return {0x0020, 0xD7AF, "Hangul Syllables (Korean)"};
+	if (locale == "ruRU") return {0x0020, 0x04FF, "Cyrillic (Russian)"};
+	return {0x0020, 0x00FF, "Basic Latin / Extended ASCII"};
+}
+
 void initialize();
 };
@@ -0,0 +1,397 @@
+#include "MSDFBackground.h"
+#include "MSDFFont.h"
+#include "MSDFDedup.h"
+#include "Lua.h"
+#include <ranges>
+
+namespace {
+	bool CallLuaPredicate(lua_State* L, const char* name, const char* unit = nullptr) {
+		Lua::lua_getglobal(L, name);
+		if (!Lua::lua_isfunction(L, -1)) {
+			Lua::lua_pop(L, 1);
+			return false;
+		}
+		if (unit) Lua::lua_pushstring(L, unit);
+		if (Lua::lua_pcall(L, unit ? 1 : 0, 1, 0) != 0) {
+			Lua::lua_pop(L, 1);
+			return false;
+		}
+		const bool result = Lua::lua_toboolean(L, -1);
+		Lua::lua_pop(L, 1);
+		return result;
+	}
+}
+
+void MSDFBackground::Register(FT_Face face, const FT_Byte* data, FT_Long size, FT_Long faceIndex, FontHash fontHash) {
+	if (!face || !data || size <= 0 || !fontHash) return;
+	if (!s_range.name) s_range = MSDF::GetLocaleRange(MSDF::GetGameLocale());
+	s_faces[face] = {.data = data, .size = size, .faceIndex = faceIndex, .fontHash = fontHash};
+	s_progress.try_emplace(fontHash);
+}
+
+void MSDFBackground::Unregister(FT_Face face) {
+	if (!s_faces.contains(face)) return;
+	// a worker may be rendering from this face's data or still hold a face opened on it
+	StopWorkers(true);
+	s_faces.erase(face);
+}
+
+void MSDFBackground::Tick() {
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	if (s_lastFrame.QuadPart) {
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+		const double ms = static_cast<double>(now.QuadPart - s_lastFrame.QuadPart) * 1000.0 / static_cast<double>(freq.QuadPart);
+		s_frameMs += (ms - s_frameMs) * FRAME_SMOOTHING;
+	}
+	s_lastFrame = now;
+
+	DrainResults();
+	// workers told to stop are reaped once the last one is out, none start before that
+	if (s_stop) {
+		StopWorkers(false);
+		return;
+	}
+	if (!s_budgetPercent || s_progress.empty()) {
+		StopWorkers(false);
+		return;
+	}
+
+	// combat holds the workers on the frame it starts, the rest is polled
+	const ULONGLONG tick = GetTickCount64();
+	if (tick - s_lastIdlePoll >= IDLE_POLL_MS) {
+		s_lastIdlePoll = tick;
+		s_idle = IsPlayerIdle();
+	}
+	const uint32_t percent = s_idle && !CGGameUI::InCombatLockdown() ? GetWorkerPercent() : 0;
+	if (!percent) {
+		SetActivePercent(0);
+		return;
+	}
+
+	if (s_workers.empty()) {
+		if (!std::ranges::any_of(s_progress, [](const auto& entry) { return !entry.second.done && FindFont(entry.first); })) return;
+		StartWorkers();
+	}
+	SetActivePercent(percent);
+	if (!QueueJobs()) StopWorkers(false);
+}
+
+bool MSDFBackground::IsPlayerIdle() {
+	DWORD processId = 0;
+	GetWindowThreadProcessId(GetForegroundWindow(), &processId);
+	s_foreground = processId == GetCurrentProcessId();
+	if (!s_foreground) return true;
+
+	LASTINPUTINFO input{sizeof(LASTINPUTINFO), 0};
+	if (GetLastInputInfo(&input) && GetTickCount() - input.dwTime >= s_idleSeconds * 1000) return true;
+
+	// flagged away, or resting in an inn or a city
+	lua_State* L = Lua::GetLuaState();
+	return L && (CallLuaPredicate(L, "UnitIsAFK", "player") || CallLuaPredicate(L, "IsResting"));
+}
+
+uint32_t MSDFBackground::GetWorkerCount() {
+	const uint32_t cores = std::max(1u, std::thread::hardware_concurrency());
+	return std::clamp((cores * std::min(s_budgetPercent, MAX_BUDGET_PERCENT) + 99) / 100, 1u, cores);
+}
+
+uint32_t MSDFBackground::GetWorkerPercent() {
+	const uint32_t cores = std::max(1u, std::thread::hardware_concurrency());
+	const uint32_t workers = s_workers.empty() ? GetWorkerCount() : static_cast<uint32_t>(s_workers.size());
+	uint32_t percent = std::clamp(std::min(s_budgetPercent, MAX_BUDGET_PERCENT) * cores / workers, 1u, 100u);
+	// nobody is looking at a game in the background, its frame rate is capped anyway
+	if (!s_foreground) return percent;
+	if (s_frameMs >= MAX_FRAME_MS) return 0;
+	if (s_frameMs > RELAXED_FRAME_MS) percent = std::max(1u, static_cast<uint32_t>(percent * (MAX_FRAME_MS - s_frameMs) / (MAX_FRAME_MS - RELAXED_FRAME_MS)));
+	return percent;
+}
+
+void MSDFBackground::SetActivePercent(uint32_t percent) {
+	const uint32_t previous = s_activePercent.load();
+	if (percent == previous) return;
+	if (!percent) ++MSDF::g_backgroundStats.pauses;
+	// not under the lock, a preempted idle priority worker may be holding it. a wakeup lost this way is caught by the workers' poll
+	s_activePercent = percent;
+	if (!previous) s_wake.notify_all();
+}
+
+void MSDFBackground::StartWorkers() {
+	s_stop = false;
+	const uint32_t count = GetWorkerCount();
+	s_runningWorkers = count;
+	s_workers.reserve(count);
+	for (uint32_t i = 0; i < count; ++i) s_workers.emplace_back(WorkerMain);
+}
+
+void MSDFBackground::StopWorkers(bool wait) {
+	if (s_workers.empty()) return;
+	// not under the lock, like SetActivePercent. a wakeup lost this way is caught by the workers' poll
+	if (!s_stop.exchange(true)) {
+		s_activePercent = 0;
+		s_wake.notify_all();
+	}
+	// each worker finishes at most the glyph it is on, only font data about to be freed is worth a stalled frame
+	if (!wait && s_runningWorkers.load()) return;
+	for (std::thread& worker : s_workers) worker.join();
+	s_workers.clear();
+	s_stop = false;
+
+	DrainResults();
+	s_queue.clear();
+	for (auto& [fontHash, progress] : s_progress) {
+		if (!progress.inFlight.empty()) {
+			progress.cursor = std::ranges::min(progress.inFlight);
+			progress.inFlight.clear();
+		}
+		SaveProgress(fontHash, progress, true);
+	}
+}
+
+bool MSDFBackground::QueueJobs() {
+	size_t queued = 0;
+	{
+		// the main thread never waits on the workers, the next frame simply tries again
+		std::unique_lock lock(s_mutex, std::try_to_lock);
+		if (!lock) return true;
+		queued = s_queue.size();
+	}
+	const size_t depth = s_workers.size() * JOBS_PER_WORKER;
+
+	bool pending = false;
+	uint32_t scanned = 0;
+	Progress* batchProgress = nullptr;
+	std::vector<std::unique_ptr<Job>> batch;
+	for (auto& [fontHash, progress] : s_progress) {
+		if (progress.done) continue;
+		const FaceSource* source = nullptr;
+		MSDFFont* font = FindFont(fontHash, &source);
+		if (!font) continue;
+		pending = true;
+		// a manifest that cannot be read now would be retried for every codepoint
+		if (!font->m_cache->m_manifestLoaded && !font->m_cache->LoadManifest(MANIFEST_TIMEOUT_MS)) break;
+
+		if (!progress.loaded) {
+			progress.loaded = true;
+			if (!font->m_cache->LoadPregenCursor(s_range, progress.cursor)) progress.cursor = s_range.first;
+			progress.saved = progress.cursor;
+		}
+
+		while (queued + batch.size() < depth && progress.cursor <= s_range.last && scanned < MAX_SCAN_PER_TICK) {
+			auto job = std::make_unique<Job>();
+			job->fontHash = fontHash;
+			job->source = *source;
+			job->first = progress.cursor;
+			// codepoints the font lacks and glyphs cached already cost nothing later either
+			while (progress.cursor <= s_range.last && job->codepoints.size() < JOB_GLYPHS && scanned < MAX_SCAN_PER_TICK) {
+				const uint32_t codepoint = progress.cursor++;
+				++scanned;
+				if (FT_Get_Char_Index(font->m_ftFace, codepoint) && !font->m_cache->Contains(codepoint)) job->codepoints.push_back(codepoint);
+			}
+			if (!job->codepoints.empty()) batch.push_back(std::move(job));
+		}
+
+		if (batch.empty() && progress.cursor > s_range.last && progress.inFlight.empty()) {
+			progress.done = true;
+			SaveProgress(fontHash, progress, true);
+			continue;
+		}
+		// one font at a time, its blocks fill up in order
+		batchProgress = &progress;
+		break;
+	}
+	if (batch.empty()) return pending;
+
+	std::unique_lock lock(s_mutex, std::try_to_lock);
+	if (!lock) {
+		batchProgress->cursor = batch.front()->first;
+		return true;
+	}
+	for (auto& job : batch) {
+		batchProgress->inFlight.push_back(job->first);
+		s_queue.push_back(std::move(job));
+	}
+	lock.unlock();
+	s_wake.notify_all();
+	return true;
+}
+
+void MSDFBackground::DrainResults() {
+	std::vector<std::unique_ptr<Job>> done;
+	{
+		std::unique_lock lock(s_mutex, std::try_to_lock);
+		if (!lock) return;
+		done.swap(s_done);
+	}
+	for (const auto& job : done) {
+		const bool stored = StoreResults(*job);
+		auto it = s_progress.find(job->fontHash);
+		if (it == s_progress.end()) continue;
+		Progress& progress = it->second;
+		// an interrupted or unstored job stays in flight, StopWorkers rewinds the cursor to it
+		if (job->complete && stored) {
+			auto fit = std::ranges::find(progress.inFlight, job->first);
+			if (fit != progress.inFlight.end()) progress.inFlight.erase(fit);
+		}
+		SaveProgress(it->first, progress, false);
+	}
+}
+
+bool MSDFBackground::StoreResults(Job& job) {
+	MSDFFont* font = FindFont(job.fontHash);
+	if (!font) return true;
+	font->m_geometryStats.Add(job.geometry);
+	if (!font->m_cache->m_manifestLoaded && !font->m_cache->LoadManifest(MANIFEST_TIMEOUT_MS)) return false;
+
+	for (GlyphMetricsToStore& storage : job.results) {
+		// the session may have needed it in the meantime
+		if (font->m_cache->Contains(storage.codepoint)) continue;
+
+		// same payload sharing as a glyph generated on demand, the hash needs the engine's face so it is taken here
+		if (storage.dataSize && MSDFDedup::IsEnabled()) {
+			const FT_UInt glyphIndex = FT_Get_Char_Index(font->m_ftFace, storage.codepoint);
+			storage.outlineHash = MSDFDedup::HashOutline(font->m_ftFace, glyphIndex, MSDF::GetTier(storage.tier), storage.width, storage.height, storage.bitmapLeft, storage.bitmapTop);
+			const uint8_t* pixels = nullptr;
+			if (storage.outlineHash && (storage.sharedId = MSDFDedup::Find(storage.outlineHash, storage.width, storage.height, pixels))) ++MSDF::g_dedupStats.sharedHits;
+			else if (storage.outlineHash) storage.sharedId = MSDFDedup::Store(storage.outlineHash, storage);
+			if (storage.sharedId) {
+				storage.ownedPixelData = {};
+				storage.dataSize = 0;
+			}
+		}
+		if (font->m_cache->StoreGlyph(std::move(storage))) ++MSDF::g_backgroundStats.generated;
+	}
+	return true;
+}
+
+void MSDFBackground::SaveProgress(FontHash fontHash, Progress& progress, bool force) {
+	if (!progress.loaded) return;
+	const uint32_t cursor = progress.inFlight.empty() ? progress.cursor : std::ranges::min(progress.inFlight);
+	if (cursor == progress.saved) return;
+	const ULONGLONG now = GetTickCount64();
+	if (!force && now - s_lastSave < SAVE_INTERVAL_MS) return;
+
+	MSDFFont* font = FindFont(fontHash);
+	if (!font) return;
+	// the cursor must never run ahead of what is on disk
+	if (!font->m_cache->FlushPendingWrites() || !font->m_cache->SavePregenCursor(s_range, cursor)) return;
+	progress.saved = cursor;
+	s_lastSave = now;
+}
+
+MSDFFont* MSDFBackground::FindFont(FontHash fontHash, const FaceSource** outSource) {
+	for (const auto& [face, source] : s_faces) {
+		if (source.fontHash != fontHash) continue;
+		MSDFFont* font = MSDFFont::Get(face);
+		if (!font || !font->m_cache) continue;
+		if (outSource) *outSource = &source;
+		return font;
+	}
+	return nullptr;
+}
+
+void MSDFBackground::WorkerMain() {
+	FinalAction exited([] { --s_runningWorkers; });
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_IDLE);
+	// FreeType objects must not be shared across threads, every worker opens the font again from the engine's data
+	FT_Library library = nullptr;
+	if (FT_Init_FreeType(&library) != 0) return;
+
+	FT_Face face = nullptr;
+	msdfgen::FontHandle* font = nullptr;
+	const FT_Byte* openData = nullptr;
+	FT_Long openIndex = 0;
+	auto closeFace = [&]() {
+		if (font) msdfgen::destroyFont(font);
+		if (face) FT_Done_Face(face);
+		font = nullptr;
+		face = nullptr;
+		openData = nullptr;
+	};
+
+	while (true) {
+		std::unique_ptr<Job> job;
+		{
+			std::unique_lock lock(s_mutex);
+			while (!s_wake.wait_for(lock, WAKE_POLL, [] { return s_stop.load() || (s_activePercent.load() && !s_queue.empty()); }));
+			if (s_stop) break;
+			job = std::move(s_queue.front());
+			s_queue.pop_front();
+		}
+
+		if (job->source.data != openData || job->source.faceIndex != openIndex) {
+			closeFace();
+			if (FT_New_Memory_Face(library, job->source.data, job->source.size, job->source.faceIndex, &face) == 0) font = msdfgen::adoptFreetypeFont(face);
+			else face = nullptr;
+			openData = job->source.data;
+			openIndex = job->source.faceIndex;
+		}
+
+		job->complete = true;
+		for (uint32_t codepoint : job->codepoints) {
+			if (!WaitWhilePaused()) {
+				job->complete = false;
+				break;
+			}
+			const auto start = std::chrono::steady_clock::now();
+			GlyphMetricsToStore storage;
+			FT_UInt glyphIndex = 0;
+			uint16_t sdfW = 0, sdfH = 0;
+			if (font && MSDFFont::MeasureGlyph(face, codepoint, storage, glyphIndex, sdfW, sdfH)) {
+				if (sdfW && sdfH && MSDFFont::GenerateMSDF(font, storage.ownedPixelData, codepoint, sdfW, sdfH, MSDF::GetTier(storage.tier).spread, job->geometry)) {
+					storage.width = sdfW;
+					storage.height = sdfH;
+					storage.dataSize = static_cast<uint32_t>(storage.ownedPixelData.size());
+				}
+				job->results.push_back(std::move(storage));
+			}
+			Rest(std::chrono::steady_clock::now() - start);
+		}
+
+		std::lock_guard lock(s_mutex);
+		s_done.push_back(std::move(job));
+	}
+
+	closeFace();
+	FT_Done_FreeType(library);
+}
+
+bool MSDFBackground::WaitWhilePaused() {
+	std::unique_lock lock(s_mutex);
+	while (!s_wake.wait_for(lock, WAKE_POLL, [] { return s_stop.load() || s_activePercent.load() != 0; }));
+	return !s_stop;
+}
+
+void MSDFBackground::Rest(std::chrono::steady_clock::duration work) {
+	// idle priority already yields every core the game wants, the budget keeps the rest from running flat out
+	const uint32_t percent = s_activePercent.load();
+	if (!percent || percent >= 100) return;
+	std::unique_lock lock(s_mutex);
+	s_wake.wait_for(lock, work * (100 - percent) / percent, [] { return s_stop.load(); });
+}
+
+void MSDFBackground::GetProgress(uint32_t& outDone, uint32_t& outTotal, double& outCurrent) {
+	outDone = 0;
+	outTotal = static_cast<uint32_t>(s_progress.size());
+	outCurrent = 0.0;
+	bool current = false;
+	const double span = static_cast<double>(s_range.last) - s_range.first + 1.0;
+	for (const Progress& progress : s_progress | std::views::values) {
+		if (progress.done) ++outDone;
+		else if (!current && progress.loaded) {
+			current = true;
+			outCurrent = std::clamp((static_cast<double>(progress.cursor) - s_range.first) / span, 0.0, 1.0);
+		}
+	}
+}
+
+void MSDFBackground::Shutdown() {
+	StopWorkers(true);
+	s_faces.clear();
+	s_progress.clear();
+	s_done.clear();
+	s_queue.clear();
+	s_lastFrame = {};
+	s_frameMs = 0.0;
+}
@@ -0,0 +1,121 @@
+#pragma once
+#include "MSDF.h"
+#include "MSDFCache.h"
+#include "unordered_dense/include/ankerl/unordered_dense.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <thread>
+
+class MSDFFont;
+
+// fills the glyph caches of the registered fonts across the locale range while the player is idle, so the session rarely has to
+// generate anything. the workers render at idle priority from faces of their own under a CPU budget, are held the frame combat
+// starts and slow down as frame time rises. every cache write, dedup lookup and progress save happens on the main thread
+class MSDFBackground {
+public:
+	static constexpr uint32_t MAX_BUDGET_PERCENT = 100;
+	static constexpr uint32_t DEFAULT_BUDGET_PERCENT = 25;
+	static constexpr uint32_t MAX_IDLE_SECONDS = 3600;
+	static constexpr uint32_t DEFAULT_IDLE_SECONDS = 60;
+
+	// share of the machine's cores the workers may keep busy, 0 disables
+	static void SetBudget(uint32_t percent) { s_budgetPercent = percent; }
+	// seconds without input before the player counts as idle, AFK, resting or the game in the background count right away
+	static void SetIdleDelay(uint32_t seconds) { s_idleSeconds = seconds; }
+
+	static void Register(FT_Face face, const FT_Byte* data, FT_Long size, FT_Long faceIndex, FontHash fontHash);
+	// the engine frees the font data right after, so the workers are joined first
+	static void Unregister(FT_Face face);
+	// call from the main thread on every update
+	static void Tick();
+
+	static bool IsRunning() { return s_activePercent.load() != 0; }
+	// fonts whose range is complete, fonts registered and how far into the range the current one is
+	static void GetProgress(uint32_t& outDone, uint32_t& outTotal, double& outCurrent);
+	static void Shutdown();
+
+private:
+	static constexpr size_t JOB_GLYPHS = 32;
+	static constexpr size_t JOBS_PER_WORKER = 2;
+	static constexpr uint32_t MAX_SCAN_PER_TICK = 4096; // codepoints checked against the font and the cache per frame
+	static constexpr ULONGLONG IDLE_POLL_MS = 1000;
+	static constexpr ULONGLONG SAVE_INTERVAL_MS = 15 * 1000;
+	static constexpr double RELAXED_FRAME_MS = 20.0; // full budget up to here
+	static constexpr double MAX_FRAME_MS = 50.0;     // held from here on
+	static constexpr double FRAME_SMOOTHING = 0.1;
+	static constexpr auto WAKE_POLL = std::chrono::milliseconds(100);
+	static constexpr DWORD MANIFEST_TIMEOUT_MS = 0; // another client's flush is not waited out, the cache backs off before retrying
+
+	struct FaceSource {
+		const FT_Byte* data;
+		FT_Long size;
+		FT_Long faceIndex;
+		FontHash fontHash;
+	};
+
+	// one per font binary, however many faces the engine opened it as
+	struct Progress {
+		uint32_t cursor = 0; // next codepoint to queue
+		uint32_t saved = 0;  // what pregen.dat holds
+		std::vector<uint32_t> inFlight; // first codepoint of every job not stored yet
+		bool loaded = false;
+		bool done = false;
+	};
+
+	struct Job {
+		FontHash fontHash = 0;
+		FaceSource source{};
+		uint32_t first = 0;
+		bool complete = false; // false if the workers were stopped halfway through
+		std::vector<uint32_t> codepoints;
+		std::vector<GlyphMetricsToStore> results;
+		MSDF::GeometryStats geometry; // handed to the font along with the results
+	};
+
+	static void WorkerMain();
+	// false once the workers are told to stop
+	static bool WaitWhilePaused();
+	static void Rest(std::chrono::steady_clock::duration work);
+
+	static bool IsPlayerIdle();
+	static uint32_t GetWorkerCount();
+	static uint32_t GetWorkerPercent();
+	static void SetActivePercent(uint32_t percent);
+
+	static void StartWorkers();
+	// tells the workers to stop. once all are out, or right away with wait, joins them, keeps what they rendered and rewinds every
+	// cursor to the first glyph they did not
+	static void StopWorkers(bool wait);
+	// false once no registered font has anything left
+	static bool QueueJobs();
+	static void DrainResults();
+	// false if the cache could not take the results yet
+	static bool StoreResults(Job& job);
+	static void SaveProgress(FontHash fontHash, Progress& progress, bool force);
+	static MSDFFont* FindFont(FontHash fontHash, const FaceSource** outSource = nullptr);
+
+	inline static uint32_t s_budgetPercent = DEFAULT_BUDGET_PERCENT;
+	inline static uint32_t s_idleSeconds = DEFAULT_IDLE_SECONDS;
+	inline static MSDF::CodepointRange s_range{};
+
+	inline static ankerl::unordered_dense::map<FT_Face, FaceSource> s_faces;
+	inline static ankerl::unordered_dense::map<FontHash, Progress> s_progress;
+
+	inline static std::vector<std::thread> s_workers;
+	inline static std::mutex s_mutex; // guards both queues and s_stop, the main thread only ever tries it
+	inline static std::condition_variable s_wake;
+	inline static std::deque<std::unique_ptr<Job>> s_queue;
+	inline static std::vector<std::unique_ptr<Job>> s_done;
+	inline static std::atomic<bool> s_stop = false;
+	inline static std::atomic<uint32_t> s_runningWorkers = 0; // workers not out of WorkerMain yet
+	inline static std::atomic<uint32_t> s_activePercent = 0; // per worker, 0 holds them
+
+	inline static LARGE_INTEGER s_lastFrame{};
+	inline static double s_frameMs = 0.0; // smoothed
+	inline static ULONGLONG s_lastIdlePoll = 0;
+	inline static ULONGLONG s_lastSave = 0;
+	inline static bool s_idle = false;
+	inline static bool s_foreground = true;
+};
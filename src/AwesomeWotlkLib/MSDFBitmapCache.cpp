@@ -0,0 +1,121 @@
+#include "MSDFBitmapCache.h"
+#include FT_BITMAP_H
+
+void MSDFBitmapCache::Register(FT_Face face, FontHash fontHash) {
+	if (!face || !fontHash) return;
+	s_faces[face] = fontHash;
+}
+
+void MSDFBitmapCache::Unregister(FT_Face face) {
+	// the caches outlive the face, the same binary is usually opened again at another size
+	s_faces.erase(face);
+	if (face == s_lastFace) s_lastFace = nullptr;
+}
+
+FT_Error MSDFBitmapCache::LoadGlyph(FT_Face face, FT_UInt glyphIndex, FT_Int32 loadFlags) {
+	MSDFCache* cache = s_enabled && (loadFlags & FT_LOAD_RENDER) ? GetCache(face, loadFlags) : nullptr;
+	if (!cache) return FT_Load_Glyph(face, glyphIndex, loadFlags);
+
+	// without FT_LOAD_RENDER the load fills the metrics and presets the bitmap box, rasterizing is all that is left
+	if (const FT_Error error = FT_Load_Glyph(face, glyphIndex, loadFlags & ~FT_LOAD_RENDER)) return error;
+	FT_GlyphSlot slot = face->glyph;
+	FT_Render_Mode mode = FT_LOAD_TARGET_MODE(loadFlags);
+	if (mode == FT_RENDER_MODE_NORMAL && (loadFlags & FT_LOAD_MONOCHROME)) mode = FT_RENDER_MODE_MONO;
+	// embedded bitmap strikes come out of the load already rendered
+	if (slot->format == FT_GLYPH_FORMAT_BITMAP) return 0;
+	if (slot->format != FT_GLYPH_FORMAT_OUTLINE) return FT_Render_Glyph(slot, mode);
+
+	const FT_Bitmap& bitmap = slot->bitmap;
+	if (bitmap.width == 0 || bitmap.rows == 0 || bitmap.pitch <= 0) return FT_Render_Glyph(slot, mode);
+
+	GlyphMetrics cached;
+	// a pending bitmap is the newest, the one on disk may be what it is about to replace
+	uint32_t cachedSize = 0;
+	const bool pending = FindPending(cache, glyphIndex, cached, cachedSize);
+	const bool found = pending || cache->TryLoadGlyph(glyphIndex, cached, nullptr, &cachedSize);
+	// the own-bitmap copy reads rows * pitch bytes, a payload cut short on disk or written for another pitch must not feed it
+	const uint32_t expectedSize = bitmap.rows * static_cast<uint32_t>(bitmap.pitch);
+	if (found && cached.pixelData && cachedSize == expectedSize && cached.width == bitmap.width && cached.height == bitmap.rows && cached.bitmapLeft == slot->bitmap_left && cached.bitmapTop == slot->bitmap_top) {
+		// the renderer would fill this very box, the copy leaves the slot owning its buffer as after FT_Render_Glyph
+		slot->bitmap.buffer = const_cast<uint8_t*>(cached.pixelData);
+		slot->format = FT_GLYPH_FORMAT_BITMAP;
+		if (FT_GlyphSlot_Own_Bitmap(slot) == 0) {
+			++MSDF::g_bitmapStats.hits;
+			return 0;
+		}
+		slot->bitmap.buffer = nullptr;
+		slot->format = FT_GLYPH_FORMAT_OUTLINE;
+	}
+
+	if (const FT_Error error = FT_Render_Glyph(slot, mode)) return error;
+	++MSDF::g_bitmapStats.rendered;
+	// a stored bitmap with another box is stale (another FreeType build, a changed font file), the new one replaces it
+	if (pending || !bitmap.buffer) return 0;
+
+	const uint32_t dataSize = expectedSize;
+	GlyphMetricsToStore store;
+	store.codepoint = glyphIndex;
+	store.width = static_cast<uint16_t>(bitmap.width);
+	store.height = static_cast<uint16_t>(bitmap.rows);
+	store.bitmapTop = slot->bitmap_top;
+	store.bitmapLeft = slot->bitmap_left;
+	store.ownedPixelData.assign(bitmap.buffer, bitmap.buffer + dataSize);
+	store.dataSize = dataSize;
+	if (bitmap.width <= UINT16_MAX && bitmap.rows <= UINT16_MAX && cache->StoreGlyph(std::move(store))) ++MSDF::g_bitmapStats.stored;
+	return 0;
+}
+
+MSDFCache* MSDFBitmapCache::GetCache(FT_Face face, FT_Int32 loadFlags) {
+	if (!face->size) return nullptr;
+	const FT_Size_Metrics& metrics = face->size->metrics;
+	if (face == s_lastFace && loadFlags == s_lastFlags && metrics.y_ppem == s_lastPixelSize) return s_lastCache;
+
+	auto fit = s_faces.find(face);
+	if (fit == s_faces.end()) return nullptr;
+	// a stretched size would share the directory of the square one
+	if (metrics.x_ppem != metrics.y_ppem || metrics.y_ppem == 0) return nullptr;
+
+	const CacheKey key{.fontHash = fit->second, .pixelSize = metrics.y_ppem, .loadFlags = static_cast<uint32_t>(loadFlags & ~FT_LOAD_RENDER)};
+	const uint64_t cacheHash = ankerl::unordered_dense::detail::wyhash::hash(&key, sizeof(key));
+	if (!s_caches.contains(cacheHash) && s_caches.size() >= MAX_CACHES) {
+		// closing flushes what they still hold
+		TrimLeastRecentlyUsed(s_caches, TRIMMED_CACHES);
+		s_lastFace = nullptr;
+		s_lastCache = nullptr;
+	}
+	auto [it, inserted] = s_caches.try_emplace(cacheHash);
+	if (inserted) {
+		// the cache hash stands in for the font hash, block ids of every size and mode stay apart in the arena
+		char styleName[20];
+		snprintf(styleName, sizeof(styleName), "%016llx", static_cast<unsigned long long>(fit->second));
+		it->second.cache = std::make_unique<MSDFCache>(cacheHash, MSDFCache::BITMAP_FAMILY, styleName, key.pixelSize, key.loadFlags);
+	}
+	it->second.lastUse = ++s_useTick;
+
+	s_lastFace = face;
+	s_lastFlags = loadFlags;
+	s_lastPixelSize = metrics.y_ppem;
+	s_lastCache = it->second.cache.get();
+	return s_lastCache;
+}
+
+bool MSDFBitmapCache::FindPending(MSDFCache* cache, FT_UInt glyphIndex, GlyphMetrics& outMetrics, uint32_t& outDataSize) {
+	for (const GlyphMetricsToStore& pending : cache->m_pendingWrites) {
+		if (pending.codepoint != glyphIndex) continue;
+		outMetrics.width = pending.width;
+		outMetrics.height = pending.height;
+		outMetrics.bitmapTop = pending.bitmapTop;
+		outMetrics.bitmapLeft = pending.bitmapLeft;
+		outMetrics.pixelData = pending.ownedPixelData.data();
+		outDataSize = static_cast<uint32_t>(pending.ownedPixelData.size());
+		return true;
+	}
+	return false;
+}
+
+void MSDFBitmapCache::Shutdown() {
+	s_lastFace = nullptr;
+	s_lastCache = nullptr;
+	s_faces.clear();
+	s_caches.clear();
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include "MSDF.h"
+#include "MSDFCache.h"
+#include "unordered_dense/include/ankerl/unordered_dense.h"
+#include <memory>
+
+// persisted FreeType bitmaps for the faces MSDF does not serve (incompatible, blacklisted), which the engine rasterizes itself.
+// one cache per font binary, pixel size and load flags, keyed by glyph index. a hit still loads the glyph for its metrics and
+// the bitmap box FreeType presets for the slot, only the rasterization is skipped and a cached bitmap with another box is ignored
+class MSDFBitmapCache {
+public:
+	static bool IsEnabled() { return s_enabled; }
+	static void SetEnabled(bool enabled) { s_enabled = enabled; }
+
+	static void Register(FT_Face face, FontHash fontHash);
+	static void Unregister(FT_Face face);
+	// FT_Load_Glyph for a load with FT_LOAD_RENDER, the slot ends up exactly as FreeType would have left it
+	static FT_Error LoadGlyph(FT_Face face, FT_UInt glyphIndex, FT_Int32 loadFlags);
+
+	static size_t GetCacheCount() { return s_caches.size(); }
+	static void Shutdown();
+
+private:
+	// every size and mode the UI asks for opens one, the least recently used are closed past the cap
+	static constexpr size_t MAX_CACHES = 32;
+	static constexpr size_t TRIMMED_CACHES = MAX_CACHES * 3 / 4;
+
+	struct CacheKey {
+		FontHash fontHash;
+		uint32_t pixelSize;
+		uint32_t loadFlags;
+	};
+
+	struct OpenCache {
+		std::unique_ptr<MSDFCache> cache;
+		uint64_t lastUse = 0;
+	};
+
+	static MSDFCache* GetCache(FT_Face face, FT_Int32 loadFlags);
+	static bool FindPending(MSDFCache* cache, FT_UInt glyphIndex, GlyphMetrics& outMetrics, uint32_t& outDataSize);
+
+	inline static bool s_enabled = true;
+	inline static ankerl::unordered_dense::map<FT_Face, FontHash> s_faces;
+	inline static ankerl::unordered_dense::map<uint64_t, OpenCache> s_caches;
+	inline static uint64_t s_useTick = 0; // the cache behind s_lastCache always carries the newest stamp
+	inline static FT_Face s_lastFace = nullptr;
+	inline static FT_Int32 s_lastFlags = 0;
+	inline static FT_UShort s_lastPixelSize = 0;
+	inline static MSDFCache* s_lastCache = nullptr;
+};
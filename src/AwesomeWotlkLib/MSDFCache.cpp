@@ -1,26 +1,109 @@
 #include "MSDFCache.h"
 #include "MSDFManager.h"
+#include "MSDFDedup.h"
+#include <compressapi.h>
+#include <charconv>
+#include <chrono>
 #include <fstream>
 #include <ranges>
+#include <thread>
+
+namespace {
+#pragma pack(push, 1)
+	struct IndexFileHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t entryCount;
+		uint32_t pad;
+	};
+
+	// content fingerprint of a font file, trusted while path, size and last write time all match
+	struct HashMemoEntry {
+		uint64_t pathHash;
+		uint64_t fileSize;
+		uint64_t writeTime;
+		FontHash hash;
+	};
+#pragma pack(pop)
+
+	static_assert(sizeof(IndexFileHeader) == 16);
+	static_assert(sizeof(HashMemoEntry) == 32);
+
+	struct HashMemo {
+		ankerl::unordered_dense::map<uint64_t, HashMemoEntry> entries;
+		ankerl::unordered_dense::map<uint64_t, HashMemoEntry> seen;
+		bool loaded = false;
+		bool dirty = false;
+	};
+
+	HashMemo s_hashMemo;
+
+#pragma pack(push, 1)
+	struct VerdictEntry {
+		FontHash fontHash;
+		uint32_t rangeFirst;
+		uint32_t rangeLast;
+		uint32_t validatorVersion;
+		uint32_t compatible;
+	};
+#pragma pack(pop)
+
+	static_assert(sizeof(VerdictEntry) == 24);
+
+	struct VerdictStore {
+		ankerl::unordered_dense::map<uint64_t, VerdictEntry> entries;
+		bool loaded = false;
+	};
+
+	VerdictStore s_verdicts;
+
+	uint64_t VerdictKey(FontHash fontHash, uint32_t rangeFirst, uint32_t rangeLast, uint32_t validatorVersion) {
+		const VerdictEntry key{.fontHash = fontHash, .rangeFirst = rangeFirst, .rangeLast = rangeLast, .validatorVersion = validatorVersion, .compatible = 0};
+		return ankerl::unordered_dense::detail::wyhash::hash(&key, sizeof(key));
+	}
+}
+
+#pragma comment(lib, "cabinet.lib")
 
 MSDFManager MSDFCache::s_manager = MSDFManager();
-MSDFCache::BlacklistAutoRunner MSDFCache::s_blacklistAutoRunner;
 
-MSDFCache::MSDFCache(const FT_Byte* fontData, FT_Long dataSize, const char* familyName, const char* styleName, uint32_t sdfRenderSize, uint32_t sdfSpread) : m_key{.sdfRenderSize = sdfRenderSize, .sdfSpread = sdfSpread} {
+MSDFCache::MSDFCache(FontHash fontHash, const char* familyName, const char* styleName, uint32_t sdfRenderSize, uint32_t sdfSpread) : m_key{.sdfRenderSize = sdfRenderSize, .sdfSpread = sdfSpread} {
 	m_cacheBasePath = GetCacheBasePath(familyName, styleName, sdfRenderSize, sdfSpread);
 	m_cacheManifestPath = m_cacheBasePath / "manifest.dat";
 	m_cacheManifestLockPath = m_cacheBasePath / "manifest.lock";
 	m_cacheManifestJournalPath = m_cacheBasePath / "manifest.jrn";
+	m_cacheKerningPath = m_cacheBasePath / "kerning.dat";
+	m_cacheProfilePath = m_cacheBasePath / "profile.dat";
+	m_cachePregenPath = m_cacheBasePath / "pregen.dat";
 
-	m_fontID = MSDFManager::RegisterFont(HashFont(fontData, dataSize));
+	// archives belong to the font binary rather than to whatever name it was registered under
+	char archiveName[64];
+	snprintf(archiveName, sizeof(archiveName), "%016llx_s%u_sp%u.msdfpak", static_cast<unsigned long long>(fontHash), sdfRenderSize, sdfSpread);
+	m_archivePath = m_cacheBasePath.parent_path() / archiveName;
+
+	m_fontID = MSDFManager::RegisterFont(fontHash);
 
 	std::error_code ec;
 	std::filesystem::create_directories(m_cacheBasePath, ec);
+	// the per-font snapshot of older builds, the atlas is snapshotted as a whole now
+	std::filesystem::remove(m_cacheBasePath / "atlas.dat", ec);
+	m_inUseLock.AcquireShared(m_cacheBasePath / "inuse.lock", IN_USE_LOCK_TIMEOUT_MS);
+
+	std::lock_guard guard(s_activeDirsMutex);
+	s_activeDirs.push_back(m_cacheBasePath);
 }
 
 MSDFCache::~MSDFCache() {
 	FlushPendingWrites();
+	if (m_stampsDirty) SaveManifest();
 	CleanupOrphans();
+	CloseArchive();
+	{
+		std::lock_guard guard(s_activeDirsMutex);
+		auto it = std::ranges::find(s_activeDirs, m_cacheBasePath);
+		if (it != s_activeDirs.end()) s_activeDirs.erase(it);
+	}
+	m_inUseLock.Release();
 	MSDFManager::FlushAll();
 	m_vecPool.TrimAll();
 	m_mEntryPool.TrimAll();
@@ -52,7 +135,8 @@ std::string MSDFCache::GetCacheBasePath(const char* familyName, const char* styl
 	return base.string();
 }
 
-void MSDFCache::InitializeBlacklist() {
+void MSDFCache::BuildBlacklistIndex() {
+	s_blacklistIndexed = true;
 	s_blacklistHashes.clear();
 
 	std::filesystem::path blacklistDir = std::filesystem::current_path() / BLACKLIST_DIR;
@@ -70,25 +154,135 @@ void MSDFCache::InitializeBlacklist() {
 		std::ranges::transform(ext, ext.begin(), tolower);
 
 		if (ext == ".ttf" || ext == ".otf") {
-			std::ifstream file(entry.path(), std::ios::binary | std::ios::ate);
-			if (file) {
-				std::streamsize size = file.tellg();
-				if (size > 0) {
-					std::vector<uint8_t> buffer(size);
-					file.seekg(0, std::ios::beg);
-					if (file.read(reinterpret_cast<char*>(buffer.data()), size)) { s_blacklistHashes.insert(HashFont(buffer.data(), buffer.size())); }
-				}
-			}
+			FontHash hash;
+			if (HashFontFile(entry, hash)) s_blacklistHashes.insert(hash);
 		}
 
 		std::string nameWithoutExt = entry.path().stem().string();
 		if (!nameWithoutExt.empty()) { s_blacklistHashes.insert(HashNormalizedString(nameWithoutExt)); }
 	}
+	SaveFontHashMemo();
 }
 
-bool MSDFCache::IsFontBlacklisted(const char* familyName, const char* styleName, const uint8_t* fontData, size_t dataSize) {
+bool MSDFCache::HashFontFile(const std::filesystem::directory_entry& entry, FontHash& outHash) {
+	HashMemo& memo = s_hashMemo;
+	if (!memo.loaded) {
+		memo.loaded = true;
+		std::ifstream in(std::filesystem::current_path() / CACHE_DIR / "fonthash.dat", std::ios::binary);
+		IndexFileHeader hdr{};
+		if (in.read(reinterpret_cast<char*>(&hdr), sizeof(hdr)) && hdr.magic == HASH_MEMO_MAGIC && hdr.version == FONT_HASH_VERSION && hdr.entryCount <= MAX_SAFE_ALLOCATION / sizeof(HashMemoEntry)) {
+			HashMemoEntry e;
+			for (uint32_t i = 0; i < hdr.entryCount && in.read(reinterpret_cast<char*>(&e), sizeof(e)); ++i) memo.entries[e.pathHash] = e;
+		}
+	}
+
+	// size and write time come from the directory listing, a known font is never opened
+	std::error_code ec;
+	const uint64_t fileSize = entry.file_size(ec);
+	if (ec || fileSize == 0 || fileSize > static_cast<uint64_t>(INT32_MAX)) return false;
+	const uint64_t writeTime = static_cast<uint64_t>(entry.last_write_time(ec).time_since_epoch().count());
+	if (ec) return false;
+
+	const std::filesystem::path& path = entry.path();
+	std::wstring key = path.lexically_normal().wstring();
+	std::ranges::transform(key, key.begin(), towlower);
+	const uint64_t pathHash = ankerl::unordered_dense::detail::wyhash::hash(key.data(), key.size() * sizeof(wchar_t));
+
+	auto it = memo.entries.find(pathHash);
+	if (it != memo.entries.end() && it->second.fileSize == fileSize && it->second.writeTime == writeTime) {
+		outHash = it->second.hash;
+		memo.seen[pathHash] = it->second;
+		return true;
+	}
+
+	FileGuard file(CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+	if (!file.IsValid()) return false;
+	MappingGuard mapping(CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr));
+	if (!mapping.IsValid()) return false;
+	const void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!view) return false;
+	outHash = HashFont(static_cast<const FT_Byte*>(view), static_cast<FT_Long>(fileSize));
+	UnmapViewOfFile(view);
+
+	const HashMemoEntry memoEntry{.pathHash = pathHash, .fileSize = fileSize, .writeTime = writeTime, .hash = outHash};
+	memo.entries[pathHash] = memoEntry;
+	memo.seen[pathHash] = memoEntry;
+	memo.dirty = true;
+	return true;
+}
+
+void MSDFCache::SaveFontHashMemo() {
+	HashMemo& memo = s_hashMemo;
+	// fonts that left the folder drop out of the memo as well
+	if (!memo.dirty && memo.seen.size() == memo.entries.size()) return;
+
+	const std::filesystem::path memoPath = std::filesystem::current_path() / CACHE_DIR / "fonthash.dat";
+	std::error_code ec;
+	std::filesystem::create_directories(memoPath.parent_path(), ec);
+
+	std::filesystem::path tmpPath = memoPath;
+	tmpPath.replace_extension(".tmp");
+	{
+		std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+		if (!out) return;
+		const IndexFileHeader hdr{.magic = HASH_MEMO_MAGIC, .version = FONT_HASH_VERSION, .entryCount = static_cast<uint32_t>(memo.seen.size()), .pad = 0};
+		out.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+		for (const auto& e : memo.seen | std::views::values) out.write(reinterpret_cast<const char*>(&e), sizeof(e));
+		if (!out) return;
+	}
+	if (MoveFileExW(tmpPath.c_str(), memoPath.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		memo.entries = memo.seen;
+		memo.dirty = false;
+	}
+}
+
+void MSDFCache::LoadVerdicts() {
+	s_verdicts.loaded = true;
+	std::ifstream in(std::filesystem::current_path() / CACHE_DIR / "verdicts.dat", std::ios::binary);
+	IndexFileHeader hdr{};
+	if (!in.read(reinterpret_cast<char*>(&hdr), sizeof(hdr)) || hdr.magic != VERDICT_MAGIC || hdr.version != FONT_HASH_VERSION || hdr.entryCount > MAX_SAFE_ALLOCATION / sizeof(VerdictEntry)) return;
+
+	VerdictEntry e;
+	for (uint32_t i = 0; i < hdr.entryCount && in.read(reinterpret_cast<char*>(&e), sizeof(e)); ++i) { s_verdicts.entries[VerdictKey(e.fontHash, e.rangeFirst, e.rangeLast, e.validatorVersion)] = e; }
+}
+
+bool MSDFCache::LookupVerdict(FontHash fontHash, const MSDF::CodepointRange& range, uint32_t validatorVersion, bool& outCompatible) {
+	if (!s_verdicts.loaded) LoadVerdicts();
+	auto it = s_verdicts.entries.find(VerdictKey(fontHash, range.first, range.last, validatorVersion));
+	if (it == s_verdicts.entries.end()) return false;
+	outCompatible = it->second.compatible != 0;
+	return true;
+}
+
+void MSDFCache::StoreVerdict(FontHash fontHash, const MSDF::CodepointRange& range, uint32_t validatorVersion, bool compatible) {
+	const std::filesystem::path verdictPath = std::filesystem::current_path() / CACHE_DIR / "verdicts.dat";
+	std::error_code ec;
+	std::filesystem::create_directories(verdictPath.parent_path(), ec);
+
+	ScopedFileLock lock;
+	if (!lock.AcquireExclusive(std::filesystem::path(verdictPath).replace_extension(".lock"), 1000)) return;
+
+	// pick up verdicts other clients wrote since we last looked
+	LoadVerdicts();
+	s_verdicts.entries[VerdictKey(fontHash, range.first, range.last, validatorVersion)] = {.fontHash = fontHash, .rangeFirst = range.first, .rangeLast = range.last, .validatorVersion = validatorVersion, .compatible = compatible ? 1u : 0u};
+
+	std::filesystem::path tmpPath = verdictPath;
+	tmpPath.replace_extension(".tmp");
+	{
+		std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+		if (!out) return;
+		const IndexFileHeader hdr{.magic = VERDICT_MAGIC, .version = FONT_HASH_VERSION, .entryCount = static_cast<uint32_t>(s_verdicts.entries.size()), .pad = 0};
+		out.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+		for (const auto& e : s_verdicts.entries | std::views::values) out.write(reinterpret_cast<const char*>(&e), sizeof(e));
+		if (!out) return;
+	}
+	MoveFileExW(tmpPath.c_str(), verdictPath.c_str(), MOVEFILE_REPLACE_EXISTING);
+}
+
+bool MSDFCache::IsFontBlacklisted(const char* familyName, const char* styleName, FontHash fontHash) {
+	if (!s_blacklistIndexed) BuildBlacklistIndex();
 	if (s_blacklistHashes.empty()) return false;
-	if (fontData && dataSize > 0) { if (s_blacklistHashes.contains(HashFont(fontData, dataSize))) return true; }
+	if (s_blacklistHashes.contains(fontHash)) return true;
 	if (familyName) { if (s_blacklistHashes.contains(HashNormalizedString(familyName))) return true; }
 	if (familyName && styleName) {
 		std::string combined = std::string(familyName) + "_" + styleName;
@@ -111,18 +305,240 @@ void MSDFCache::BuildBlockPath(uint32_t blockId, std::filesystem::path& outPath)
 
 uint32_t MSDFCache::GetBlockId(uint32_t codepoint) { return codepoint >> static_cast<uint32_t>(std::countr_zero(BLOCK_SIZE)); }
 
-bool MSDFCache::TryLoadGlyph(uint32_t codepoint, GlyphMetrics& outMetrics) {
+bool MSDFCache::TryLoadGlyph(uint32_t codepoint, GlyphMetrics& outMetrics, uint64_t* outOutlineHash, uint32_t* outDataSize) {
+	// a packed archive answers without a lock or a block file, the directory only holds what was generated since packing
+	if (TryLoadArchivedGlyph(codepoint, outMetrics, outDataSize)) {
+		if (outOutlineHash) *outOutlineHash = 0;
+		return true;
+	}
+	return TryLoadDirectoryGlyph(codepoint, outMetrics, outOutlineHash, outDataSize);
+}
+
+bool MSDFCache::TryLoadDirectoryGlyph(uint32_t codepoint, GlyphMetrics& outMetrics, uint64_t* outOutlineHash, uint32_t* outDataSize) {
+	if (!m_manifestLoaded) { if (!LoadManifest()) return false; }
 	auto mit = m_manifest.find(codepoint);
 	if (mit == m_manifest.end()) return false;
 	auto bit = m_blockWrap.find(mit->second.blockId);
-	if (bit != m_blockWrap.end()) { return MSDFManager::LoadGlyph(bit->second, codepoint, outMetrics); }
+	if (bit != m_blockWrap.end()) { return LoadGlyphFromBlock(bit->second, codepoint, outMetrics, outOutlineHash, outDataSize); }
 	uint32_t blockId = mit->second.blockId;
 	BlockKey block(m_fontID, blockId);
 	std::filesystem::path blockPath;
 	BuildBlockPath(blockId, blockPath);
 	BlockWrap wrap = {.key = block, .path = blockPath};
 	m_blockWrap[mit->second.blockId] = wrap;
-	return MSDFManager::LoadGlyph(wrap, codepoint, outMetrics);
+	// first use this session, the collector evicts blocks by this stamp
+	m_blockStamps[blockId] = GetStampNow();
+	m_stampsDirty = true;
+	return LoadGlyphFromBlock(wrap, codepoint, outMetrics, outOutlineHash, outDataSize);
+}
+
+bool MSDFCache::LoadGlyphFromBlock(const BlockWrap& wrap, uint32_t codepoint, GlyphMetrics& outMetrics, uint64_t* outOutlineHash, uint32_t* outDataSize) {
+	const GlyphEntry* entry = nullptr;
+	if (!MSDFManager::LoadGlyph(wrap, codepoint, outMetrics, &entry)) return false;
+	if (outOutlineHash) *outOutlineHash = entry->outlineHash;
+	// a shared payload was matched on its box, it is the full RGBA field of that box
+	if (outDataSize) *outDataSize = entry->sharedId ? static_cast<uint32_t>(entry->width) * entry->height * 4 : entry->dataSize;
+	if (!entry->sharedId) return true;
+
+	// the pixels live in the shared store, a lost payload is regenerated like any other miss
+	const uint8_t* pixels = nullptr;
+	if (!MSDFDedup::LoadPayload(entry->sharedId, entry->outlineHash, outMetrics.width, outMetrics.height, pixels)) return false;
+	outMetrics.pixelData = pixels;
+	return true;
+}
+
+bool MSDFCache::Contains(uint32_t codepoint) {
+	if (FindArchiveEntry(codepoint)) return true;
+	if (!m_manifestLoaded) { if (!LoadManifest()) return false; }
+	if (m_manifest.contains(codepoint)) return true;
+	return std::ranges::any_of(m_pendingWrites, [codepoint](const GlyphMetricsToStore& pending) { return pending.codepoint == codepoint; });
+}
+
+const MSDFCache::ArchiveEntry* MSDFCache::FindArchiveEntry(uint32_t codepoint) {
+	if (!m_archiveChecked) OpenArchive();
+	if (!m_archiveIndex) return nullptr;
+
+	const auto* hdr = reinterpret_cast<const ArchiveHeader*>(m_archiveIndex);
+	const auto* regions = reinterpret_cast<const ArchiveRegion*>(m_archiveIndex + sizeof(ArchiveHeader));
+	const auto* entries = reinterpret_cast<const ArchiveEntry*>(regions + hdr->regionCount);
+	const ArchiveEntry* end = entries + hdr->entryCount;
+	const ArchiveEntry* e = std::lower_bound(entries, end, codepoint, [](const ArchiveEntry& entry, uint32_t cp) { return entry.codepoint < cp; });
+	return e != end && e->codepoint == codepoint ? e : nullptr;
+}
+
+bool MSDFCache::TryLoadArchivedGlyph(uint32_t codepoint, GlyphMetrics& outMetrics, uint32_t* outDataSize) {
+	const ArchiveEntry* e = FindArchiveEntry(codepoint);
+	if (!e) return false;
+
+	const auto* regions = reinterpret_cast<const ArchiveRegion*>(m_archiveIndex + sizeof(ArchiveHeader));
+	const uint8_t*& view = m_archiveRegions[e->region];
+	if (e->dataSize && !view) {
+		view = static_cast<const uint8_t*>(MapViewOfFile(m_archiveMapping, FILE_MAP_READ, 0, regions[e->region].offset, regions[e->region].size));
+		if (!view) return false;
+	}
+
+	outMetrics.width = e->width;
+	outMetrics.height = e->height;
+	outMetrics.bitmapTop = e->bitmapTop;
+	outMetrics.bitmapLeft = e->bitmapLeft;
+	outMetrics.tier = e->tier;
+	outMetrics.pixelData = e->dataSize ? view + e->dataOffset : nullptr;
+	if (outDataSize) *outDataSize = e->dataSize;
+	return true;
+}
+
+bool MSDFCache::OpenArchive() {
+	m_archiveChecked = true;
+	std::error_code ec;
+	const uint64_t fsize = std::filesystem::file_size(m_archivePath, ec);
+	if (ec || fsize < sizeof(ArchiveHeader) || fsize > UINT32_MAX) return false;
+
+	FileGuard file(CreateFileW(m_archivePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr));
+	if (!file.IsValid()) return false;
+
+	ArchiveHeader hdr{};
+	DWORD read = 0;
+	if (!ReadFile(file, &hdr, sizeof(hdr), &read, nullptr) || read != sizeof(hdr)) return false;
+	if (hdr.magic != ARCHIVE_MAGIC || hdr.version != CACHE_VERSION || hdr.fontHash != MSDFManager::GetFontHash(m_fontID) || !(hdr.key == m_key)) return false;
+	const uint64_t indexSize = sizeof(ArchiveHeader) + static_cast<uint64_t>(hdr.regionCount) * sizeof(ArchiveRegion) + static_cast<uint64_t>(hdr.entryCount) * sizeof(ArchiveEntry);
+	if (hdr.indexSize != indexSize || indexSize > fsize) return false;
+
+	MappingGuard mapping(CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr));
+	if (!mapping.IsValid()) return false;
+	const auto* index = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, hdr.indexSize));
+	if (!index) return false;
+
+	// everything a lookup relies on is checked here, once, so the hot path trusts the index blindly
+	const auto* regions = reinterpret_cast<const ArchiveRegion*>(index + sizeof(ArchiveHeader));
+	const auto* entries = reinterpret_cast<const ArchiveEntry*>(regions + hdr.regionCount);
+	bool valid = Crc32C(regions, hdr.indexSize - sizeof(ArchiveHeader)) == hdr.checksum;
+	for (uint32_t i = 0; valid && i < hdr.regionCount; ++i) {
+		const ArchiveRegion& r = regions[i];
+		valid = r.size == 0 || (r.offset % ARCHIVE_REGION_ALIGNMENT == 0 && r.offset >= indexSize && static_cast<uint64_t>(r.offset) + r.size <= fsize);
+	}
+	for (uint32_t i = 0; valid && i < hdr.entryCount; ++i) {
+		const ArchiveEntry& e = entries[i];
+		const uint64_t expectedSize = static_cast<uint64_t>(e.width) * e.height * 4;
+		valid = (i == 0 || entries[i - 1].codepoint < e.codepoint) && e.region < hdr.regionCount && e.tier < MSDF::QUALITY_TIER_COUNT && (e.dataSize == 0 || e.dataSize == expectedSize) && static_cast<uint64_t>(e.dataOffset) + e.dataSize <= regions[e.region].size;
+	}
+	if (!valid) {
+		UnmapViewOfFile(index);
+		return false;
+	}
+
+	m_archiveMapping = mapping.Release();
+	m_archiveIndex = index;
+	m_archiveRegions.assign(hdr.regionCount, nullptr);
+	WriteArchiveRef();
+	return true;
+}
+
+void MSDFCache::WriteArchiveRef() const {
+	const std::string name = m_archivePath.filename().string();
+	const std::filesystem::path refPath = m_cacheBasePath / "archive.ref";
+	{
+		std::ifstream in(refPath, std::ios::binary);
+		const std::string current((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		if (current == name) return;
+	}
+	std::ofstream out(refPath, std::ios::binary | std::ios::trunc);
+	out.write(name.data(), static_cast<std::streamsize>(name.size()));
+}
+
+void MSDFCache::CloseArchive() {
+	for (const uint8_t* view : m_archiveRegions) { if (view) UnmapViewOfFile(view); }
+	m_archiveRegions.clear();
+	if (m_archiveIndex) UnmapViewOfFile(m_archiveIndex);
+	if (m_archiveMapping) CloseHandle(m_archiveMapping);
+	m_archiveIndex = nullptr;
+	m_archiveMapping = nullptr;
+	// reopened on the next lookup, a freshly packed file is picked up that way
+	m_archiveChecked = false;
+}
+
+bool MSDFCache::PackArchive(uint32_t& outGlyphs) {
+	outGlyphs = 0;
+	FlushPendingWrites();
+	if (!m_manifestLoaded && !LoadManifest(MANIFEST_LOCK_TIMEOUT_LONG_MS)) return false;
+	if (!m_archiveChecked) OpenArchive();
+
+	std::vector<uint32_t> codepoints;
+	codepoints.reserve(m_manifest.size());
+	for (uint32_t cp : m_manifest | std::views::keys) codepoints.push_back(cp);
+	if (m_archiveIndex) {
+		const auto* hdr = reinterpret_cast<const ArchiveHeader*>(m_archiveIndex);
+		const auto* entries = reinterpret_cast<const ArchiveEntry*>(m_archiveIndex + sizeof(ArchiveHeader) + hdr->regionCount * sizeof(ArchiveRegion));
+		for (uint32_t i = 0; i < hdr->entryCount; ++i) { if (!m_manifest.contains(entries[i].codepoint)) codepoints.push_back(entries[i].codepoint); }
+	}
+	if (codepoints.empty()) return false;
+	std::ranges::sort(codepoints);
+
+	uint32_t regionCount = 0;
+	for (size_t i = 0; i < codepoints.size(); ++i) { if (i == 0 || GetBlockId(codepoints[i]) != GetBlockId(codepoints[i - 1])) ++regionCount; }
+
+	std::filesystem::path lockPath = m_archivePath;
+	lockPath.replace_extension(".lock");
+	ScopedFileLock lock;
+	if (!lock.AcquireExclusive(lockPath, 1000)) return false;
+
+	std::filesystem::path tmpPath = m_archivePath;
+	tmpPath.replace_extension(".tmp");
+	FileGuard file(CreateFileW(tmpPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+	if (!file.IsValid()) return false;
+	file.path = tmpPath;
+	file.deleteOnFailure = true;
+
+	auto alignRegion = [](uint64_t offset) { return (offset + ARCHIVE_REGION_ALIGNMENT - 1) & ~static_cast<uint64_t>(ARCHIVE_REGION_ALIGNMENT - 1); };
+	auto writeAt = [&](uint64_t offset, const void* data, size_t size) {
+		LARGE_INTEGER pos;
+		pos.QuadPart = static_cast<LONGLONG>(offset);
+		DWORD written = 0;
+		return SetFilePointerEx(file, pos, nullptr, FILE_BEGIN) && WriteFile(file, data, static_cast<DWORD>(size), &written, nullptr) && written == size;
+	};
+
+	// payloads go first, past room reserved for the largest possible index, which is written once every offset is known
+	std::vector<ArchiveRegion> regions;
+	std::vector<ArchiveEntry> entries;
+	regions.reserve(regionCount);
+	entries.reserve(codepoints.size());
+	uint64_t fileOffset = alignRegion(sizeof(ArchiveHeader) + static_cast<uint64_t>(regionCount) * sizeof(ArchiveRegion) + codepoints.size() * sizeof(ArchiveEntry));
+
+	auto payload = m_vecPool.Acquire(0);
+	FinalAction cleanup([&]() { m_vecPool.Release(std::move(payload)); });
+
+	for (size_t i = 0; i < codepoints.size();) {
+		const uint32_t blockId = GetBlockId(codepoints[i]);
+		const uint32_t regionIndex = static_cast<uint32_t>(regions.size());
+		payload.clear();
+		for (; i < codepoints.size() && GetBlockId(codepoints[i]) == blockId; ++i) {
+			// the directory is newer than the archive for anything present in both
+			GlyphMetrics metrics;
+			if (!TryLoadDirectoryGlyph(codepoints[i], metrics, nullptr) && !TryLoadArchivedGlyph(codepoints[i], metrics)) continue;
+			const uint32_t dataSize = metrics.pixelData ? static_cast<uint32_t>(metrics.width) * metrics.height * 4 : 0;
+			entries.push_back({.codepoint = codepoints[i], .region = regionIndex, .dataOffset = static_cast<uint32_t>(payload.size()), .dataSize = dataSize, .bitmapTop = metrics.bitmapTop, .bitmapLeft = metrics.bitmapLeft, .width = metrics.width, .height = metrics.height, .tier = metrics.tier, .pad = {}});
+			if (dataSize) payload.insert(payload.end(), metrics.pixelData, metrics.pixelData + dataSize);
+		}
+		if (fileOffset + payload.size() > UINT32_MAX) return false;
+		regions.push_back({.offset = static_cast<uint32_t>(fileOffset), .size = static_cast<uint32_t>(payload.size())});
+		if (!payload.empty() && !writeAt(fileOffset, payload.data(), payload.size())) return false;
+		fileOffset = alignRegion(fileOffset + payload.size());
+	}
+	if (entries.empty()) return false;
+
+	ArchiveHeader hdr{.magic = ARCHIVE_MAGIC, .version = CACHE_VERSION, .fontHash = MSDFManager::GetFontHash(m_fontID), .key = m_key, .regionCount = static_cast<uint32_t>(regions.size()), .entryCount = static_cast<uint32_t>(entries.size())};
+	hdr.indexSize = static_cast<uint32_t>(sizeof(ArchiveHeader) + regions.size() * sizeof(ArchiveRegion) + entries.size() * sizeof(ArchiveEntry));
+	hdr.checksum = Crc32C(entries.data(), entries.size() * sizeof(ArchiveEntry), Crc32C(regions.data(), regions.size() * sizeof(ArchiveRegion)));
+	if (!writeAt(0, &hdr, sizeof(hdr)) || !writeAt(sizeof(hdr), regions.data(), regions.size() * sizeof(ArchiveRegion)) || !writeAt(sizeof(hdr) + regions.size() * sizeof(ArchiveRegion), entries.data(), entries.size() * sizeof(ArchiveEntry))) return false;
+	FlushFileBuffers(file);
+	CloseHandle(file.Release());
+
+	// our own views would keep the old file from being replaced
+	CloseArchive();
+	if (!MoveFileExW(tmpPath.c_str(), m_archivePath.c_str(), MOVEFILE_REPLACE_EXISTING)) return false;
+	file.successful = true;
+	WriteArchiveRef();
+	outGlyphs = static_cast<uint32_t>(entries.size());
+	return true;
 }
 
 bool MSDFCache::StoreGlyph(GlyphMetricsToStore&& metrics) {
@@ -132,9 +548,13 @@ bool MSDFCache::StoreGlyph(GlyphMetricsToStore&& metrics) {
 	return true;
 }
 
-bool MSDFCache::LoadManifest() {
+bool MSDFCache::LoadManifest(DWORD timeoutMs) {
+	if (timeoutMs < MANIFEST_LOCK_TIMEOUT_LONG_MS && GetTickCount64() < m_manifestRetryTick) return false;
 	ScopedFileLock lock;
-	if (!lock.AcquireShared(m_cacheManifestLockPath, 10000)) { return false; }
+	if (!lock.AcquireShared(m_cacheManifestLockPath, timeoutMs)) {
+		m_manifestRetryTick = GetTickCount64() + MANIFEST_RETRY_MS;
+		return false;
+	}
 
 	std::error_code ec;
 	bool pathExists = std::filesystem::exists(m_cacheManifestPath, ec);
@@ -151,8 +571,10 @@ bool MSDFCache::LoadManifest() {
 			size_t estimatedEntries = (fsize - sizeof(ManifestHeader)) / sizeof(ManifestEntry);
 			m_manifest.reserve(std::min(estimatedEntries + estimatedEntries / 10, static_cast<uint32_t>(0x110000))); // 1,114,112 - max unicode range
 		}
-		if (!LoadManifestFromFile(m_cacheManifestPath, m_manifest)) {
+		if (!LoadManifestFromFile(m_cacheManifestPath, m_key, m_manifest, &m_blockStamps)) {
 			m_manifest.clear();
+			m_blockStamps.clear();
+			m_manifestRetryTick = GetTickCount64() + MANIFEST_RETRY_MS;
 			return false;
 		}
 	}
@@ -164,7 +586,7 @@ bool MSDFCache::LoadManifest() {
 	return true;
 }
 
-bool MSDFCache::LoadManifestFromFile(const std::filesystem::path& path, ManifestMap& outMap) const {
+bool MSDFCache::LoadManifestFromFile(const std::filesystem::path& path, const CacheKey& key, ManifestMap& outMap, StampMap* outStamps) {
 	std::error_code ec;
 	auto fsize = std::filesystem::file_size(path, ec);
 	if (ec || fsize < sizeof(ManifestHeader) || fsize > MAX_SAFE_ALLOCATION) return false;
@@ -179,11 +601,15 @@ bool MSDFCache::LoadManifestFromFile(const std::filesystem::path& path, Manifest
 	if (!view) return false;
 
 	const auto* hdr = static_cast<const ManifestHeader*>(view.ptr);
-	if (hdr->magic == MANIFEST_MAGIC && hdr->version == CACHE_VERSION && hdr->key == m_key) {
-		uint64_t expectedSize = sizeof(ManifestHeader) + static_cast<uint64_t>(hdr->entryCount) * sizeof(ManifestEntry);
+	if (hdr->magic == MANIFEST_MAGIC && hdr->version == CACHE_VERSION && hdr->key == key) {
+		uint64_t expectedSize = sizeof(ManifestHeader) + static_cast<uint64_t>(hdr->entryCount) * sizeof(ManifestEntry) + static_cast<uint64_t>(hdr->stampCount) * sizeof(BlockStamp);
 		if (fsize >= expectedSize) {
 			auto* entries = reinterpret_cast<const ManifestEntry*>(static_cast<const uint8_t*>(view.ptr) + sizeof(ManifestHeader));
 			for (uint32_t i = 0; i < hdr->entryCount; ++i) { outMap.try_emplace(entries[i].codepoint, entries[i]); }
+			if (outStamps) {
+				auto* stamps = reinterpret_cast<const BlockStamp*>(entries + hdr->entryCount);
+				for (uint32_t i = 0; i < hdr->stampCount; ++i) { (*outStamps)[stamps[i].blockId] = stamps[i].lastUse; }
+			}
 			return true;
 		}
 	}
@@ -242,16 +668,11 @@ bool MSDFCache::SaveManifest(bool isLocked) {
 	ScopedFileLock lock;
 	if (!isLocked && !lock.AcquireExclusive(m_cacheManifestLockPath, 1000)) return false;
 
-	std::filesystem::path tmpManifest = m_cacheManifestPath;
-	tmpManifest.replace_extension(".tmp");
-
-	FileGuard file(CreateFileW(tmpManifest.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
-	if (file.handle == INVALID_HANDLE_VALUE) return false;
-
-	ManifestHeader hdr{.magic = MANIFEST_MAGIC, .version = CACHE_VERSION, .key = m_key, .entryCount = m_manifest.size(), .pad = 0};
-	DWORD written = 0;
-
-	if (!WriteFile(file.handle, &hdr, sizeof(hdr), &written, nullptr)) return false;
+	// outside a flush the journal may hold entries other clients appended since we loaded
+	if (!isLocked) {
+		size_t applied = 0;
+		LoadManifestJournal(m_cacheManifestJournalPath, m_manifest, applied);
+	}
 
 	auto entries = m_mEntryPool.Acquire(m_manifest.size());
 	entries.reserve(m_manifest.size());
@@ -260,18 +681,270 @@ bool MSDFCache::SaveManifest(bool isLocked) {
 
 	for (const auto& kv : m_manifest) { entries.push_back({.codepoint = kv.first, .blockId = kv.second.blockId}); }
 
+	if (!WriteManifestFile(m_cacheManifestPath, m_key, entries, m_blockStamps)) return false;
+	m_stampsDirty = false;
+	return true;
+}
+
+bool MSDFCache::WriteManifestFile(const std::filesystem::path& path, const CacheKey& key, const std::vector<ManifestEntry>& entries, const StampMap& stamps) {
+	std::filesystem::path tmpManifest = path;
+	tmpManifest.replace_extension(".tmp");
+
+	FileGuard file(CreateFileW(tmpManifest.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+	if (file.handle == INVALID_HANDLE_VALUE) return false;
+
+	ManifestHeader hdr{.magic = MANIFEST_MAGIC, .version = CACHE_VERSION, .key = key, .entryCount = entries.size(), .stampCount = stamps.size()};
+	DWORD written = 0;
+
+	if (!WriteFile(file.handle, &hdr, sizeof(hdr), &written, nullptr)) return false;
 	if (!entries.empty()) { if (!WriteFile(file.handle, entries.data(), entries.size() * sizeof(ManifestEntry), &written, nullptr)) { return false; } }
+
+	if (!stamps.empty()) {
+		std::vector<BlockStamp> records;
+		records.reserve(stamps.size());
+		for (const auto& [blockId, lastUse] : stamps) { records.push_back({.blockId = blockId, .lastUse = lastUse}); }
+		if (!WriteFile(file.handle, records.data(), records.size() * sizeof(BlockStamp), &written, nullptr)) return false;
+	}
 	FlushFileBuffers(file.handle);
 	file.Close();
 
-	if (MoveFileExW(tmpManifest.c_str(), m_cacheManifestPath.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+	if (MoveFileExW(tmpManifest.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
 		std::error_code ec;
-		std::filesystem::remove(m_cacheManifestJournalPath, ec);
+		std::filesystem::path journal = path;
+		std::filesystem::remove(journal.replace_extension(".jrn"), ec);
 		return true;
 	}
 	return false;
 }
 
+bool MSDFCache::LoadKerning(std::vector<KerningEntry>& outEntries) const {
+	std::error_code ec;
+	auto fsize = std::filesystem::file_size(m_cacheKerningPath, ec);
+	if (ec || fsize < sizeof(KerningHeader) || fsize > MAX_SAFE_ALLOCATION) return false;
+
+	std::ifstream in(m_cacheKerningPath, std::ios::binary);
+	if (!in.good()) return false;
+
+	KerningHeader hdr{};
+	if (!in.read(reinterpret_cast<char*>(&hdr), sizeof(hdr))) return false;
+	// pairs are glyph indices, only meaningful for the exact font binary they were read from
+	if (hdr.magic != KERNING_MAGIC || hdr.version != CACHE_VERSION || hdr.fontHash != MSDFManager::GetFontHash(m_fontID)) return false;
+	if (fsize < sizeof(KerningHeader) + static_cast<uint64_t>(hdr.entryCount) * sizeof(KerningEntry)) return false;
+
+	outEntries.resize(hdr.entryCount);
+	if (hdr.entryCount && !in.read(reinterpret_cast<char*>(outEntries.data()), hdr.entryCount * sizeof(KerningEntry))) {
+		outEntries.clear();
+		return false;
+	}
+	return true;
+}
+
+bool MSDFCache::SaveKerning(const std::vector<KerningEntry>& entries) const {
+	if (entries.size() > (MAX_SAFE_ALLOCATION - sizeof(KerningHeader)) / sizeof(KerningEntry)) return false;
+
+	ScopedFileLock lock;
+	if (!lock.AcquireExclusive(m_cacheManifestLockPath, 1000)) return false;
+
+	std::filesystem::path tmpKerning = m_cacheKerningPath;
+	tmpKerning.replace_extension(".ktmp");
+
+	FileGuard file(CreateFileW(tmpKerning.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+	if (!file.IsValid()) return false;
+	file.path = tmpKerning;
+	file.deleteOnFailure = true;
+
+	KerningHeader hdr{.magic = KERNING_MAGIC, .version = CACHE_VERSION, .fontHash = MSDFManager::GetFontHash(m_fontID), .entryCount = static_cast<uint32_t>(entries.size()), .pad = 0};
+	DWORD written = 0;
+
+	if (!WriteFile(file.handle, &hdr, sizeof(hdr), &written, nullptr) || written != sizeof(hdr)) return false;
+	if (!entries.empty()) {
+		const DWORD bytes = static_cast<DWORD>(entries.size() * sizeof(KerningEntry));
+		if (!WriteFile(file.handle, entries.data(), bytes, &written, nullptr) || written != bytes) return false;
+	}
+	FlushFileBuffers(file.handle);
+	CloseHandle(file.Release());
+
+	if (!MoveFileExW(tmpKerning.c_str(), m_cacheKerningPath.c_str(), MOVEFILE_REPLACE_EXISTING)) return false;
+	file.successful = true;
+	return true;
+}
+
+bool MSDFCache::LoadProfile(std::vector<ProfileEntry>& outEntries) const {
+	std::error_code ec;
+	auto fsize = std::filesystem::file_size(m_cacheProfilePath, ec);
+	if (ec || fsize < sizeof(ProfileHeader) || fsize > MAX_SAFE_ALLOCATION) return false;
+
+	std::ifstream in(m_cacheProfilePath, std::ios::binary);
+	if (!in.good()) return false;
+
+	ProfileHeader hdr{};
+	if (!in.read(reinterpret_cast<char*>(&hdr), sizeof(hdr))) return false;
+	if (hdr.magic != PROFILE_MAGIC || hdr.version != CACHE_VERSION || hdr.fontHash != MSDFManager::GetFontHash(m_fontID)) return false;
+	if (fsize < sizeof(ProfileHeader) + static_cast<uint64_t>(hdr.entryCount) * sizeof(ProfileEntry)) return false;
+
+	outEntries.resize(hdr.entryCount);
+	if (hdr.entryCount && !in.read(reinterpret_cast<char*>(outEntries.data()), hdr.entryCount * sizeof(ProfileEntry))) {
+		outEntries.clear();
+		return false;
+	}
+	return true;
+}
+
+bool MSDFCache::SaveProfile(const std::vector<ProfileEntry>& entries) const {
+	if (entries.size() > (MAX_SAFE_ALLOCATION - sizeof(ProfileHeader)) / sizeof(ProfileEntry)) return false;
+
+	std::filesystem::path lockPath = m_cacheProfilePath;
+	ScopedFileLock lock;
+	if (!lock.AcquireExclusive(lockPath.replace_extension(".lock"), 1000)) return false;
+
+	std::filesystem::path tmpProfile = m_cacheProfilePath;
+	tmpProfile.replace_extension(".tmp");
+
+	FileGuard file(CreateFileW(tmpProfile.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+	if (!file.IsValid()) return false;
+	file.path = tmpProfile;
+	file.deleteOnFailure = true;
+
+	ProfileHeader hdr{.magic = PROFILE_MAGIC, .version = CACHE_VERSION, .fontHash = MSDFManager::GetFontHash(m_fontID), .entryCount = static_cast<uint32_t>(entries.size()), .pad = 0};
+	DWORD written = 0;
+
+	if (!WriteFile(file.handle, &hdr, sizeof(hdr), &written, nullptr) || written != sizeof(hdr)) return false;
+	if (!entries.empty()) {
+		const DWORD bytes = static_cast<DWORD>(entries.size() * sizeof(ProfileEntry));
+		if (!WriteFile(file.handle, entries.data(), bytes, &written, nullptr) || written != bytes) return false;
+	}
+	CloseHandle(file.Release());
+
+	if (!MoveFileExW(tmpProfile.c_str(), m_cacheProfilePath.c_str(), MOVEFILE_REPLACE_EXISTING)) return false;
+	file.successful = true;
+	return true;
+}
+
+bool MSDFCache::LoadPregenCursor(const MSDF::CodepointRange& range, uint32_t& outCursor) const {
+	std::ifstream in(m_cachePregenPath, std::ios::binary);
+	if (!in.good()) return false;
+
+	PregenHeader hdr{};
+	if (!in.read(reinterpret_cast<char*>(&hdr), sizeof(hdr))) return false;
+	if (hdr.magic != PREGEN_MAGIC || hdr.version != CACHE_VERSION || hdr.fontHash != MSDFManager::GetFontHash(m_fontID)) return false;
+	if (hdr.rangeFirst != range.first || hdr.rangeLast != range.last || hdr.cursor < range.first) return false;
+	outCursor = hdr.cursor;
+	return true;
+}
+
+bool MSDFCache::SavePregenCursor(const MSDF::CodepointRange& range, uint32_t cursor) const {
+	std::filesystem::path lockPath = m_cachePregenPath;
+	ScopedFileLock lock;
+	if (!lock.AcquireExclusive(lockPath.replace_extension(".lock"), 1000)) return false;
+
+	std::filesystem::path tmpPregen = m_cachePregenPath;
+	tmpPregen.replace_extension(".tmp");
+
+	FileGuard file(CreateFileW(tmpPregen.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+	if (!file.IsValid()) return false;
+	file.path = tmpPregen;
+	file.deleteOnFailure = true;
+
+	PregenHeader hdr{.magic = PREGEN_MAGIC, .version = CACHE_VERSION, .fontHash = MSDFManager::GetFontHash(m_fontID), .rangeFirst = range.first, .rangeLast = range.last, .cursor = cursor, .pad = 0};
+	DWORD written = 0;
+	if (!WriteFile(file.handle, &hdr, sizeof(hdr), &written, nullptr) || written != sizeof(hdr)) return false;
+	CloseHandle(file.Release());
+
+	if (!MoveFileExW(tmpPregen.c_str(), m_cachePregenPath.c_str(), MOVEFILE_REPLACE_EXISTING)) return false;
+	file.successful = true;
+	return true;
+}
+
+bool MSDFCache::LoadAtlasSnapshot(const SnapshotReader& reader) {
+	std::error_code ec;
+	const std::filesystem::path path = std::filesystem::current_path(ec) / CACHE_DIR / "atlas.dat";
+	if (ec) return false;
+	const auto fsize = std::filesystem::file_size(path, ec);
+	if (ec || fsize < sizeof(SnapshotHeader)) return false;
+
+	std::ifstream in(path, std::ios::binary);
+	if (!in.good()) return false;
+
+	SnapshotHeader hdr{};
+	if (!in.read(reinterpret_cast<char*>(&hdr), sizeof(hdr))) return false;
+	if (hdr.magic != SNAPSHOT_MAGIC || hdr.version != CACHE_VERSION) return false;
+	if (hdr.chunkCount == 0 || hdr.chunkCount > MAX_SNAPSHOT_CHUNKS) return false;
+
+	DECOMPRESSOR_HANDLE decompressor = nullptr;
+	if (!CreateDecompressor(COMPRESS_ALGORITHM_XPRESS_HUFF, nullptr, &decompressor)) return false;
+	FinalAction closeDecompressor([&]() { CloseDecompressor(decompressor); });
+
+	// megabytes at a time and once per session, not worth parking in the pool
+	std::vector<uint8_t> compressed, data;
+	uint64_t offset = sizeof(SnapshotHeader);
+	for (uint32_t i = 0; i < hdr.chunkCount; ++i) {
+		SnapshotChunk chunk{};
+		if (!in.read(reinterpret_cast<char*>(&chunk), sizeof(chunk))) return false;
+		offset += sizeof(chunk) + chunk.compressedSize;
+		if (chunk.rawSize > MAX_SNAPSHOT_CHUNK || (chunk.rawSize == 0) != (chunk.compressedSize == 0) || offset > fsize) return false;
+
+		data.resize(chunk.rawSize);
+		if (chunk.rawSize) {
+			compressed.resize(chunk.compressedSize);
+			if (!in.read(reinterpret_cast<char*>(compressed.data()), chunk.compressedSize)) return false;
+			SIZE_T rawSize = 0;
+			if (!Decompress(decompressor, compressed.data(), compressed.size(), data.data(), data.size(), &rawSize) || rawSize != chunk.rawSize) return false;
+		}
+		if (!reader(i, data)) return false;
+	}
+	return offset == fsize;
+}
+
+bool MSDFCache::SaveAtlasSnapshot(uint32_t chunkCount, const SnapshotWriter& writer) {
+	if (chunkCount == 0 || chunkCount > MAX_SNAPSHOT_CHUNKS) return false;
+	std::error_code ec;
+	const std::filesystem::path path = std::filesystem::current_path(ec) / CACHE_DIR / "atlas.dat";
+	if (ec) return false;
+
+	COMPRESSOR_HANDLE compressor = nullptr;
+	if (!CreateCompressor(COMPRESS_ALGORITHM_XPRESS_HUFF, nullptr, &compressor)) return false;
+	FinalAction closeCompressor([&]() { CloseCompressor(compressor); });
+
+	std::filesystem::path lockPath = path;
+	ScopedFileLock lock;
+	if (!lock.AcquireExclusive(lockPath.replace_extension(".lock"), 1000)) return false;
+
+	std::filesystem::path tmpSnapshot = path;
+	tmpSnapshot.replace_extension(".tmp");
+
+	FileGuard file(CreateFileW(tmpSnapshot.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+	if (!file.IsValid()) return false;
+	file.path = tmpSnapshot;
+	file.deleteOnFailure = true;
+
+	SnapshotHeader hdr{.magic = SNAPSHOT_MAGIC, .version = CACHE_VERSION, .chunkCount = chunkCount, .pad = 0};
+	DWORD written = 0;
+	if (!WriteFile(file.handle, &hdr, sizeof(hdr), &written, nullptr) || written != sizeof(hdr)) return false;
+
+	std::vector<uint8_t> data, compressed;
+	for (uint32_t i = 0; i < chunkCount; ++i) {
+		data.clear();
+		if (!writer(i, data) || data.size() > MAX_SNAPSHOT_CHUNK) return false;
+
+		// the first call only reports the bound
+		SIZE_T compressedSize = 0;
+		if (!data.empty()) {
+			if (!Compress(compressor, data.data(), data.size(), nullptr, 0, &compressedSize) && GetLastError() != ERROR_INSUFFICIENT_BUFFER) return false;
+			compressed.resize(compressedSize);
+			if (!Compress(compressor, data.data(), data.size(), compressed.data(), compressed.size(), &compressedSize)) return false;
+		}
+
+		const SnapshotChunk chunk{.rawSize = static_cast<uint32_t>(data.size()), .compressedSize = static_cast<uint32_t>(compressedSize)};
+		if (!WriteFile(file.handle, &chunk, sizeof(chunk), &written, nullptr) || written != sizeof(chunk)) return false;
+		if (compressedSize && (!WriteFile(file.handle, compressed.data(), static_cast<DWORD>(compressedSize), &written, nullptr) || written != compressedSize)) return false;
+	}
+	CloseHandle(file.Release());
+
+	if (!MoveFileExW(tmpSnapshot.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) return false;
+	file.successful = true;
+	return true;
+}
+
 size_t MSDFCache::GetManifestSize() {
 	if (!m_manifestLoaded) { LoadManifest(); }
 	return m_manifest.size();
@@ -317,6 +990,8 @@ bool MSDFCache::FlushPendingWrites() {
 	}
 	m_mEntryPool.Release(std::move(blockEntries));
 	m_mEntryPool.Release(std::move(newEntries));
+	// the shared payload index only points other clients at payloads once they are on disk
+	if (MSDFDedup::IsStore(this)) MSDFDedup::FlushIndex();
 	return true;
 }
 
@@ -353,11 +1028,11 @@ bool MSDFCache::WriteBlockFile(uint32_t blockId, std::vector<GlyphMetricsToStore
 		if (oldIdx < oldEntriesCount && (pendingIt == pending.end() || ((cachedBlock->entries[oldIdx].codepoint) < ((*pendingIt)->codepoint)))) { mergedEntries.push_back(cachedBlock->entries[oldIdx++]); }
 		else if (pendingIt != pending.end() && (oldIdx == oldEntriesCount || (*pendingIt)->codepoint < cachedBlock->entries[oldIdx].codepoint)) {
 			auto* p = *pendingIt++;
-			mergedEntries.push_back({.codepoint = p->codepoint, .width = p->width, .height = p->height, .bitmapTop = p->bitmapTop, .bitmapLeft = p->bitmapLeft, .dataOffset = 0, .dataSize = p->dataSize});
+			mergedEntries.push_back({.codepoint = p->codepoint, .width = p->width, .height = p->height, .bitmapTop = p->bitmapTop, .bitmapLeft = p->bitmapLeft, .dataOffset = 0, .dataSize = p->dataSize, .tier = p->tier, .sharedId = p->sharedId, .outlineHash = p->outlineHash});
 		}
 		else {
 			auto* p = *pendingIt++;
-			mergedEntries.push_back({.codepoint = p->codepoint, .width = p->width, .height = p->height, .bitmapTop = p->bitmapTop, .bitmapLeft = p->bitmapLeft, .dataOffset = 0, .dataSize = p->dataSize});
+			mergedEntries.push_back({.codepoint = p->codepoint, .width = p->width, .height = p->height, .bitmapTop = p->bitmapTop, .bitmapLeft = p->bitmapLeft, .dataOffset = 0, .dataSize = p->dataSize, .tier = p->tier, .sharedId = p->sharedId, .outlineHash = p->outlineHash});
 			oldIdx++;
 		}
 	}
@@ -394,7 +1069,8 @@ bool MSDFCache::WriteBlockFile(uint32_t blockId, std::vector<GlyphMetricsToStore
 		FileGuard tmpFile(CreateFileW(tmpPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
 		if (tmpFile.handle == INVALID_HANDLE_VALUE) return false;
 
-		BlockFileHeader bHdr{.magic = BLOCK_MAGIC, .version = CACHE_VERSION, .blockId = blockId, .entryCount = mergedEntries.size()};
+		BlockFileHeader bHdr{.magic = BLOCK_MAGIC, .version = CACHE_VERSION, .blockId = blockId, .entryCount = mergedEntries.size(), .payloadSize = static_cast<uint32_t>(payloadBuffer.size())};
+		bHdr.checksum = Crc32C(hashTable.data(), BLOCK_SIZE * sizeof(uint32_t), Crc32C(mergedEntries.data(), mergedEntries.size() * sizeof(GlyphEntry)));
 		size_t dataSize = sizeof(bHdr) + (mergedEntries.size() * sizeof(GlyphEntry)) + (BLOCK_SIZE * sizeof(uint32_t)) + payloadBuffer.size();
 
 		const size_t align = MSDFManager::s_si.dwAllocationGranularity;
@@ -430,11 +1106,280 @@ bool MSDFCache::WriteBlockFile(uint32_t blockId, std::vector<GlyphMetricsToStore
 void MSDFCache::CleanupOrphans() const {
 	std::error_code ec;
 	if (!std::filesystem::exists(m_cacheBasePath, ec)) return;
+	RemoveStaleTemporaries(m_cacheBasePath, 0);
+}
+
+void MSDFCache::RemoveStaleTemporaries(const std::filesystem::path& dir, uint32_t minAgeMinutes) {
+	std::error_code ec;
+	const uint32_t now = GetStampNow();
+	for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+		if (!entry.is_regular_file(ec)) continue;
+		const std::filesystem::path& path = entry.path();
+		const std::filesystem::path ext = path.extension();
+		if (ext != ".old" && ext != ".tmp" && ext != ".ktmp") continue;
+		if (GetFileStamp(entry) + minAgeMinutes > now) continue;
+
+		// temporaries are written under the lock of the file they replace, kerning shares the manifest's
+		std::filesystem::path lockPath = dir / (ext == ".ktmp" ? std::filesystem::path("manifest") : path.stem());
+		lockPath += ".lock";
+		ScopedFileLock lock;
+		if (lock.AcquireExclusive(lockPath, 0)) std::filesystem::remove(path, ec);
+	}
+}
+
+uint32_t MSDFCache::GetStampNow() {
+	return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::minutes>(std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+uint32_t MSDFCache::GetFileStamp(const std::filesystem::directory_entry& entry) {
+	std::error_code ec;
+	const auto writeTime = entry.last_write_time(ec);
+	if (ec) return 0;
+	const auto sysTime = std::chrono::clock_cast<std::chrono::system_clock>(writeTime);
+	return static_cast<uint32_t>(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::minutes>(sysTime.time_since_epoch()).count()));
+}
+
+bool MSDFCache::IsDirActive(const std::filesystem::path& dir) {
+	std::lock_guard guard(s_activeDirsMutex);
+	return std::ranges::any_of(s_activeDirs, [&](const std::filesystem::path& active) { return _wcsicmp(active.filename().c_str(), dir.filename().c_str()) == 0; });
+}
+
+bool MSDFCache::IsDirLive(const std::filesystem::path& dir) {
+	if (IsDirActive(dir)) return true;
+	// every client holds inuse.lock of the directories it has open shared, an exclusive probe only succeeds once they are all gone
+	ScopedFileLock probe;
+	return !probe.AcquireExclusive(dir / "inuse.lock", 0);
+}
 
-	for (const auto& entry : std::filesystem::directory_iterator(m_cacheBasePath, ec)) {
-		if (entry.is_regular_file()) {
-			std::string ext = entry.path().extension().string();
-			if (ext == ".old" || ext == ".tmp") { std::filesystem::remove(entry.path(), ec); }
+void MSDFCache::GarbageCollectorTick() {
+	if (s_gcStarted) return;
+	const ULONGLONG now = GetTickCount64();
+	if (!s_gcFirstTick) {
+		s_gcFirstTick = now;
+		return;
+	}
+	// loading screens and the first flood of text are over by now
+	if (now - s_gcFirstTick < GC_IDLE_DELAY_MS) return;
+	s_gcStarted = true;
+
+	s_gcThread = std::thread([]() {
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_IDLE);
+		CollectGarbage(s_cacheBudget.load());
+	});
+}
+
+void MSDFCache::StopGarbageCollector() {
+	s_gcStop = true;
+	if (s_gcThread.joinable()) s_gcThread.join();
+}
+
+void MSDFCache::CollectGarbage(uint64_t budget) {
+	namespace fs = std::filesystem;
+	std::error_code ec;
+	const fs::path root = fs::current_path(ec) / CACHE_DIR;
+	if (ec || !fs::is_directory(root, ec)) return;
+
+	const uint32_t now = GetStampNow();
+	const CacheKey key{.sdfRenderSize = MSDF::SDF_RENDER_SIZE, .sdfSpread = MSDF::SDF_SPREAD};
+
+	// "<family>_<style>_s<size>_sp<spread>", anything else under the root (the shader cache) is not the collector's
+	auto parseKey = [](const std::string& name, CacheKey& outKey) {
+		const size_t sp = name.rfind("_sp");
+		if (sp == std::string::npos || sp == 0) return false;
+		const size_t s = name.rfind("_s", sp - 1);
+		if (s == std::string::npos) return false;
+		const char* last = name.data() + name.size();
+		auto [spEnd, spErr] = std::from_chars(name.data() + sp + 3, last, outKey.sdfSpread);
+		auto [sEnd, sErr] = std::from_chars(name.data() + s + 2, name.data() + sp, outKey.sdfRenderSize);
+		return spErr == std::errc() && spEnd == last && sErr == std::errc() && sEnd == name.data() + sp;
+	};
+
+	// wipes a whole font directory, live caches and directories another client holds are left alone
+	auto removeDir = [](const fs::path& dir) {
+		std::error_code rec;
+		{
+			// held until the files are gone, a client opening the directory meanwhile waits on it
+			ScopedFileLock inUse;
+			ScopedFileLock lock;
+			if (!inUse.AcquireExclusive(dir / "inuse.lock", 0) || !lock.AcquireExclusive(dir / "manifest.lock", 0) || IsDirActive(dir)) return;
+			for (const auto& entry : fs::directory_iterator(dir, rec)) {
+				const fs::path name = entry.path().filename();
+				if (name != "manifest.lock" && name != "inuse.lock") fs::remove(entry.path(), rec);
+			}
+		}
+		fs::remove_all(dir, rec);
+	};
+
+	auto parseBlockId = [](const fs::path& path, uint32_t& outId) {
+		if (path.extension() != ".dat") return false;
+		const std::string stem = path.stem().string();
+		if (!stem.starts_with("block_")) return false;
+		const char* first = stem.data() + 6;
+		const char* last = stem.data() + stem.size();
+		auto [ptr, err] = std::from_chars(first, last, outId);
+		return err == std::errc() && ptr == last && ptr != first;
+	};
+
+	struct BlockFile {
+		size_t dirIndex;
+		uint32_t blockId;
+		uint64_t size;
+		uint32_t lastUse;
+	};
+
+	std::vector<fs::path> dirs;
+	std::vector<CacheKey> dirKeys; // bitmap caches are keyed by pixel size and load flags, not the glyph size
+	std::vector<BlockFile> blocks;
+	uint64_t total = 0;
+
+	RemoveStaleTemporaries(root, STALE_TEMP_MINUTES);
+
+	for (const auto& dirEntry : fs::directory_iterator(root, ec)) {
+		if (s_gcStop) return;
+		const fs::path& dir = dirEntry.path();
+		// files at the root (archives, verdicts, the font hash memo) are not evicted, so they are not held against the budget either
+		if (!dirEntry.is_directory(ec)) continue;
+		CacheKey dirKey;
+		const std::string dirName = dir.filename().string();
+		if (!parseKey(dirName, dirKey)) continue;
+		// glyphs rendered at another size or spread are never looked up again, bitmap caches exist for every size
+		const bool bitmapDir = dirName.starts_with(std::string(BITMAP_FAMILY) + "_");
+		if (!bitmapDir && dirKey != key) {
+			removeDir(dir);
+			continue;
+		}
+
+		RemoveStaleTemporaries(dir, STALE_TEMP_MINUTES);
+		const bool active = IsDirLive(dir);
+
+		ManifestMap manifest;
+		StampMap stamps;
+		bool usable = true;
+		{
+			ScopedFileLock lock;
+			if (!lock.AcquireShared(dir / "manifest.lock", 0)) continue;
+			const fs::path manifestPath = dir / "manifest.dat";
+			if (fs::exists(manifestPath, ec)) usable = LoadManifestFromFile(manifestPath, dirKey, manifest, &stamps);
+			size_t applied = 0;
+			if (usable) LoadManifestJournal(dir / "manifest.jrn", manifest, applied);
+		}
+		// a manifest from an older cache version orphans every block beside it
+		if (!usable && !active) {
+			removeDir(dir);
+			continue;
+		}
+
+		ankerl::unordered_dense::set<uint32_t> referenced;
+		for (const ManifestEntry& e : manifest | std::views::values) referenced.insert(e.blockId);
+
+		std::vector<BlockFile> dirBlocks;
+		uint64_t dirBytes = 0;
+		uint32_t lastUse = 0;
+		for (const auto& entry : fs::directory_iterator(dir, ec)) {
+			// lock files are created by probes like the ones above and say nothing about use
+			if (!entry.is_regular_file(ec) || entry.path().extension() == ".lock") continue;
+			const uint64_t size = entry.file_size(ec);
+			const uint32_t fileStamp = GetFileStamp(entry);
+			lastUse = std::max(lastUse, fileStamp);
+
+			uint32_t blockId = 0;
+			if (!parseBlockId(entry.path(), blockId)) {
+				dirBytes += size;
+				continue;
+			}
+			// a live cache may be between writing a block and journaling it
+			if (!referenced.contains(blockId) && !active) {
+				fs::path lockPath = entry.path();
+				ScopedFileLock lock;
+				if (lock.AcquireExclusive(lockPath.replace_extension(".lock"), 0) && fs::remove(entry.path(), ec)) continue;
+			}
+			auto sit = stamps.find(blockId);
+			const uint32_t blockUse = sit != stamps.end() ? sit->second : fileStamp;
+			lastUse = std::max(lastUse, blockUse);
+			dirBlocks.push_back({.dirIndex = dirs.size(), .blockId = blockId, .size = size, .lastUse = blockUse});
+			dirBytes += size;
+		}
+
+		// the font has not been registered for a month, most likely it left the addon folders
+		if (!active && lastUse + STALE_DIR_MINUTES < now) {
+			removeDir(dir);
+			continue;
+		}
+
+		dirs.push_back(dir);
+		dirKeys.push_back(dirKey);
+		blocks.insert(blocks.end(), dirBlocks.begin(), dirBlocks.end());
+		total += dirBytes;
+	}
+
+	// archives belong to font binaries, one is kept while a directory that survived the pass above still names it
+	ankerl::unordered_dense::set<std::string> archiveRefs;
+	for (const auto& dirEntry : fs::directory_iterator(root, ec)) {
+		if (!dirEntry.is_directory(ec)) continue;
+		std::ifstream in(dirEntry.path() / "archive.ref", std::ios::binary);
+		std::string name((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		if (!name.empty()) archiveRefs.insert(std::move(name));
+	}
+	auto isArchiveCurrent = [&](const fs::path& path) {
+		CacheKey archiveKey;
+		if (!parseKey(path.stem().string(), archiveKey) || archiveKey != key) return false;
+		std::ifstream in(path, std::ios::binary);
+		ArchiveHeader hdr{};
+		return in.read(reinterpret_cast<char*>(&hdr), sizeof(hdr)) && hdr.magic == ARCHIVE_MAGIC && hdr.version == CACHE_VERSION;
+	};
+	for (const auto& entry : fs::directory_iterator(root, ec)) {
+		if (s_gcStop) return;
+		const fs::path& path = entry.path();
+		if (!entry.is_regular_file(ec) || path.extension() != ".msdfpak") continue;
+		// a freshly packed archive may not be named by its directory yet
+		if (isArchiveCurrent(path) && (archiveRefs.contains(path.filename().string()) || GetFileStamp(entry) + STALE_TEMP_MINUTES > now)) continue;
+		// packing holds the lock, a client reading it keeps its mapping until it lets go
+		fs::path lockPath = path;
+		ScopedFileLock lock;
+		if (lock.AcquireExclusive(lockPath.replace_extension(".lock"), 0)) fs::remove(path, ec);
+	}
+
+	if (total <= budget) return;
+
+	std::ranges::sort(blocks, {}, &BlockFile::lastUse);
+	std::vector<ankerl::unordered_dense::set<uint32_t>> removed(dirs.size());
+	std::vector<uint8_t> live(dirs.size(), 0);
+	for (const BlockFile& block : blocks) {
+		if (total <= budget || s_gcStop) break;
+		// a client may have opened the directory since the scan, from then on only its cold blocks go. the fonts in use hold most of
+		// the bytes, a block it still has mapped stays readable and one it loads again later is regenerated like any miss
+		if (!live[block.dirIndex]) live[block.dirIndex] = IsDirLive(dirs[block.dirIndex]);
+		if (live[block.dirIndex] && block.lastUse + COLD_BLOCK_MINUTES >= now) continue;
+		char name[32];
+		snprintf(name, sizeof(name), "block_%u", block.blockId);
+		const fs::path base = dirs[block.dirIndex] / name;
+		ScopedFileLock lock;
+		if (!lock.AcquireExclusive(fs::path(base) += ".lock", 0)) continue;
+		if (!fs::remove(fs::path(base) += ".dat", ec)) continue;
+		total -= std::min(total, block.size);
+		removed[block.dirIndex].insert(block.blockId);
+	}
+
+	// live caches rewrite their own manifest, a dangling entry there only costs a regeneration
+	for (size_t i = 0; i < dirs.size(); ++i) {
+		if (s_gcStop) break;
+		if (removed[i].empty() || IsDirLive(dirs[i])) continue;
+		ScopedFileLock lock;
+		if (!lock.AcquireExclusive(dirs[i] / "manifest.lock", 1000)) continue;
+
+		ManifestMap manifest;
+		StampMap stamps;
+		const fs::path manifestPath = dirs[i] / "manifest.dat";
+		if (fs::exists(manifestPath, ec) && !LoadManifestFromFile(manifestPath, dirKeys[i], manifest, &stamps)) continue;
+		size_t applied = 0;
+		LoadManifestJournal(dirs[i] / "manifest.jrn", manifest, applied);
+
+		std::vector<ManifestEntry> entries;
+		entries.reserve(manifest.size());
+		for (const auto& [codepoint, e] : manifest) {
+			if (!removed[i].contains(e.blockId)) entries.push_back({.codepoint = codepoint, .blockId = e.blockId});
 		}
+		for (uint32_t blockId : removed[i]) stamps.erase(blockId);
+		WriteManifestFile(manifestPath, dirKeys[i], entries, stamps);
 	}
 }
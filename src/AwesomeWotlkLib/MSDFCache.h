@@ -4,10 +4,17 @@
 #include "unordered_dense/include/ankerl/unordered_dense.h"
 #include <filesystem>
 #include <deque>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
 
 class MSDFManager;
 class MSDFPregen;
 class MSDFFont;
+class MSDFDedup;
+class MSDFBitmapCache;
+class MSDFBackground;
 
 class MSDFCache {
 	struct BlockKey {
@@ -27,10 +34,13 @@ class MSDFCache {
 	friend class MSDFFont;
 	friend class MSDFPregen;
 	friend class MSDFManager;
+	friend class MSDFDedup;
+	friend class MSDFBitmapCache;
+	friend class MSDFBackground;
 	friend struct std::hash<BlockKey>;
 
 public:
-	MSDFCache(const FT_Byte* fontData, FT_Long dataSize, const char* familyName, const char* styleName, uint32_t sdfRenderSize, uint32_t sdfSpread);
+	MSDFCache(FontHash fontHash, const char* familyName, const char* styleName, uint32_t sdfRenderSize, uint32_t sdfSpread);
 	~MSDFCache();
 
 	MSDFCache(const MSDFCache&) = delete;
@@ -41,12 +51,47 @@ public:
 private:
 	static constexpr auto* CACHE_DIR = "Cache_AwesomeWotLK";
 	static constexpr auto* BLACKLIST_DIR = "Fonts_AwesomeWotLK";
-	static constexpr uint32_t CACHE_VERSION = 1;
+	static constexpr auto* BITMAP_FAMILY = "_bitmap"; // MSDFBitmapCache folders, keyed by pixel size and load flags instead
+	static constexpr uint32_t CACHE_VERSION = 6;
 	static constexpr uint32_t BLOCK_MAGIC = 0x4D534442;
 	static constexpr uint32_t MANIFEST_MAGIC = 0x4D534D46;
+	static constexpr uint32_t KERNING_MAGIC = 0x4D534B4E;
+	static constexpr uint32_t HASH_MEMO_MAGIC = 0x4D534648;
+	static constexpr uint32_t VERDICT_MAGIC = 0x4D535644;
+	static constexpr uint32_t ARCHIVE_MAGIC = 0x4D535041;
+	static constexpr uint32_t PROFILE_MAGIC = 0x4D535046;
+	static constexpr uint32_t SNAPSHOT_MAGIC = 0x4D534153;
+	static constexpr uint32_t PREGEN_MAGIC = 0x4D535052;
+	static constexpr size_t MAX_SNAPSHOT_CHUNK = 32 * 1024 * 1024; // uncompressed, a full atlas page or the glyph table
+	static constexpr uint32_t MAX_SNAPSHOT_CHUNKS = 64;
+	static constexpr uint32_t ARCHIVE_REGION_ALIGNMENT = 64 * 1024; // view offsets have to sit on the allocation granularity
 	static constexpr size_t WRITE_BATCH_SIZE = 64;
+	static constexpr DWORD MANIFEST_LOCK_TIMEOUT_MS = 20;      // lookups run on the render thread, a writer holds the lock for one flush at most
+	static constexpr DWORD MANIFEST_LOCK_TIMEOUT_LONG_MS = 10000; // explicit requests (packing) may wait
+	static constexpr ULONGLONG MANIFEST_RETRY_MS = 1000;       // a failed load is not retried before this
 	static constexpr size_t BLOCK_SIZE = 512;
 	static constexpr size_t MAX_SAFE_ALLOCATION = 32 * 1024 * 1024;
+	static constexpr uint32_t STALE_DIR_MINUTES = 30 * 24 * 60;  // unregistered fonts untouched this long lose their directory
+	static constexpr uint32_t STALE_TEMP_MINUTES = 10;           // younger temporaries may still belong to a live writer
+	static constexpr uint32_t COLD_BLOCK_MINUTES = 7 * 24 * 60;  // blocks of fonts in use are only evicted once unused this long
+	static constexpr DWORD GC_IDLE_DELAY_MS = 2 * 60 * 1000;
+	static constexpr DWORD IN_USE_LOCK_TIMEOUT_MS = 250;         // the collector only holds it exclusively while it deletes a dead directory
+
+public:
+	static constexpr uint32_t MIN_CACHE_BUDGET_MB = 64;
+	static constexpr uint32_t MAX_CACHE_BUDGET_MB = 8192;
+	static constexpr uint32_t DEFAULT_CACHE_BUDGET_MB = 512;
+
+	static void SetCacheBudget(uint64_t bytes) { s_cacheBudget = bytes; }
+	// call from the main thread on every update, starts the collector once the session has settled
+	static void GarbageCollectorTick();
+	static void StopGarbageCollector();
+
+	// packs every glyph of the font, directory and previous archive alike, into a single read-only file
+	bool PackArchive(uint32_t& outGlyphs);
+	void CloseArchive();
+
+private:
 
 	struct CacheKey {
 		uint32_t sdfRenderSize = 0;
@@ -65,7 +110,7 @@ private:
 		uint32_t version;
 		CacheKey key;
 		uint32_t entryCount;
-		uint32_t pad;
+		uint32_t stampCount; // BlockStamp records following the entries
 	};
 
 	struct ManifestEntry {
@@ -73,11 +118,18 @@ private:
 		uint32_t blockId;
 	};
 
+	struct BlockStamp {
+		uint32_t blockId;
+		uint32_t lastUse; // minutes since the epoch
+	};
+
 	struct alignas(64) BlockFileHeader {
 		uint32_t magic;
 		uint32_t version;
 		uint32_t blockId;
 		uint32_t entryCount;
+		uint32_t payloadSize; // bytes after the hash table, the arena sizes the block's mapping from it
+		uint32_t checksum;    // CRC32C of the entry and hash tables
 	};
 
 	struct alignas(64) GlyphEntry {
@@ -88,52 +140,208 @@ private:
 		FT_Int bitmapLeft;
 		uint32_t dataOffset;
 		uint32_t dataSize;
+		uint8_t tier; // MSDF::QUALITY_TIERS index
+		uint32_t sharedId;    // MSDFDedup payload id, 0 - payload stored in this block
+		uint64_t outlineHash; // MSDFDedup key, guards against ids recycled by a wiped store
 
 		bool operator<(const GlyphEntry& other) const { return codepoint < other.codepoint; }
 	};
+
+	struct KerningHeader {
+		uint32_t magic;
+		uint32_t version;
+		FontHash fontHash;
+		uint32_t entryCount;
+		uint32_t pad;
+	};
+
+	// unscaled (font unit) kerning of a glyph index pair
+	struct KerningEntry {
+		uint32_t left;
+		uint32_t right;
+		int16_t x;
+		int16_t y;
+	};
+
+	struct ProfileHeader {
+		uint32_t magic;
+		uint32_t version;
+		FontHash fontHash;
+		uint32_t entryCount;
+		uint32_t pad;
+	};
+
+	struct SnapshotHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t chunkCount;
+		uint32_t pad;
+	};
+
+	// precedes each chunk, every chunk is an XPRESS Huffman stream of its own
+	struct SnapshotChunk {
+		uint32_t rawSize;
+		uint32_t compressedSize; // nothing follows an empty chunk
+	};
+
+	// how far MSDFBackground got through a codepoint range
+	struct PregenHeader {
+		uint32_t magic;
+		uint32_t version;
+		FontHash fontHash;
+		uint32_t rangeFirst;
+		uint32_t rangeLast;
+		uint32_t cursor; // every codepoint of the range below it is cached or missing from the font
+		uint32_t pad;
+	};
+
+	// decayed per-session use count of a glyph, the warmup loads the highest scores first
+	struct ProfileEntry {
+		uint32_t codepoint;
+		float score;
+	};
+
+	// read-only single file cache: header, region table and the codepoint-sorted entries form the index,
+	// followed by one payload region per block, each mapped on its first hit and kept for the session
+	struct alignas(64) ArchiveHeader {
+		uint32_t magic;
+		uint32_t version;
+		FontHash fontHash;
+		CacheKey key;
+		uint32_t regionCount;
+		uint32_t entryCount;
+		uint32_t indexSize; // bytes from the start of the file to the end of the entries
+		uint32_t checksum;  // CRC32C of the region table and the entries
+	};
+
+	struct ArchiveRegion {
+		uint32_t offset; // multiple of ARCHIVE_REGION_ALIGNMENT
+		uint32_t size;
+	};
+
+	struct ArchiveEntry {
+		uint32_t codepoint;
+		uint32_t region;
+		uint32_t dataOffset; // from the start of the region
+		uint32_t dataSize;
+		FT_Int bitmapTop;
+		FT_Int bitmapLeft;
+		uint16_t width;
+		uint16_t height;
+		uint8_t tier;
+		uint8_t pad[3];
+	};
 #pragma pack(pop)
 
+	static_assert(sizeof(SnapshotHeader) == 16);
+	static_assert(sizeof(SnapshotChunk) == 8);
+	static_assert(sizeof(ProfileHeader) == 24);
+	static_assert(sizeof(ProfileEntry) == 8);
+	static_assert(sizeof(PregenHeader) == 32);
+	static_assert(sizeof(ArchiveHeader) == 64);
+	static_assert(sizeof(ArchiveRegion) == 8);
+	static_assert(sizeof(ArchiveEntry) == 32);
 	static_assert(sizeof(ManifestHeader) == 24);
 	static_assert(sizeof(ManifestEntry) == 8);
+	static_assert(sizeof(BlockStamp) == 8);
 	static_assert(sizeof(BlockFileHeader) == 64);
 	static_assert(sizeof(GlyphEntry) == 64);
-
-	bool TryLoadGlyph(uint32_t codepoint, GlyphMetrics& outMetrics);
+	static_assert(sizeof(KerningHeader) == 24);
+	static_assert(sizeof(KerningEntry) == 12);
+
+	bool TryLoadGlyph(uint32_t codepoint, GlyphMetrics& outMetrics, uint64_t* outOutlineHash = nullptr, uint32_t* outDataSize = nullptr);
+	bool TryLoadDirectoryGlyph(uint32_t codepoint, GlyphMetrics& outMetrics, uint64_t* outOutlineHash, uint32_t* outDataSize = nullptr);
+	bool TryLoadArchivedGlyph(uint32_t codepoint, GlyphMetrics& outMetrics, uint32_t* outDataSize = nullptr);
+	const ArchiveEntry* FindArchiveEntry(uint32_t codepoint);
+	// archive, manifest or pending, without mapping or reading any payload
+	bool Contains(uint32_t codepoint);
+	bool OpenArchive();
+	// names the archive in archive.ref of the font directory, the collector keeps an archive only while a directory names it
+	void WriteArchiveRef() const;
+	bool LoadGlyphFromBlock(const BlockWrap& wrap, uint32_t codepoint, GlyphMetrics& outMetrics, uint64_t* outOutlineHash, uint32_t* outDataSize);
 	bool StoreGlyph(GlyphMetricsToStore&& metrics);
 	size_t GetManifestSize();
 
 	using ManifestMap = ankerl::unordered_dense::map<uint32_t, ManifestEntry>;
+	using StampMap = ankerl::unordered_dense::map<uint32_t, uint32_t>;
 
-	bool LoadManifest();
+	// after a failure lookups return false right away until MANIFEST_RETRY_MS have passed, only a long wait retries at once
+	bool LoadManifest(DWORD timeoutMs = MANIFEST_LOCK_TIMEOUT_MS);
 	bool SaveManifest(bool isLocked = false);
-	bool LoadManifestFromFile(const std::filesystem::path& path, ManifestMap& outMap) const;
+	static bool LoadManifestFromFile(const std::filesystem::path& path, const CacheKey& key, ManifestMap& outMap, StampMap* outStamps = nullptr);
+	static bool WriteManifestFile(const std::filesystem::path& path, const CacheKey& key, const std::vector<ManifestEntry>& entries, const StampMap& stamps);
 	static bool LoadManifestJournal(const std::filesystem::path& journalPath, ManifestMap& outMap, size_t& outEntriesApplied);
 	bool AppendManifestJournal(const std::vector<ManifestEntry>& entries);
 
+	bool LoadKerning(std::vector<KerningEntry>& outEntries) const;
+	bool SaveKerning(const std::vector<KerningEntry>& entries) const;
+
+	bool LoadProfile(std::vector<ProfileEntry>& outEntries) const;
+	bool SaveProfile(const std::vector<ProfileEntry>& entries) const;
+
+	// a cursor saved for another range is ignored
+	bool LoadPregenCursor(const MSDF::CodepointRange& range, uint32_t& outCursor) const;
+	bool SavePregenCursor(const MSDF::CodepointRange& range, uint32_t cursor) const;
+
+	// one snapshot for the whole atlas pool under CACHE_DIR, its layout belongs to MSDFFont and the cache only stores it compressed.
+	// it is produced and consumed one chunk at a time, so at most one chunk and its compressed copy are held
+	using SnapshotWriter = std::function<bool(uint32_t chunk, std::vector<uint8_t>& outData)>;
+	using SnapshotReader = std::function<bool(uint32_t chunk, const std::vector<uint8_t>& data)>;
+	static bool LoadAtlasSnapshot(const SnapshotReader& reader);
+	static bool SaveAtlasSnapshot(uint32_t chunkCount, const SnapshotWriter& writer);
+
 	void BuildBlockLockPath(uint32_t blockId, std::filesystem::path& outPath) const;
 	void BuildBlockPath(uint32_t blockId, std::filesystem::path& outPath) const;
 
 	bool FlushPendingWrites();
 	bool WriteBlockFile(uint32_t blockId, std::vector<GlyphMetricsToStore*>& pending, std::vector<ManifestEntry>& outEntries);
 	void CleanupOrphans() const;
+	static void RemoveStaleTemporaries(const std::filesystem::path& dir, uint32_t minAgeMinutes);
+
+	// runs on its own idle priority thread, touches nothing but the files under CACHE_DIR
+	static void CollectGarbage(uint64_t budget);
+	static bool IsDirActive(const std::filesystem::path& dir); // open in this process
+	static bool IsDirLive(const std::filesystem::path& dir);   // open in this process or held by another client
+	static uint32_t GetStampNow();
+	static uint32_t GetFileStamp(const std::filesystem::directory_entry& entry);
 
 	static uint32_t GetBlockId(uint32_t codepoint);
 	static std::string GetCacheBasePath(const char* familyName, const char* styleName, uint32_t sdfRenderSize, uint32_t sdfSpread);
 	static std::string SanitizeName(std::string_view name);
 
-	static void InitializeBlacklist();
-	static bool IsFontBlacklisted(const char* familyName, const char* styleName, const uint8_t* fontData, size_t dataSize);
+	// built on the first font registration, file contents are only read for fonts new to the memo
+	static void BuildBlacklistIndex();
+	static bool HashFontFile(const std::filesystem::directory_entry& entry, FontHash& outHash);
+	static void SaveFontHashMemo();
+
+	// MSDF compatibility depends only on the font file, the validator and the checked range
+	static bool LookupVerdict(FontHash fontHash, const MSDF::CodepointRange& range, uint32_t validatorVersion, bool& outCompatible);
+	static void StoreVerdict(FontHash fontHash, const MSDF::CodepointRange& range, uint32_t validatorVersion, bool compatible);
+	static void LoadVerdicts();
+	static bool IsFontBlacklisted(const char* familyName, const char* styleName, FontHash fontHash);
 	static uint64_t HashNormalizedString(std::string_view str);
 
 	std::filesystem::path m_cacheBasePath;
 	std::filesystem::path m_cacheManifestPath;
 	std::filesystem::path m_cacheManifestLockPath;
 	std::filesystem::path m_cacheManifestJournalPath;
+	std::filesystem::path m_cacheKerningPath;
+	std::filesystem::path m_cacheProfilePath;
+	std::filesystem::path m_cachePregenPath;
+	std::filesystem::path m_archivePath;
+	ScopedFileLock m_inUseLock; // inuse.lock held shared for the cache's lifetime, other clients' collectors leave the directory alone
 
 	CacheKey m_key;
 	ManifestMap m_manifest;
+	StampMap m_blockStamps;
+	bool m_stampsDirty = false;
 
 	bool m_manifestLoaded = false;
+	ULONGLONG m_manifestRetryTick = 0;
+	bool m_archiveChecked = false;
+	HANDLE m_archiveMapping = nullptr;
+	const uint8_t* m_archiveIndex = nullptr;         // header through entries, validated once on open
+	std::vector<const uint8_t*> m_archiveRegions;    // per region view, nullptr until first hit
 	uint32_t m_fontID = 0xFFFFFFFF;
 
 	VectorPool<uint8_t> m_vecPool;
@@ -145,13 +353,17 @@ private:
 
 	ankerl::unordered_dense::map<uint32_t, BlockWrap> m_blockWrap;
 
-	struct BlacklistAutoRunner {
-		BlacklistAutoRunner() { InitializeBlacklist(); }
-	};
-
-	static BlacklistAutoRunner s_blacklistAutoRunner;
+	inline static bool s_blacklistIndexed = false;
 	inline static ankerl::unordered_dense::set<FontHash> s_blacklistHashes;
 
+	inline static std::atomic<uint64_t> s_cacheBudget = static_cast<uint64_t>(DEFAULT_CACHE_BUDGET_MB) * 1024 * 1024;
+	inline static std::atomic<bool> s_gcStop = false;
+	inline static bool s_gcStarted = false;
+	inline static std::thread s_gcThread;
+	inline static std::mutex s_activeDirsMutex; // directories of the live caches, shared with the collector
+	inline static std::vector<std::filesystem::path> s_activeDirs;
+	inline static ULONGLONG s_gcFirstTick = 0;
+
 	static MSDFManager s_manager;
 };
 
@@ -0,0 +1,192 @@
+#include "MSDFDedup.h"
+#include <fstream>
+
+MSDFDedup::OutlineHash MSDFDedup::HashOutline(FT_Face face, FT_UInt glyphIndex, const MSDF::QualityTier& tier, uint16_t width, uint16_t height, FT_Int bitmapLeft, FT_Int bitmapTop) {
+	// the same unscaled outline GenerateMSDF reads through msdfgen
+	if (FT_Load_Glyph(face, glyphIndex, FT_LOAD_NO_SCALE) != 0) return 0;
+	if (face->glyph->format != FT_GLYPH_FORMAT_OUTLINE) return 0;
+	const FT_Outline& outline = face->glyph->outline;
+	if (outline.n_contours == 0 || outline.n_points == 0) return 0;
+
+	// everything else the generated pixels depend on
+	const int32_t params[] = {static_cast<int32_t>(OUTLINE_HASH_VERSION), face->units_per_EM, static_cast<int32_t>(tier.renderSize), static_cast<int32_t>(tier.spread), width, height, bitmapLeft, bitmapTop, outline.n_contours, outline.n_points};
+
+	std::vector<uint8_t>& buf = s_hashBuffer;
+	buf.resize(sizeof(params) + outline.n_points * (2 * sizeof(int32_t) + 1) + outline.n_contours * sizeof(uint16_t));
+	uint8_t* p = buf.data();
+	std::memcpy(p, params, sizeof(params));
+	p += sizeof(params);
+	for (unsigned short i = 0; i < outline.n_points; ++i) {
+		const int32_t xy[2] = {static_cast<int32_t>(outline.points[i].x), static_cast<int32_t>(outline.points[i].y)};
+		std::memcpy(p, xy, sizeof(xy));
+		p += sizeof(xy);
+	}
+	// only the curve type, the rest are rasterizer hints msdfgen never looks at
+	for (unsigned short i = 0; i < outline.n_points; ++i) *p++ = static_cast<uint8_t>(FT_CURVE_TAG(outline.tags[i]));
+	std::memcpy(p, outline.contours, outline.n_contours * sizeof(uint16_t));
+
+	const OutlineHash hash = HashFont(buf.data(), static_cast<FT_Long>(buf.size()));
+	return hash ? hash : 1;
+}
+
+uint32_t MSDFDedup::Find(OutlineHash hash, uint16_t width, uint16_t height, const uint8_t*& outPixels) {
+	if (!hash || !GetStore()) return 0;
+	auto it = s_index.find(hash);
+	if (it == s_index.end()) {
+		RefreshIndex();
+		it = s_index.find(hash);
+		if (it == s_index.end()) return 0;
+	}
+	const uint32_t sharedId = it->second;
+	return LoadPayload(sharedId, hash, width, height, outPixels) ? sharedId : 0;
+}
+
+uint32_t MSDFDedup::Store(OutlineHash hash, const GlyphMetricsToStore& glyph) {
+	if (!hash || glyph.dataSize == 0 || !GetStore()) return 0;
+
+	// a lost payload is simply stored again under its old id, the index record waits for the store's next flush
+	uint32_t sharedId = 0;
+	auto it = s_index.find(hash);
+	if (it != s_index.end()) { sharedId = it->second; }
+	else {
+		if (s_nextId == s_reservedEnd && !ReserveIds()) return 0;
+		sharedId = s_nextId++;
+		s_index.emplace(hash, sharedId);
+		s_pendingRecords.push_back({.hash = hash, .sharedId = sharedId, .pad = 0});
+	}
+
+	GlyphMetricsToStore payload;
+	payload.codepoint = sharedId;
+	payload.width = glyph.width;
+	payload.height = glyph.height;
+	payload.bitmapTop = glyph.bitmapTop;
+	payload.bitmapLeft = glyph.bitmapLeft;
+	payload.tier = glyph.tier;
+	payload.ownedPixelData = glyph.ownedPixelData;
+	payload.dataSize = glyph.dataSize;
+	payload.outlineHash = hash;
+	if (!s_store->StoreGlyph(std::move(payload))) return 0;
+
+	++MSDF::g_dedupStats.sharedStores;
+	return sharedId;
+}
+
+bool MSDFDedup::LoadPayload(uint32_t sharedId, OutlineHash hash, uint16_t width, uint16_t height, const uint8_t*& outPixels) {
+	if (!GetStore()) return false;
+
+	GlyphMetrics shared;
+	OutlineHash storedHash = 0;
+	if (!s_store->TryLoadGlyph(sharedId, shared, &storedHash) && !FindPending(sharedId, storedHash, shared.width, shared.height, shared.pixelData)) return false;
+	// ids restart from 1 once the collector wipes the store, the hash tells a recycled one apart
+	if (storedHash != hash || shared.width != width || shared.height != height || !shared.pixelData) return false;
+
+	outPixels = shared.pixelData;
+	return true;
+}
+
+bool MSDFDedup::FindPending(uint32_t sharedId, OutlineHash& outHash, uint16_t& outWidth, uint16_t& outHeight, const uint8_t*& outPixels) {
+	for (const GlyphMetricsToStore& pending : s_store->m_pendingWrites) {
+		if (pending.codepoint != sharedId) continue;
+		outHash = pending.outlineHash;
+		outWidth = pending.width;
+		outHeight = pending.height;
+		outPixels = pending.ownedPixelData.data();
+		return true;
+	}
+	return false;
+}
+
+MSDFCache* MSDFDedup::GetStore() {
+	if (!s_store) {
+		s_store = std::make_unique<MSDFCache>(STORE_FONT_HASH, "_shared", "payloads", MSDF::SDF_RENDER_SIZE, MSDF::SDF_SPREAD);
+		s_indexPath = s_store->m_cacheBasePath / "outlines.dat";
+		s_indexLockPath = s_store->m_cacheBasePath / "outlines.lock";
+		RefreshIndex();
+	}
+	return s_store.get();
+}
+
+void MSDFDedup::RefreshIndex(bool force) {
+	const ULONGLONG now = GetTickCount64();
+	if (!force && now < s_nextRefreshTick) return;
+	s_nextRefreshTick = now + INDEX_REFRESH_MS;
+
+	std::error_code ec;
+	const uint64_t fsize = std::filesystem::file_size(s_indexPath, ec);
+	if (ec || fsize <= s_indexBytesRead) return;
+
+	std::ifstream in(s_indexPath, std::ios::binary);
+	if (!in.good()) return;
+
+	if (s_indexBytesRead == 0) {
+		IndexHeader hdr{};
+		if (!in.read(reinterpret_cast<char*>(&hdr), sizeof(hdr)) || hdr.magic != INDEX_MAGIC || hdr.version != OUTLINE_HASH_VERSION) return;
+		s_indexBytesRead = sizeof(hdr);
+	}
+	in.seekg(static_cast<std::streamoff>(s_indexBytesRead));
+
+	IndexRecord record;
+	while (in.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+		if (record.hash) s_index[record.hash] = record.sharedId;
+		s_fileNextId = std::max(s_fileNextId, record.sharedId + 1);
+		s_indexBytesRead += sizeof(record);
+	}
+}
+
+bool MSDFDedup::ReserveIds() {
+	ScopedFileLock lock;
+	if (!lock.AcquireExclusive(s_indexLockPath, RESERVE_LOCK_TIMEOUT_MS)) return false;
+	RefreshIndex(true);
+	// a record without a hash claims every id up to its own, other clients continue after it
+	const uint32_t first = s_fileNextId;
+	const IndexRecord reservation{.hash = 0, .sharedId = first + ID_RESERVATION - 1, .pad = 0};
+	if (!AppendIndexRecords(&reservation, 1)) return false;
+	s_nextId = first;
+	s_reservedEnd = first + ID_RESERVATION;
+	s_fileNextId = s_reservedEnd;
+	return true;
+}
+
+void MSDFDedup::FlushIndex() {
+	if (s_pendingRecords.empty()) return;
+	ScopedFileLock lock;
+	if (!lock.AcquireExclusive(s_indexLockPath, 1000)) return;
+	RefreshIndex(true);
+	// the ids are ours either way, records that fail to land only keep other clients from sharing the payloads
+	AppendIndexRecords(s_pendingRecords.data(), s_pendingRecords.size());
+	s_pendingRecords.clear();
+}
+
+bool MSDFDedup::AppendIndexRecords(const IndexRecord* records, size_t count) {
+	// nothing readable yet, the file is missing, truncated or from another hash version
+	const bool fresh = s_indexBytesRead == 0;
+	FileGuard file(CreateFileW(s_indexPath.c_str(), fresh ? GENERIC_WRITE : FILE_APPEND_DATA, FILE_SHARE_READ, nullptr, fresh ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+	if (!file.IsValid()) return false;
+
+	DWORD written = 0;
+	if (fresh) {
+		const IndexHeader hdr{.magic = INDEX_MAGIC, .version = OUTLINE_HASH_VERSION};
+		if (!WriteFile(file, &hdr, sizeof(hdr), &written, nullptr) || written != sizeof(hdr)) return false;
+		s_indexBytesRead = sizeof(hdr);
+	}
+	const DWORD bytes = static_cast<DWORD>(count * sizeof(IndexRecord));
+	if (!WriteFile(file, records, bytes, &written, nullptr) || written != bytes) return false;
+	s_indexBytesRead += bytes;
+	file.successful = true;
+	return true;
+}
+
+void MSDFDedup::Shutdown() {
+	if (s_store) {
+		s_store->FlushPendingWrites();
+		FlushIndex();
+	}
+	s_store.reset();
+	s_index.clear();
+	s_pendingRecords.clear();
+	s_indexBytesRead = 0;
+	s_nextRefreshTick = 0;
+	s_fileNextId = 1;
+	s_nextId = 0;
+	s_reservedEnd = 0;
+}
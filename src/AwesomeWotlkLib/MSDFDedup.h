@@ -0,0 +1,74 @@
+#pragma once
+#include "MSDF.h"
+#include "MSDFCache.h"
+#include "unordered_dense/include/ankerl/unordered_dense.h"
+#include <filesystem>
+#include <memory>
+
+// content-addressed store of MSDF payloads shared by every font cache, keyed by the glyph outline and its generation parameters.
+// font caches keep only metrics and a reference, so a glyph repeated across fonts or repackagings is generated and stored once
+class MSDFDedup {
+public:
+	using OutlineHash = uint64_t;
+
+	static bool IsEnabled() { return s_enabled; }
+	static void SetEnabled(bool enabled) { s_enabled = enabled; }
+
+	// 0 when the glyph has nothing to share, leaves the face's glyph slot loaded unscaled
+	static OutlineHash HashOutline(FT_Face face, FT_UInt glyphIndex, const MSDF::QualityTier& tier, uint16_t width, uint16_t height, FT_Int bitmapLeft, FT_Int bitmapTop);
+	// id of a payload generated earlier for any font, 0 if there is none yet
+	static uint32_t Find(OutlineHash hash, uint16_t width, uint16_t height, const uint8_t*& outPixels);
+	// copies the generated payload into the store, returns the id a font entry refers to it by, 0 on failure
+	static uint32_t Store(OutlineHash hash, const GlyphMetricsToStore& glyph);
+	static bool LoadPayload(uint32_t sharedId, OutlineHash hash, uint16_t width, uint16_t height, const uint8_t*& outPixels);
+	// appends the index records queued by Store, the store calls it once their payloads are written
+	static void FlushIndex();
+	static bool IsStore(const MSDFCache* cache) { return cache && cache == s_store.get(); }
+
+	static size_t GetPayloadCount() { return s_index.size(); }
+	static void Shutdown();
+
+private:
+	static constexpr uint32_t INDEX_MAGIC = 0x4D534458;
+	static constexpr uint32_t OUTLINE_HASH_VERSION = 2; // bump whenever HashOutline or GenerateMSDF output changes
+	static constexpr FontHash STORE_FONT_HASH = ~0ULL;
+	static constexpr uint32_t ID_RESERVATION = 256;           // ids a client claims at once, Store only takes the index lock when they run out
+	static constexpr DWORD RESERVE_LOCK_TIMEOUT_MS = 20;      // on the render thread, a glyph that cannot get one is just not shared
+	static constexpr ULONGLONG INDEX_REFRESH_MS = 250;        // misses look at other clients' records at most this often
+
+#pragma pack(push, 1)
+	struct IndexHeader {
+		uint32_t magic;
+		uint32_t version;
+	};
+
+	struct IndexRecord {
+		OutlineHash hash;
+		uint32_t sharedId;
+		uint32_t pad;
+	};
+#pragma pack(pop)
+
+	static_assert(sizeof(IndexHeader) == 8);
+	static_assert(sizeof(IndexRecord) == 16);
+
+	static MSDFCache* GetStore();
+	// applies records other clients appended since the last look
+	static void RefreshIndex(bool force = false);
+	static bool AppendIndexRecords(const IndexRecord* records, size_t count);
+	static bool ReserveIds();
+	static bool FindPending(uint32_t sharedId, OutlineHash& outHash, uint16_t& outWidth, uint16_t& outHeight, const uint8_t*& outPixels);
+
+	inline static bool s_enabled = true;
+	inline static std::unique_ptr<MSDFCache> s_store;
+	inline static std::filesystem::path s_indexPath;
+	inline static std::filesystem::path s_indexLockPath;
+	inline static uint64_t s_indexBytesRead = 0;
+	inline static ULONGLONG s_nextRefreshTick = 0;
+	inline static uint32_t s_fileNextId = 1; // first id no record in the index has claimed
+	inline static uint32_t s_nextId = 0;     // next of the ids reserved for this client
+	inline static uint32_t s_reservedEnd = 0;
+	inline static std::vector<IndexRecord> s_pendingRecords;
+	inline static ankerl::unordered_dense::map<OutlineHash, uint32_t> s_index;
+	inline static std::vector<uint8_t> s_hashBuffer;
+};
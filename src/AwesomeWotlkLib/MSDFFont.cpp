@@ -1,24 +1,65 @@
 #include "MSDFFont.h"
+#include "MSDFBackground.h"
+#include "MSDFBitmapCache.h"
 #include "MSDFCache.h"
+#include "MSDFDedup.h"
+#include "MSDFSharedMemory.h"
 #include "MSDFValidator.h"
 #include "MSDFUtils.h"
+#include "MSDFRaster.h"
+#include <array>
+#include <cmath>
 #include <ranges>
 
-MSDFFont::MSDFFont(FT_Face face, const FT_Byte* fontData, FT_Long dataSize) : m_ftFace(face), m_msdfFont(nullptr), m_isValid(false), m_oldestPage(0), m_evictionCount(0) {
-	if (!face || MSDFCache::IsFontBlacklisted(face->family_name ? face->family_name : "Unknown", face->style_name ? face->style_name : "", fontData, static_cast<size_t>(dataSize))) { return; }
+namespace {
+	// codepoints whose glyphs get a slot in the dense kerning table
+	constexpr std::pair<uint32_t, uint32_t> KERNING_DENSE_RANGES[] = {
+		{0x0020, 0x00FF}, // Basic Latin, Latin-1
+		{0x0400, 0x045F}, // Cyrillic
+	};
+
+	// staged with a zero pitch to clear any width of a page
+	constexpr std::array<uint8_t, MSDF::ATLAS_SIZE * 4> ZERO_ROW{};
+
+	LONGLONG GetPerformanceFrequency() {
+		static const LONGLONG frequency = [] {
+			LARGE_INTEGER freq;
+			QueryPerformanceFrequency(&freq);
+			return freq.QuadPart;
+		}();
+		return frequency;
+	}
+}
+
+MSDFFont::MSDFFont(FT_Face face, const FT_Byte* fontData, FT_Long dataSize) : m_ftFace(face), m_msdfFont(nullptr), m_isValid(false), m_evictionCount(0) {
+	if (!face) return;
+	// one fingerprint serves both the blacklist lookup and the cache identity
+	const FontHash fontHash = HashFont(fontData, dataSize);
+	m_fontHash = fontHash;
+	if (MSDFCache::IsFontBlacklisted(face->family_name ? face->family_name : "Unknown", face->style_name ? face->style_name : "", fontHash)) { return; }
 
 	m_msdfFont = CreateMSDFHandle(fontData, dataSize);
 	if (!m_msdfFont) return;
 
-	m_cache = std::make_unique<MSDFCache>(fontData, dataSize, face->family_name ? face->family_name : "Unknown", face->style_name ? face->style_name : "", MSDF::SDF_RENDER_SIZE, MSDF::SDF_SPREAD);
+	m_cache = std::make_unique<MSDFCache>(fontHash, face->family_name ? face->family_name : "Unknown", face->style_name ? face->style_name : "", MSDF::SDF_RENDER_SIZE, MSDF::SDF_SPREAD);
 
-	m_isValid = MSDF::ALLOW_UNSAFE_FONTS || MSDFValidator::IsFontMSDFCompatible(m_msdfFont);
+	const MSDF::CodepointRange range = MSDF::GetLocaleRange(MSDF::GetGameLocale());
+	if (!MSDFCache::LookupVerdict(fontHash, range, MSDFValidator::VERSION, m_isCompatible)) {
+		m_isCompatible = MSDFValidator::IsFontMSDFCompatible(m_msdfFont, range);
+		MSDFCache::StoreVerdict(fontHash, range, MSDFValidator::VERSION, m_isCompatible);
+	}
+	m_isValid = MSDF::ALLOW_UNSAFE_FONTS || m_isCompatible;
 	if (m_isValid) m_glyphPool.reserve(4096);
 }
 
 MSDFFont::~MSDFFont() {
+	if (m_kerningDirty) SaveKerning();
+	if (m_isValid) SaveProfile();
+	// the pooled pages outlive the font, its glyphs there are dead space until the page is recycled
+	for (const auto& page : s_atlasPages) std::erase_if(page->glyphs, [this](const PageGlyph& glyph) { return glyph.font == this; });
+	++s_atlasVersion;
+	m_glyphRuns.Clear();
 	m_glyphPool.clear();
-	m_atlasPages.clear();
 	m_cache.reset();
 	if (m_msdfFont) {
 		msdfgen::destroyFont(m_msdfFont);
@@ -27,121 +68,566 @@ MSDFFont::~MSDFFont() {
 }
 
 MSDFFont* MSDFFont::Get(FT_Face face) {
+	if (face == s_lastFace) return s_lastFont;
 	auto it = s_fontHandles.find(face);
-	if (it != s_fontHandles.end() && it->second->IsValid()) { return it->second.get(); }
-	return nullptr;
+	s_lastFace = face;
+	s_lastFont = (it != s_fontHandles.end() && it->second->IsValid()) ? it->second.get() : nullptr;
+	return s_lastFont;
 }
 
 void MSDFFont::Register(FT_Face face, const FT_Byte* data, FT_Long size) {
 	if (s_fontHandles.find(face) != s_fontHandles.end()) return;
+	s_lastFace = nullptr;
+	s_lastFont = nullptr;
 	auto font = std::make_unique<MSDFFont>(face, data, size);
-	if (font->m_msdfFont && font->m_isValid) s_fontHandles[face] = std::move(font);
+	if (font->m_msdfFont && font->m_isValid) {
+		MSDFBackground::Register(face, data, size, face->face_index, font->m_fontHash);
+		s_fontHandles[face] = std::move(font);
+	}
+	// the engine keeps rasterizing whatever MSDF turned down
+	else MSDFBitmapCache::Register(face, font->m_fontHash);
 }
 
 void MSDFFont::Unregister(FT_Face face) {
+	// whatever the workers rendered for this face still lands in its cache
+	MSDFBackground::Unregister(face);
+	s_lastFace = nullptr;
+	s_lastFont = nullptr;
 	auto it = s_fontHandles.find(face);
 	if (it != s_fontHandles.end()) { s_fontHandles.erase(it); }
+	MSDFBitmapCache::Unregister(face);
+}
+
+void MSDFFont::OnDeviceDestroy() {
+	SaveSnapshot();
+	ClearAllCache();
+	ReleaseStaging();
+	s_pagesLost = false;
+}
+
+void MSDFFont::OnDeviceRestore() {
+	// a format change restores without releasing anything first
+	if (!s_pagesLost) return;
+	s_pagesLost = false;
+	if (s_atlasPages.empty()) return;
+	// a page the device did not give back takes its glyphs with it, the atlas is rebuilt on demand
+	if (std::ranges::any_of(s_atlasPages, [](const auto& page) { return !page->texture; })) {
+		ClearAllCache();
+		return;
+	}
+	// placements nobody has claimed yet are not composed back
+	s_snapshotFonts.clear();
+	// glyphs generated since the last flush are only readable once they are on disk
+	for (const auto& handle : s_fontHandles | std::views::values) { if (handle && handle->m_cache) handle->m_cache->FlushPendingWrites(); }
+
+	constexpr size_t rowBytes = MSDF::ATLAS_SIZE * 4;
+	std::vector<uint8_t> pixels;
+	std::vector<PageGlyph> lost;
+	s_uploadBatch = true;
+	for (size_t i = 0; i < s_atlasPages.size(); ++i) {
+		AtlasPage* page = s_atlasPages[i].get();
+		const uint32_t rows = GetUsedRows(*page);
+		pixels.assign(rows * rowBytes, 0);
+		ComposePage(i, rows, pixels.data(), lost);
+		if (rows) StageRegion(page, 0, 0, MSDF::ATLAS_SIZE, rows, pixels.data(), rowBytes);
+		if (rows < MSDF::ATLAS_SIZE) StageRegion(page, 0, rows, MSDF::ATLAS_SIZE, MSDF::ATLAS_SIZE - rows, ZERO_ROW.data(), 0);
+	}
+	EndUploadBatch();
+
+	std::ranges::sort(lost, {}, &PageGlyph::font);
+	for (size_t i = 0; i < lost.size(); ++i) {
+		const PageGlyph& glyph = lost[i];
+		auto it = glyph.font->m_glyphPool.find(glyph.codepoint);
+		std::erase_if(s_atlasPages[it->second.atlasPageIndex]->glyphs, [&glyph](const PageGlyph& placed) { return placed.font == glyph.font && placed.codepoint == glyph.codepoint; });
+		glyph.font->m_glyphPool.erase(it);
+		// runs recorded against the lost glyphs must not replay, once per font keeps the 7 bit string token from wrapping
+		if (i == 0 || lost[i - 1].font != glyph.font) glyph.font->m_evictionCount++;
+	}
+	if (!lost.empty()) ++s_atlasVersion;
 }
 
 void MSDFFont::ClearAllCache() {
 	for (auto& handle : s_fontHandles | std::views::values) {
 		if (handle) {
+			handle->m_glyphRuns.Clear();
 			handle->m_glyphPool.clear();
-			handle->m_atlasPages.clear();
-			handle->m_oldestPage = 0;
 			handle->m_evictionCount++;
+			handle->m_warmedUp = false;
 		}
 	}
+	s_atlasPages.clear();
+	s_snapshotFonts.clear();
+	s_snapshotTried = false;
+	++s_atlasVersion;
 }
 
-void MSDFFont::Shutdown() { s_fontHandles.clear(); }
+void MSDFFont::Shutdown() {
+	SaveSnapshot();
+	MSDFCache::StopGarbageCollector();
+	MSDFBackground::Shutdown();
+	s_lastFace = nullptr;
+	s_lastFont = nullptr;
+	s_fontHandles.clear();
+	s_atlasPages.clear();
+	ReleaseStaging();
+	MSDFDedup::Shutdown();
+	MSDFSharedMemory::Shutdown();
+	MSDFBitmapCache::Shutdown();
+}
+
+uint32_t MSDFFont::PackArchives(uint32_t& outGlyphs) {
+	outGlyphs = 0;
+	// a binary registered under several names shares one archive, nobody may keep it mapped while it is replaced
+	for (const auto& font : s_fontHandles | std::views::values) { if (font->m_cache) font->m_cache->CloseArchive(); }
+
+	ankerl::unordered_dense::set<FontHash> packed;
+	uint32_t archives = 0;
+	for (const auto& font : s_fontHandles | std::views::values) {
+		if (!font->m_cache || !packed.insert(font->m_fontHash).second) continue;
+		uint32_t glyphs = 0;
+		if (!font->m_cache->PackArchive(glyphs)) continue;
+		++archives;
+		outGlyphs += glyphs;
+	}
+	return archives;
+}
+
+bool MSDFFont::GetGeometryStats(const char* familyName, MSDF::GeometryStats& outStats) {
+	bool found = false;
+	for (const auto& [face, handle] : s_fontHandles) {
+		if (!handle || !face->family_name || _stricmp(face->family_name, familyName) != 0) continue;
+		outStats.Add(handle->m_geometryStats);
+		found = true;
+	}
+	return found;
+}
+
+void MSDFFont::ResetGeometryStats() {
+	for (const auto& handle : s_fontHandles | std::views::values) { if (handle) handle->m_geometryStats.Reset(); }
+}
 
 const GlyphMetrics* MSDFFont::GetGlyph(uint32_t codepoint) {
 	auto pit = m_glyphPool.find(codepoint);
-	if (pit != m_glyphPool.end()) return &pit->second;
+	if (pit != m_glyphPool.end()) {
+		++MSDF::g_atlasStats.hits;
+		if (pit->second.uses != UINT8_MAX) ++pit->second.uses;
+		if (pit->second.width > 0) TouchPages(1u << pit->second.atlasPageIndex);
+		return &pit->second;
+	}
+	++MSDF::g_atlasStats.misses;
+
+	// the first miss of the session fills the atlas with what recent sessions used most
+	if (!m_warmedUp) {
+		WarmUp();
+		pit = m_glyphPool.find(codepoint);
+		if (pit != m_glyphPool.end()) {
+			pit->second.uses = 1;
+			if (pit->second.width > 0) TouchPages(1u << pit->second.atlasPageIndex);
+			return &pit->second;
+		}
+	}
 
 	auto [it, inserted] = m_glyphPool.try_emplace(codepoint);
 	GlyphMetrics& metrics = it->second;
+	metrics.uses = 1;
 
+	// another client on this machine may have it already, no file or lock is touched then
+	if (MSDFSharedMemory::Find(m_fontHash, codepoint, metrics)) return UploadGlyphToAtlas(codepoint);
+
+	// stream from the disk cache first, only the glyphs actually on screen ever reach the atlas
 	if (m_cache->TryLoadGlyph(codepoint, metrics)) {
-		UploadGlyphToAtlas(metrics, codepoint);
-		return &metrics;
+		++MSDF::g_atlasStats.diskLoads;
+		MSDFSharedMemory::Publish(m_fontHash, codepoint, metrics);
+		return UploadGlyphToAtlas(codepoint);
 	}
 
 	GlyphMetricsToStore storage;
-	storage.codepoint = codepoint;
-
-	if (FT_Set_Pixel_Sizes(m_ftFace, MSDF::SDF_RENDER_SIZE, MSDF::SDF_RENDER_SIZE) != 0) {
-		m_glyphPool.erase(it);
-		return nullptr;
-	}
-
-	FT_UInt glyphIndex = FT_Get_Char_Index(m_ftFace, codepoint);
-	if (FT_Load_Glyph(m_ftFace, glyphIndex, FT_LOAD_NO_BITMAP | FT_LOAD_NO_HINTING) != 0) {
+	FT_UInt glyphIndex = 0;
+	uint16_t sdfW = 0, sdfH = 0;
+	if (!MeasureGlyph(m_ftFace, codepoint, storage, glyphIndex, sdfW, sdfH)) {
 		m_glyphPool.erase(it);
 		return nullptr;
 	}
+	metrics.tier = storage.tier;
 
-	storage.bitmapLeft = m_ftFace->glyph->bitmap_left;
-	storage.bitmapTop = m_ftFace->glyph->bitmap_top;
-
-	const bool hasOutline = m_ftFace->glyph->format == FT_GLYPH_FORMAT_OUTLINE && m_ftFace->glyph->outline.n_contours > 0;
-	if (hasOutline) {
-		FT_BBox bbox;
-		FT_Outline_Get_BBox(&m_ftFace->glyph->outline, &bbox);
+	if (sdfW && sdfH) {
+		const MSDF::QualityTier& tier = MSDF::GetTier(storage.tier);
+		// the same outline from another font, or another copy of this one, reuses its payload
+		if (MSDFDedup::IsEnabled()) storage.outlineHash = MSDFDedup::HashOutline(m_ftFace, glyphIndex, tier, sdfW, sdfH, storage.bitmapLeft, storage.bitmapTop);
 
-		uint16_t w = static_cast<uint16_t>(std::max(0, static_cast<int>(((bbox.xMax + 63) >> 6) - (bbox.xMin >> 6))));
-		uint16_t h = static_cast<uint16_t>(std::max(0, static_cast<int>(((bbox.yMax + 63) >> 6) - (bbox.yMin >> 6))));
-
-		if (w > 0 && h > 0) {
-			uint16_t sdfW = w + 2 * MSDF::SDF_SPREAD;
-			uint16_t sdfH = h + 2 * MSDF::SDF_SPREAD;
+		const uint8_t* pixels = nullptr;
+		if (storage.outlineHash && (storage.sharedId = MSDFDedup::Find(storage.outlineHash, sdfW, sdfH, pixels))) { ++MSDF::g_dedupStats.sharedHits; }
+		else {
 			storage.ownedPixelData.reserve(static_cast<size_t>(sdfW) * sdfH * 4);
-			if (GenerateMSDF(storage.ownedPixelData, codepoint, sdfW, sdfH)) {
-				storage.width = sdfW;
-				storage.height = sdfH;
+			if (GenerateMSDF(storage.ownedPixelData, codepoint, sdfW, sdfH, tier.spread)) {
 				storage.dataSize = storage.ownedPixelData.size();
-				metrics.width = storage.width;
-				metrics.height = storage.height;
-				metrics.bitmapLeft = storage.bitmapLeft;
-				metrics.bitmapTop = storage.bitmapTop;
-				metrics.pixelData = storage.ownedPixelData.data();
-				UploadGlyphToAtlas(metrics, codepoint);
+				pixels = storage.ownedPixelData.data();
 			}
 		}
+		if (pixels) {
+			storage.width = sdfW;
+			storage.height = sdfH;
+			metrics.width = storage.width;
+			metrics.height = storage.height;
+			metrics.bitmapLeft = storage.bitmapLeft;
+			metrics.bitmapTop = storage.bitmapTop;
+			metrics.pixelData = pixels;
+			UploadGlyphToAtlas(codepoint);
+		}
+	}
+	// payloads reused from the shared store are counted by g_dedupStats
+	if (!storage.sharedId) ++MSDF::g_atlasStats.generated;
+	// placing it may have recycled a page of this font and moved the entry
+	GlyphMetrics& placed = m_glyphPool.find(codepoint)->second;
+	MSDFSharedMemory::Publish(m_fontHash, codepoint, placed);
+
+	// the font's own block then only keeps the metrics and a reference
+	if (storage.dataSize && storage.outlineHash && !storage.sharedId && (storage.sharedId = MSDFDedup::Store(storage.outlineHash, storage))) {
+		storage.ownedPixelData = {};
+		storage.dataSize = 0;
 	}
 	m_cache->StoreGlyph(std::move(storage));
 
-	return &metrics;
+	return &placed;
+}
+
+void MSDFFont::WarmUp() {
+	m_warmedUp = true;
+	if (!m_cache) return;
+	// the atlas as it was at the last shutdown or device loss, the profile then tops up whatever it lacks
+	if (s_atlasPages.empty() && !s_snapshotTried) RestoreSnapshot();
+	ClaimSnapshotGlyphs();
+	if (!s_warmupBudgetMs) return;
+
+	std::vector<MSDFCache::ProfileEntry> profile;
+	if (!m_cache->LoadProfile(profile) || profile.empty()) return;
+
+	LARGE_INTEGER freq, start, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+	const LONGLONG budget = freq.QuadPart * s_warmupBudgetMs / 1000;
+	const uint64_t evictions = MSDF::g_atlasStats.evictions;
+
+	// the profile is stored best first, whatever the budget cuts off is the least used
+	s_uploadBatch = true;
+	for (const MSDFCache::ProfileEntry& entry : profile) {
+		QueryPerformanceCounter(&now);
+		if (now.QuadPart - start.QuadPart > budget) break;
+
+		auto [it, inserted] = m_glyphPool.try_emplace(entry.codepoint);
+		if (!inserted) continue;
+		GlyphMetrics& metrics = it->second;
+		// only what is already cached, generating would blow any budget
+		if (!MSDFSharedMemory::Find(m_fontHash, entry.codepoint, metrics) && !m_cache->TryLoadGlyph(entry.codepoint, metrics)) {
+			m_glyphPool.erase(it);
+			continue;
+		}
+		UploadGlyphToAtlas(entry.codepoint);
+		++MSDF::g_atlasStats.warmed;
+		// the profile outgrew the shared budget, recycling pages would throw this or another font's glyphs away again
+		if (MSDF::g_atlasStats.evictions != evictions) break;
+	}
+	EndUploadBatch();
+}
+
+void MSDFFont::SaveProfile() const {
+	if (!m_cache) return;
+	// a session the font went unused in leaves its profile alone
+	if (std::ranges::none_of(m_glyphPool | std::views::values, [](const GlyphMetrics& metrics) { return metrics.uses != 0; })) return;
+
+	std::vector<MSDFCache::ProfileEntry> profile;
+	m_cache->LoadProfile(profile);
+
+	ankerl::unordered_dense::map<uint32_t, float> scores;
+	scores.reserve(profile.size() + m_glyphPool.size());
+	for (const MSDFCache::ProfileEntry& entry : profile) scores[entry.codepoint] = entry.score * PROFILE_DECAY;
+	for (const auto& [codepoint, metrics] : m_glyphPool) { if (metrics.uses) scores[codepoint] += metrics.uses; }
+
+	profile.clear();
+	for (const auto& [codepoint, score] : scores) { if (score >= PROFILE_MIN_SCORE) profile.push_back({.codepoint = codepoint, .score = score}); }
+	const size_t keep = std::min(profile.size(), PROFILE_MAX_GLYPHS);
+	std::ranges::partial_sort(profile, profile.begin() + keep, std::ranges::greater{}, &MSDFCache::ProfileEntry::score);
+	profile.resize(keep);
+	m_cache->SaveProfile(profile);
+}
+
+void MSDFFont::SaveSnapshot() {
+	// nothing was placed, recycled or dropped since the snapshot on disk was written or restored
+	if (s_atlasPages.empty() || s_snapshotVersion == s_atlasVersion) return;
+
+	std::vector<MSDFFont*> fonts;
+	std::vector<FontHash> fontHashes;
+	for (const auto& handle : s_fontHandles | std::views::values) {
+		if (!handle || !handle->m_cache || handle->m_glyphPool.empty() || fonts.size() > UINT8_MAX) continue;
+		// default pool pages cannot be read back, they are composed from the same sources a reset restores from
+		handle->m_cache->FlushPendingWrites();
+		fonts.push_back(handle.get());
+		fontHashes.push_back(handle->m_fontHash);
+	}
+	if (fonts.empty()) return;
+
+	constexpr size_t rowBytes = MSDF::ATLAS_SIZE * 4;
+	std::vector<SnapshotPage> pages;
+	for (const auto& page : s_atlasPages) pages.push_back({.nextX = page->nextX, .nextY = page->nextY, .rowHeight = page->rowHeight, .rows = GetUsedRows(*page)});
+
+	std::vector<SnapshotGlyph> glyphs;
+	const float atlasSize = static_cast<float>(MSDF::ATLAS_SIZE);
+	for (size_t f = 0; f < fonts.size(); ++f) {
+		for (const auto& [codepoint, metrics] : fonts[f]->m_glyphPool) {
+			// sized but never placed, the upload failed or there were no pixels to upload
+			if (metrics.width && metrics.height && metrics.u1 == 0.0f) continue;
+			// uvs are exact multiples of 1 / ATLAS_SIZE, so the placement comes back unchanged
+			const uint16_t page = metrics.width && metrics.height ? metrics.atlasPageIndex : 0;
+			glyphs.push_back({.codepoint = codepoint, .x = static_cast<uint16_t>(std::lround(metrics.u0 * atlasSize)), .y = static_cast<uint16_t>(std::lround(metrics.v0 * atlasSize)), .width = metrics.width, .height = metrics.height, .bitmapTop = metrics.bitmapTop, .bitmapLeft = metrics.bitmapLeft, .page = page, .tier = metrics.tier, .font = static_cast<uint8_t>(f)});
+		}
+	}
+
+	// one page is composed and compressed at a time, the glyph table goes last so the glyphs composing lost are left out of it
+	std::vector<PageGlyph> lost;
+	auto byGlyph = [](const PageGlyph& a, const PageGlyph& b) { return a.font != b.font ? std::less{}(a.font, b.font) : a.codepoint < b.codepoint; };
+	const uint32_t chunkCount = static_cast<uint32_t>(pages.size()) + 2;
+	const bool saved = MSDFCache::SaveAtlasSnapshot(chunkCount, [&](uint32_t chunk, std::vector<uint8_t>& outData) {
+		if (chunk == 0) {
+			const SnapshotLayout layout{.atlasSize = MSDF::ATLAS_SIZE, .gutter = MSDF::ATLAS_GUTTER, .format = static_cast<uint32_t>(MSDF::D3DFMT), .renderSize = MSDF::SDF_RENDER_SIZE, .spread = MSDF::SDF_SPREAD, .pageCount = static_cast<uint32_t>(pages.size()), .fontCount = static_cast<uint32_t>(fonts.size()), .pad = 0};
+			const size_t pageBytes = pages.size() * sizeof(SnapshotPage);
+			outData.resize(sizeof(layout) + pageBytes + fontHashes.size() * sizeof(FontHash));
+			std::memcpy(outData.data(), &layout, sizeof(layout));
+			std::memcpy(outData.data() + sizeof(layout), pages.data(), pageBytes);
+			std::memcpy(outData.data() + sizeof(layout) + pageBytes, fontHashes.data(), fontHashes.size() * sizeof(FontHash));
+			return true;
+		}
+		if (chunk <= pages.size()) {
+			outData.assign(pages[chunk - 1].rows * rowBytes, 0);
+			ComposePage(chunk - 1, pages[chunk - 1].rows, outData.data(), lost);
+			return true;
+		}
+		if (!lost.empty()) {
+			std::ranges::sort(lost, byGlyph);
+			std::erase_if(glyphs, [&](const SnapshotGlyph& glyph) { return std::ranges::binary_search(lost, PageGlyph{.font = fonts[glyph.font], .codepoint = glyph.codepoint}, byGlyph); });
+		}
+		outData.resize(glyphs.size() * sizeof(SnapshotGlyph));
+		if (!glyphs.empty()) std::memcpy(outData.data(), glyphs.data(), outData.size());
+		return true;
+	});
+	if (saved) s_snapshotVersion = s_atlasVersion;
+}
+
+bool MSDFFont::RestoreSnapshot() {
+	s_snapshotTried = true;
+	constexpr size_t rowBytes = MSDF::ATLAS_SIZE * 4;
+	std::vector<SnapshotPage> pages;
+	std::vector<SnapshotFont> fonts;
+	bool complete = false;
+	// the stored rows and the empty rest of each page go up through the staging surface in one batch
+	s_uploadBatch = true;
+	const bool loaded = MSDFCache::LoadAtlasSnapshot([&](uint32_t chunk, const std::vector<uint8_t>& data) {
+		if (chunk == 0) {
+			SnapshotLayout layout;
+			if (data.size() < sizeof(layout)) return false;
+			std::memcpy(&layout, data.data(), sizeof(layout));
+			// a build with other atlas or generation parameters would place or sample the glyphs wrong
+			if (layout.atlasSize != MSDF::ATLAS_SIZE || layout.gutter != MSDF::ATLAS_GUTTER || layout.format != static_cast<uint32_t>(MSDF::D3DFMT) || layout.renderSize != MSDF::SDF_RENDER_SIZE || layout.spread != MSDF::SDF_SPREAD) return false;
+			if (layout.pageCount == 0 || layout.pageCount > std::clamp(MSDF::ATLAS_BUDGET_PAGES, 1u, MSDF::MAX_ATLAS_PAGES)) return false;
+			if (layout.fontCount == 0 || layout.fontCount > UINT8_MAX + 1) return false;
+			const size_t pageBytes = layout.pageCount * sizeof(SnapshotPage);
+			if (data.size() != sizeof(layout) + pageBytes + layout.fontCount * sizeof(FontHash)) return false;
+			pages.resize(layout.pageCount);
+			std::memcpy(pages.data(), data.data() + sizeof(layout), pageBytes);
+			fonts.resize(layout.fontCount);
+			for (size_t f = 0; f < fonts.size(); ++f) std::memcpy(&fonts[f].fontHash, data.data() + sizeof(layout) + pageBytes + f * sizeof(FontHash), sizeof(FontHash));
+			return std::ranges::all_of(pages, [](const SnapshotPage& page) { return page.rows <= MSDF::ATLAS_SIZE && page.nextX >= 0 && page.nextY >= 0 && page.rowHeight >= 0 && static_cast<uint32_t>(page.nextX) <= MSDF::ATLAS_SIZE && static_cast<uint32_t>(page.nextY) <= MSDF::ATLAS_SIZE; });
+		}
+		if (chunk <= pages.size()) {
+			const SnapshotPage& page = pages[chunk - 1];
+			if (data.size() != page.rows * rowBytes || !CreateAtlasPage(false)) return false;
+			AtlasPage* atlasPage = s_atlasPages.back().get();
+			const bool staged = (page.rows == 0 || StageRegion(atlasPage, 0, 0, MSDF::ATLAS_SIZE, page.rows, data.data(), rowBytes)) && (page.rows == MSDF::ATLAS_SIZE || StageRegion(atlasPage, 0, page.rows, MSDF::ATLAS_SIZE, MSDF::ATLAS_SIZE - page.rows, ZERO_ROW.data(), 0));
+			if (!staged) return false;
+			atlasPage->nextX = page.nextX;
+			atlasPage->nextY = page.nextY;
+			atlasPage->rowHeight = page.rowHeight;
+			atlasPage->lastUse = ++s_useTick;
+			return true;
+		}
+		if (chunk != pages.size() + 1 || data.size() % sizeof(SnapshotGlyph)) return false;
+		for (size_t i = 0; i < data.size() / sizeof(SnapshotGlyph); ++i) {
+			SnapshotGlyph glyph;
+			std::memcpy(&glyph, data.data() + i * sizeof(SnapshotGlyph), sizeof(glyph));
+			const bool placed = glyph.width == 0 || glyph.height == 0 || (glyph.page < pages.size() && glyph.y + glyph.height <= pages[glyph.page].rows && glyph.x + glyph.width <= MSDF::ATLAS_SIZE);
+			if (!placed || glyph.tier >= MSDF::QUALITY_TIER_COUNT || glyph.font >= fonts.size()) return false;
+			fonts[glyph.font].glyphs.push_back(glyph);
+		}
+		complete = true;
+		return true;
+	});
+	EndUploadBatch();
+	if (!loaded || !complete) {
+		s_atlasPages.clear();
+		++s_atlasVersion;
+		return false;
+	}
+	std::erase_if(fonts, [](const SnapshotFont& font) { return font.glyphs.empty(); });
+	s_snapshotFonts = std::move(fonts);
+	// what is on disk is what was just put back
+	s_snapshotVersion = s_atlasVersion;
+	return true;
+}
+
+void MSDFFont::ClaimSnapshotGlyphs() {
+	auto font = std::ranges::find(s_snapshotFonts, m_fontHash, &SnapshotFont::fontHash);
+	if (font == s_snapshotFonts.end()) return;
+
+	const float atlasSize = static_cast<float>(MSDF::ATLAS_SIZE);
+	for (const SnapshotGlyph& glyph : font->glyphs) {
+		auto [it, inserted] = m_glyphPool.try_emplace(glyph.codepoint);
+		if (!inserted) continue;
+		GlyphMetrics& metrics = it->second;
+		metrics.width = glyph.width;
+		metrics.height = glyph.height;
+		metrics.bitmapTop = glyph.bitmapTop;
+		metrics.bitmapLeft = glyph.bitmapLeft;
+		metrics.tier = glyph.tier;
+		++MSDF::g_atlasStats.warmed;
+		if (glyph.width == 0 || glyph.height == 0) continue;
+		metrics.u0 = static_cast<float>(glyph.x) / atlasSize;
+		metrics.v0 = static_cast<float>(glyph.y) / atlasSize;
+		metrics.u1 = static_cast<float>(glyph.x + glyph.width) / atlasSize;
+		metrics.v1 = static_cast<float>(glyph.y + glyph.height) / atlasSize;
+		metrics.atlasPageIndex = glyph.page;
+		s_atlasPages[glyph.page]->glyphs.push_back({.font = this, .codepoint = glyph.codepoint});
+	}
+	s_snapshotFonts.erase(font);
+}
+
+void MSDFFont::TouchPages(uint32_t pageMask) {
+	const uint64_t tick = ++s_useTick;
+	for (size_t i = 0; i < s_atlasPages.size(); ++i) { if (pageMask & (1u << i)) s_atlasPages[i]->lastUse = tick; }
 }
 
-MSDFFont::AtlasPage* MSDFFont::GetAtlasPage(size_t index) const {
-	if (index < m_atlasPages.size()) { return m_atlasPages[index].get(); }
+FT_Error MSDFFont::GetKerning(FT_UInt leftGlyph, FT_UInt rightGlyph, FT_UInt kernMode, FT_Vector* akerning) {
+	if (!akerning) return FT_Err_Invalid_Argument;
+	akerning->x = akerning->y = 0;
+	if (!FT_HAS_KERNING(m_ftFace)) return FT_Err_Ok;
+	if (!m_kerningInit) InitKerning();
+
+	KerningPair* pair = FindKerningPair(leftGlyph, rightGlyph, false);
+	if (!pair || pair->x == KERN_UNKNOWN) {
+		FT_Vector raw;
+		if (FT_Error error = FT_Get_Kerning(m_ftFace, leftGlyph, rightGlyph, FT_KERNING_UNSCALED, &raw)) return error;
+		if (raw.x <= KERN_UNKNOWN || raw.x > INT16_MAX || raw.y < INT16_MIN || raw.y > INT16_MAX) return FT_Get_Kerning(m_ftFace, leftGlyph, rightGlyph, kernMode, akerning);
+		pair = FindKerningPair(leftGlyph, rightGlyph, true);
+		*pair = {static_cast<int16_t>(raw.x), static_cast<int16_t>(raw.y)};
+		m_kerningDirty = true;
+	}
+
+	akerning->x = pair->x;
+	akerning->y = pair->y;
+	if (kernMode == FT_KERNING_UNSCALED) return FT_Err_Ok;
+
+	// same scaling FT_Get_Kerning applies on top of the driver's font unit values
+	const FT_Size_Metrics& size = m_ftFace->size->metrics;
+	akerning->x = FT_MulFix(akerning->x, size.x_scale);
+	akerning->y = FT_MulFix(akerning->y, size.y_scale);
+	if (kernMode != FT_KERNING_UNFITTED) {
+		if (size.x_ppem < 25) akerning->x = FT_MulDiv(akerning->x, size.x_ppem, 25);
+		if (size.y_ppem < 25) akerning->y = FT_MulDiv(akerning->y, size.y_ppem, 25);
+		akerning->x = (akerning->x + 32) & ~static_cast<FT_Pos>(63);
+		akerning->y = (akerning->y + 32) & ~static_cast<FT_Pos>(63);
+	}
+	return FT_Err_Ok;
+}
+
+void MSDFFont::InitKerning() {
+	m_kerningInit = true;
+	m_kernSlotOf.assign(static_cast<size_t>(std::max<FT_Long>(m_ftFace->num_glyphs, 0)), KERN_NO_SLOT);
+	for (const auto& [first, last] : KERNING_DENSE_RANGES) {
+		for (uint32_t cp = first; cp <= last; ++cp) {
+			FT_UInt glyphIndex = FT_Get_Char_Index(m_ftFace, cp);
+			if (glyphIndex == 0 || glyphIndex >= m_kernSlotOf.size() || m_kernSlotOf[glyphIndex] != KERN_NO_SLOT) continue;
+			m_kernSlotOf[glyphIndex] = static_cast<uint16_t>(m_kernSlotGlyph.size());
+			m_kernSlotGlyph.push_back(glyphIndex);
+		}
+	}
+	m_kernDense.assign(m_kernSlotGlyph.size() * m_kernSlotGlyph.size(), KerningPair{});
+
+	std::vector<MSDFCache::KerningEntry> entries;
+	if (!m_cache || !m_cache->LoadKerning(entries)) return;
+	for (const auto& entry : entries) {
+		if (entry.x == KERN_UNKNOWN) continue;
+		*FindKerningPair(entry.left, entry.right, true) = {entry.x, entry.y};
+	}
+}
+
+void MSDFFont::SaveKerning() const {
+	if (!m_cache) return;
+	std::vector<MSDFCache::KerningEntry> entries;
+	entries.reserve(m_kernSparse.size() + 256);
+
+	const size_t slots = m_kernSlotGlyph.size();
+	for (size_t i = 0; i < m_kernDense.size(); ++i) {
+		const KerningPair& pair = m_kernDense[i];
+		if (pair.x != KERN_UNKNOWN) entries.push_back({.left = m_kernSlotGlyph[i / slots], .right = m_kernSlotGlyph[i % slots], .x = pair.x, .y = pair.y});
+	}
+	for (const auto& [key, pair] : m_kernSparse) { entries.push_back({.left = static_cast<uint32_t>(key >> 32), .right = static_cast<uint32_t>(key), .x = pair.x, .y = pair.y}); }
+
+	m_cache->SaveKerning(entries);
+}
+
+MSDFFont::KerningPair* MSDFFont::FindKerningPair(FT_UInt leftGlyph, FT_UInt rightGlyph, bool create) {
+	if (leftGlyph < m_kernSlotOf.size() && rightGlyph < m_kernSlotOf.size()) {
+		const uint16_t left = m_kernSlotOf[leftGlyph];
+		const uint16_t right = m_kernSlotOf[rightGlyph];
+		if (left != KERN_NO_SLOT && right != KERN_NO_SLOT) return &m_kernDense[static_cast<size_t>(left) * m_kernSlotGlyph.size() + right];
+	}
+
+	const uint64_t key = (static_cast<uint64_t>(leftGlyph) << 32) | rightGlyph;
+	if (create) return &m_kernSparse[key];
+	auto it = m_kernSparse.find(key);
+	return it != m_kernSparse.end() ? &it->second : nullptr;
+}
+
+uint64_t MSDFFont::HashGlyphRun(const char* text, size_t quadCount, double scale, double fontSizeMult, uint32_t flags, bool is3d, const CGxFont* fontObj) {
+	const GlyphRunKey key{scale, fontSizeMult, quadCount, reinterpret_cast<uintptr_t>(fontObj), flags, is3d, fontObj->m_fontHeight, fontObj->m_styleFlags, fontObj->m_effectivePixelHeight, fontObj->m_rasterTargetSize};
+	return key.Hash(text);
+}
+
+MSDFFont::AtlasPage* MSDFFont::GetAtlasPage(size_t index) {
+	if (index < s_atlasPages.size()) { return s_atlasPages[index].get(); }
 	return nullptr;
 }
 
-bool MSDFFont::CreateAtlasPage() {
+bool MSDFFont::CreateAtlasPage(bool clear) {
 	auto page = std::make_unique<AtlasPage>(MSDF::ATLAS_GUTTER);
-	if (!D3D::CreateTexture(&page->texture, {.width = MSDF::ATLAS_SIZE, .height = MSDF::ATLAS_SIZE, .format = MSDF::D3DFMT, .pool = D3DPOOL_MANAGED})) { return false; }
-	m_atlasPages.push_back(std::move(page));
+	// no managed copy in system memory, a reset is recovered from the glyph cache instead
+	if (!D3D::CreateTexture(&page->texture, {.width = MSDF::ATLAS_SIZE, .height = MSDF::ATLAS_SIZE, .format = MSDF::D3DFMT, .pool = D3DPOOL_DEFAULT, .autoCleanup = true})) { return false; }
+	// default pool textures start out undefined
+	if (clear && !ClearAtlasPage(page.get())) {
+		std::erase_if(s_staged, [&page](const StagedRegion& region) { return region.page == page.get(); });
+		return false;
+	}
+	s_atlasPages.push_back(std::move(page));
+	++s_atlasVersion;
 	return true;
 }
 
-bool MSDFFont::UploadGlyphToAtlas(GlyphMetrics& metrics, uint32_t codepoint) {
-	if (!metrics.pixelData || metrics.width == 0 || metrics.height == 0) return true;
+GlyphMetrics* MSDFFont::UploadGlyphToAtlas(uint32_t codepoint) {
+	GlyphMetrics* metrics = &m_glyphPool.find(codepoint)->second;
+	if (!metrics->pixelData || metrics->width == 0 || metrics->height == 0) return metrics;
+	const uint16_t width = metrics->width;
+	const uint16_t height = metrics->height;
 
 	int16_t pageIndex = -1;
 	AtlasPage* targetPage = nullptr;
 
-	for (size_t i = 0; i < m_atlasPages.size(); ++i) {
-		AtlasPage* page = m_atlasPages[i].get();
-		if (page->nextX + metrics.width + MSDF::ATLAS_GUTTER <= MSDF::ATLAS_SIZE && page->nextY + metrics.height + MSDF::ATLAS_GUTTER <= MSDF::ATLAS_SIZE) {
+	for (size_t i = 0; i < s_atlasPages.size(); ++i) {
+		AtlasPage* page = s_atlasPages[i].get();
+		if (page->nextX + width + MSDF::ATLAS_GUTTER <= MSDF::ATLAS_SIZE && page->nextY + height + MSDF::ATLAS_GUTTER <= MSDF::ATLAS_SIZE) {
 			pageIndex = static_cast<int16_t>(i);
 			targetPage = page;
 			break;
 		}
 		int nextY = page->nextY + page->rowHeight + MSDF::ATLAS_GUTTER;
-		if (nextY + metrics.height + MSDF::ATLAS_GUTTER <= MSDF::ATLAS_SIZE) {
+		if (nextY + height + MSDF::ATLAS_GUTTER <= MSDF::ATLAS_SIZE) {
 			page->nextX = MSDF::ATLAS_GUTTER;
 			page->nextY = nextY;
 			page->rowHeight = 0;
@@ -151,120 +637,222 @@ bool MSDFFont::UploadGlyphToAtlas(GlyphMetrics& metrics, uint32_t codepoint) {
 		}
 	}
 	if (pageIndex == -1) {
-		if (m_atlasPages.size() >= MSDF::MAX_ATLAS_PAGES) {
-			pageIndex = m_oldestPage;
-			targetPage = m_atlasPages[m_oldestPage].get();
-
-			for (uint32_t cp : targetPage->codepoints) {
-				auto it = m_glyphPool.find(cp);
-				if (it != m_glyphPool.end()) { m_glyphPool.erase(it); }
-			}
-			targetPage->Clear();
-
-			D3DLOCKED_RECT fullRect;
-			if (SUCCEEDED(targetPage->texture->LockRect(0, &fullRect, nullptr, 0))) {
-				memset(fullRect.pBits, 0, MSDF::ATLAS_SIZE * fullRect.Pitch);
-				targetPage->texture->UnlockRect(0);
-			}
-			m_evictionCount++;
-			m_oldestPage = (m_oldestPage + 1) % MSDF::MAX_ATLAS_PAGES;
+		if (s_atlasPages.size() >= std::clamp(MSDF::ATLAS_BUDGET_PAGES, 1u, MSDF::MAX_ATLAS_PAGES)) {
+			// recycle the least recently sampled page of any font, strings still on screen keep theirs
+			pageIndex = 0;
+			for (size_t i = 1; i < s_atlasPages.size(); ++i) { if (s_atlasPages[i]->lastUse < s_atlasPages[pageIndex]->lastUse) pageIndex = static_cast<int16_t>(i); }
+			targetPage = s_atlasPages[pageIndex].get();
+			EvictAtlasPage(pageIndex);
+			// erasing glyphs of this very font may have moved the entry
+			metrics = &m_glyphPool.find(codepoint)->second;
 		}
 		else {
-			if (!CreateAtlasPage()) return false;
-			pageIndex = static_cast<int16_t>(m_atlasPages.size() - 1);
-			targetPage = m_atlasPages.back().get();
+			if (!CreateAtlasPage()) return metrics;
+			pageIndex = static_cast<int16_t>(s_atlasPages.size() - 1);
+			targetPage = s_atlasPages.back().get();
 		}
 	}
-	if (!targetPage->texture) return false;
+	if (!StageRegion(targetPage, targetPage->nextX, targetPage->nextY, width, height, metrics->pixelData, width * 4)) return metrics;
+
+	float atlasSize = static_cast<float>(MSDF::ATLAS_SIZE);
+	metrics->u0 = static_cast<float>(targetPage->nextX) / atlasSize;
+	metrics->v0 = static_cast<float>(targetPage->nextY) / atlasSize;
+	metrics->u1 = static_cast<float>(targetPage->nextX + width) / atlasSize;
+	metrics->v1 = static_cast<float>(targetPage->nextY + height) / atlasSize;
+	metrics->atlasPageIndex = pageIndex;
+	targetPage->lastUse = ++s_useTick;
+
+	targetPage->nextX += width + MSDF::ATLAS_GUTTER;
+	targetPage->rowHeight = std::max(targetPage->rowHeight, static_cast<int>(height));
+	targetPage->glyphs.push_back({.font = this, .codepoint = codepoint});
+	++s_atlasVersion;
+
+	return metrics;
+}
 
-	D3DLOCKED_RECT lockedRect;
-	if (FAILED(targetPage->texture->LockRect(0, &lockedRect, nullptr, 0))) { return false; }
-	if (lockedRect.Pitch < metrics.width * 4) {
-		targetPage->texture->UnlockRect(0);
+void MSDFFont::EvictAtlasPage(size_t pageIndex) {
+	AtlasPage* page = s_atlasPages[pageIndex].get();
+	// only the fonts that lose glyphs rebuild their strings, once each keeps the 7 bit string token from wrapping
+	std::ranges::sort(page->glyphs, {}, &PageGlyph::font);
+	for (size_t i = 0; i < page->glyphs.size(); ++i) {
+		const PageGlyph& glyph = page->glyphs[i];
+		auto it = glyph.font->m_glyphPool.find(glyph.codepoint);
+		if (it != glyph.font->m_glyphPool.end() && it->second.atlasPageIndex == pageIndex) glyph.font->m_glyphPool.erase(it);
+		if (i == 0 || page->glyphs[i - 1].font != glyph.font) glyph.font->m_evictionCount++;
+	}
+	for (SnapshotFont& font : s_snapshotFonts) std::erase_if(font.glyphs, [pageIndex](const SnapshotGlyph& glyph) { return glyph.width && glyph.height && glyph.page == pageIndex; });
+	page->Clear();
+	ClearAtlasPage(page);
+	++s_atlasVersion;
+	++MSDF::g_atlasStats.evictions;
+}
+
+uint32_t MSDFFont::GetUsedRows(const AtlasPage& page) { return std::min(MSDF::ATLAS_SIZE, static_cast<uint32_t>(page.nextY + page.rowHeight + page.g)); }
+
+void MSDFFont::ComposePage(size_t pageIndex, uint32_t rows, uint8_t* dest, std::vector<PageGlyph>& outLost, const MSDFFont* owner) {
+	constexpr size_t rowBytes = MSDF::ATLAS_SIZE * 4;
+	const float atlasSize = static_cast<float>(MSDF::ATLAS_SIZE);
+	// grouped by font and ascending within it, each cache reads its blocks in order
+	std::vector<PageGlyph> glyphs = s_atlasPages[pageIndex]->glyphs;
+	std::ranges::sort(glyphs, [](const PageGlyph& a, const PageGlyph& b) { return a.font != b.font ? std::less{}(a.font, b.font) : a.codepoint < b.codepoint; });
+	for (const PageGlyph& glyph : glyphs) {
+		if (owner && glyph.font != owner) continue;
+		const MSDFFont* font = glyph.font;
+		auto it = font->m_glyphPool.find(glyph.codepoint);
+		if (it == font->m_glyphPool.end() || it->second.atlasPageIndex != pageIndex) continue;
+		const GlyphMetrics& placed = it->second;
+		const auto x = static_cast<uint32_t>(std::lround(placed.u0 * atlasSize));
+		const auto y = static_cast<uint32_t>(std::lround(placed.v0 * atlasSize));
+
+		GlyphMetrics source;
+		const bool found = MSDFSharedMemory::Find(font->m_fontHash, glyph.codepoint, source) || (font->m_cache && font->m_cache->TryLoadGlyph(glyph.codepoint, source));
+		if (!found || !source.pixelData || source.width != placed.width || source.height != placed.height || y + placed.height > rows || x + placed.width > MSDF::ATLAS_SIZE) {
+			outLost.push_back(glyph);
+			continue;
+		}
+		const uint8_t* src = source.pixelData;
+		uint8_t* out = dest + y * rowBytes + x * 4;
+		for (uint16_t row = 0; row < placed.height; ++row, src += placed.width * 4, out += rowBytes) std::memcpy(out, src, placed.width * 4);
+	}
+}
+
+bool MSDFFont::StageRegion(AtlasPage* page, int x, int y, int width, int height, const uint8_t* src, size_t srcPitch) {
+	if (!page->texture || width <= 0 || height <= 0 || width > static_cast<int>(MSDF::ATLAS_SIZE)) return false;
+	// taller regions go up in bands of the staging height
+	for (; height > STAGING_ROWS; y += STAGING_ROWS, height -= STAGING_ROWS, src += STAGING_ROWS * srcPitch) {
+		if (!StageRegion(page, x, y, width, STAGING_ROWS, src, srcPitch)) return false;
+	}
+
+	if (!s_staging) {
+		IDirect3DDevice9* device = D3D::GetDevice();
+		if (!device || FAILED(device->CreateOffscreenPlainSurface(MSDF::ATLAS_SIZE, STAGING_ROWS, MSDF::D3DFMT, D3DPOOL_SYSTEMMEM, &s_staging, nullptr))) {
+			s_staging = nullptr;
+			return false;
+		}
+	}
+	// shelf packed like the pages themselves, a full surface is flushed and reused
+	if (s_stagingX + width > static_cast<int>(MSDF::ATLAS_SIZE)) {
+		s_stagingX = 0;
+		s_stagingY += s_stagingRowHeight;
+		s_stagingRowHeight = 0;
+	}
+	if (s_stagingY + height > STAGING_ROWS && !FlushStaging()) return false;
+	if (!s_stagingRect.pBits && FAILED(s_staging->LockRect(&s_stagingRect, nullptr, 0))) {
+		s_stagingRect = {};
 		return false;
 	}
 
-	const unsigned char* src = metrics.pixelData;
-	unsigned char* dest = static_cast<unsigned char*>(lockedRect.pBits) + targetPage->nextY * lockedRect.Pitch + targetPage->nextX * 4;
-	for (uint16_t y = 0; y < metrics.height; ++y) {
-		memcpy(dest, src, metrics.width * 4);
-		dest += lockedRect.Pitch;
-		src += metrics.width * 4;
+	uint8_t* dest = static_cast<uint8_t*>(s_stagingRect.pBits) + s_stagingY * s_stagingRect.Pitch + s_stagingX * 4;
+	for (int row = 0; row < height; ++row, dest += s_stagingRect.Pitch, src += srcPitch) std::memcpy(dest, src, width * 4);
+	s_staged.push_back({.page = page, .src = {s_stagingX, s_stagingY, s_stagingX + width, s_stagingY + height}, .dest = {x, y}});
+	s_stagingX += width;
+	s_stagingRowHeight = std::max(s_stagingRowHeight, height);
+	return s_uploadBatch || FlushStaging();
+}
+
+bool MSDFFont::FlushStaging() {
+	if (s_stagingRect.pBits) s_staging->UnlockRect();
+	s_stagingRect = {};
+	s_stagingX = 0;
+	s_stagingY = 0;
+	s_stagingRowHeight = 0;
+	if (s_staged.empty()) return true;
+
+	// regions go up in staging order, a page cleared after an upload stays cleared
+	IDirect3DDevice9* device = D3D::GetDevice();
+	bool flushed = device != nullptr;
+	for (const StagedRegion& region : s_staged) {
+		IDirect3DSurface9* surface = nullptr;
+		if (!device || !region.page->texture || FAILED(region.page->texture->GetSurfaceLevel(0, &surface))) {
+			flushed = false;
+			continue;
+		}
+		flushed &= SUCCEEDED(device->UpdateSurface(s_staging, &region.src, surface, &region.dest));
+		surface->Release();
 	}
-	targetPage->texture->UnlockRect(0);
+	s_staged.clear();
+	return flushed;
+}
 
-	float atlasSize = static_cast<float>(MSDF::ATLAS_SIZE);
-	metrics.u0 = static_cast<float>(targetPage->nextX) / atlasSize;
-	metrics.v0 = static_cast<float>(targetPage->nextY) / atlasSize;
-	metrics.u1 = static_cast<float>(targetPage->nextX + metrics.width) / atlasSize;
-	metrics.v1 = static_cast<float>(targetPage->nextY + metrics.height) / atlasSize;
-	metrics.atlasPageIndex = pageIndex;
+bool MSDFFont::ClearAtlasPage(AtlasPage* page) { return StageRegion(page, 0, 0, MSDF::ATLAS_SIZE, MSDF::ATLAS_SIZE, ZERO_ROW.data(), 0); }
+
+void MSDFFont::EndUploadBatch() {
+	s_uploadBatch = false;
+	FlushStaging();
+}
 
-	targetPage->nextX += metrics.width + MSDF::ATLAS_GUTTER;
-	targetPage->rowHeight = std::max(targetPage->rowHeight, static_cast<int>(metrics.height));
-	targetPage->codepoints.push_back(codepoint);
+void MSDFFont::ReleaseStaging() {
+	if (s_stagingRect.pBits) s_staging->UnlockRect();
+	s_stagingRect = {};
+	s_staged.clear();
+	s_stagingX = 0;
+	s_stagingY = 0;
+	s_stagingRowHeight = 0;
+	s_uploadBatch = false;
+	if (s_staging) s_staging->Release();
+	s_staging = nullptr;
+}
 
+bool MSDFFont::MeasureGlyph(FT_Face face, uint32_t codepoint, GlyphMetricsToStore& storage, FT_UInt& outGlyphIndex, uint16_t& outWidth, uint16_t& outHeight) {
+	const uint8_t tierIndex = MSDF::GetQualityTier(codepoint);
+	const MSDF::QualityTier& tier = MSDF::GetTier(tierIndex);
+	storage.codepoint = codepoint;
+	storage.tier = tierIndex;
+	outWidth = 0;
+	outHeight = 0;
+
+	if (FT_Set_Pixel_Sizes(face, tier.renderSize, tier.renderSize) != 0) return false;
+	outGlyphIndex = FT_Get_Char_Index(face, codepoint);
+	if (FT_Load_Glyph(face, outGlyphIndex, FT_LOAD_NO_BITMAP | FT_LOAD_NO_HINTING) != 0) return false;
+
+	storage.bitmapLeft = face->glyph->bitmap_left;
+	storage.bitmapTop = face->glyph->bitmap_top;
+
+	const bool hasOutline = face->glyph->format == FT_GLYPH_FORMAT_OUTLINE && face->glyph->outline.n_contours > 0;
+	if (!hasOutline) return true;
+
+	FT_BBox bbox;
+	FT_Outline_Get_BBox(&face->glyph->outline, &bbox);
+	uint16_t w = static_cast<uint16_t>(std::max(0, static_cast<int>(((bbox.xMax + 63) >> 6) - (bbox.xMin >> 6))));
+	uint16_t h = static_cast<uint16_t>(std::max(0, static_cast<int>(((bbox.yMax + 63) >> 6) - (bbox.yMin >> 6))));
+	if (w > 0 && h > 0) {
+		outWidth = w + 2 * tier.spread;
+		outHeight = h + 2 * tier.spread;
+	}
 	return true;
 }
 
-bool MSDFFont::GenerateMSDF(std::vector<uint8_t>& outData, uint32_t codepoint, int sdfW, int sdfH) const {
+bool MSDFFont::GenerateMSDF(msdfgen::FontHandle* font, std::vector<uint8_t>& outData, uint32_t codepoint, int sdfW, int sdfH, uint32_t spread, MSDF::GeometryStats& fontStats) {
 	if (sdfW <= 0 || sdfH <= 0 || sdfW > 512 || sdfH > 512) return false;
 
+	LARGE_INTEGER genStart;
+	QueryPerformanceCounter(&genStart);
 	msdfgen::Shape shape;
-	if (!msdfgen::loadGlyph(shape, m_msdfFont, codepoint)) return false;
+	if (!msdfgen::loadGlyph(shape, font, codepoint)) return false;
 
 	if (shape.contours.empty()) {
 		outData.assign(sdfW * sdfH * 4, 0);
 		return true;
 	}
 
-	msdfgen::resolveShapeGeometry(shape);
-	msdfgen::edgeColoringInkTrap(shape, 3.0, 0);
-
-	auto bounds = shape.getBounds();
-	double shapeW = bounds.r - bounds.l;
-	double shapeH = bounds.t - bounds.b;
-	if (shapeW <= 0 || shapeH <= 0) return false;
-
-	double usableW = static_cast<double>(sdfW) - 2.0 * MSDF::SDF_SPREAD;
-	double usableH = static_cast<double>(sdfH) - 2.0 * MSDF::SDF_SPREAD;
-	if (usableW <= 0 || usableH <= 0) return false;
-
-	double scale = std::min(usableW / shapeW, usableH / shapeH);
-	msdfgen::Projection projection(msdfgen::Vector2(scale, scale), msdfgen::Vector2(MSDF::SDF_SPREAD / scale - bounds.l, MSDF::SDF_SPREAD / scale - bounds.b));
-
-	auto msdfBuf = m_msdfPool.AcquireSized(sdfW * sdfH * 3);
-	auto sdfBuf = m_msdfPool.AcquireSized(sdfW * sdfH);
-
-	msdfgen::BitmapRef<float, 3> msdfBitmap(msdfBuf.data(), sdfW, sdfH);
-	msdfgen::BitmapRef<float, 1> sdfBitmap(sdfBuf.data(), sdfW, sdfH);
-
-	msdfgen::MSDFGeneratorConfig config;
-	config.overlapSupport = true;
-
-	msdfgen::Range msdfRange(MSDF::SDF_SPREAD / scale);
-	msdfgen::generateMSDF(msdfBitmap, shape, projection, msdfRange, config);
-	msdfgen::SDFTransformation msdfTransform(projection, msdfRange);
-	msdfgen::distanceSignCorrection(msdfBitmap, shape, msdfTransform, msdfgen::FillRule::FILL_NONZERO);
-
-	msdfgen::Range sdfRange(MSDF::SDF_SPREAD / scale * 5.0);
-	msdfgen::generateSDF(sdfBitmap, shape, projection, sdfRange);
-	msdfgen::SDFTransformation sdfTransform(projection, sdfRange);
-	msdfgen::distanceSignCorrection(sdfBitmap, shape, sdfTransform, msdfgen::FillRule::FILL_NONZERO);
+	// the Skia pass dominates generation for most glyphs, with MSDF_SKIP_RESOLVED_GEOMETRY an outline that is already simple only gets what it does around Simplify
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter(&start);
+	const bool simple = ResolveGlyphGeometry(shape, MSDF_SKIP_RESOLVED_GEOMETRY);
+	QueryPerformanceCounter(&end);
+	const uint64_t micros = static_cast<uint64_t>((end.QuadPart - start.QuadPart) * 1000000 / GetPerformanceFrequency());
+	for (MSDF::GeometryStats* geometry : {&MSDF::g_geometryStats, &fontStats}) {
+		(simple ? geometry->simple : geometry->resolved).fetch_add(1, std::memory_order_relaxed);
+		(simple ? geometry->simpleMicros : geometry->resolvedMicros).fetch_add(micros, std::memory_order_relaxed);
+	}
 
-	outData.resize(sdfW * sdfH * 4);
-	uint8_t* dest = outData.data();
-	const float* srcMSDF = msdfBuf.data();
-	const float* srcSDF = sdfBuf.data();
+	if (!RasterizeGlyph(shape, outData, sdfW, sdfH, spread, m_msdfPool)) return false;
 
-	for (int i = 0; i < sdfW * sdfH; ++i) {
-		dest[i * 4 + 0] = static_cast<uint8_t>(std::clamp(srcMSDF[i * 3 + 0] * 255.f, 0.f, 255.f));
-		dest[i * 4 + 1] = static_cast<uint8_t>(std::clamp(srcMSDF[i * 3 + 1] * 255.f, 0.f, 255.f));
-		dest[i * 4 + 2] = static_cast<uint8_t>(std::clamp(srcMSDF[i * 3 + 2] * 255.f, 0.f, 255.f));
-		dest[i * 4 + 3] = static_cast<uint8_t>(std::clamp(srcSDF[i] * 255.f, 0.f, 255.f));
-	}
-	m_msdfPool.Release(std::move(msdfBuf));
-	m_msdfPool.Release(std::move(sdfBuf));
+	QueryPerformanceCounter(&end);
+	MSDF::TierStats& tierStats = MSDF::g_tierStats[MSDF::GetQualityTier(codepoint)];
+	tierStats.glyphs.fetch_add(1, std::memory_order_relaxed);
+	tierStats.bytes.fetch_add(outData.size(), std::memory_order_relaxed);
+	tierStats.micros.fetch_add(static_cast<uint64_t>((end.QuadPart - genStart.QuadPart) * 1000000 / GetPerformanceFrequency()), std::memory_order_relaxed);
 
 	return true;
 }
@@ -5,24 +5,33 @@
 class MSDFFont {
 	friend class MSDFCache;
 	friend class MSDFPregen;
+	friend class MSDFBackground;
 
+	struct PageGlyph {
+		MSDFFont* font;
+		uint32_t codepoint;
+	};
+
+	// pages are pooled across every font, one budget and one eviction order for all of them
 	struct AtlasPage {
 		IDirect3DTexture9* texture = nullptr;
 		int nextX = 0, nextY = 0;
 		int rowHeight = 0;
 		int g = 0;
-		std::vector<uint32_t> codepoints;
+		uint64_t lastUse = 0;
+		std::vector<PageGlyph> glyphs;
 
 		AtlasPage(int gutter) : nextX(gutter), nextY(gutter), g(gutter) {
 		}
 
-		~AtlasPage() { if (texture) texture->Release(); }
+		// default pool texture on the device restore list, it is recreated empty after a reset
+		~AtlasPage() { D3D::DestroyManagedResource(reinterpret_cast<IUnknown**>(&texture)); }
 
 		void Clear() {
 			nextX = g;
 			nextY = g;
 			rowHeight = 0;
-			codepoints.clear();
+			glyphs.clear();
 		}
 	};
 
@@ -31,38 +40,186 @@ public:
 	~MSDFFont();
 
 	bool IsValid() const { return m_isValid; }
+	FontHash GetFontHash() const { return m_fontHash; }
 
-	AtlasPage* GetAtlasPage(size_t index) const;
-	size_t GetAtlasPageCount() const { return m_atlasPages.size(); }
+	static AtlasPage* GetAtlasPage(size_t index);
+	static size_t GetAtlasPageCount() { return s_atlasPages.size(); }
+	// bumped whenever a page holding glyphs of this font is recycled
 	size_t GetAtlasEvictionCount() const { return m_evictionCount; }
 
 	const GlyphMetrics* GetGlyph(uint32_t codepoint);
+	static void TouchPages(uint32_t pageMask);
+
+	FT_Error GetKerning(FT_UInt leftGlyph, FT_UInt rightGlyph, FT_UInt kernMode, FT_Vector* akerning);
+
+	const GlyphRun* FindGlyphRun(uint64_t key, size_t quadCount) { return m_glyphRuns.Find(key, quadCount, m_evictionCount); }
+	GlyphRun* CreateGlyphRun(uint64_t key) { return m_glyphRuns.Create(key, m_evictionCount); }
+	void DropGlyphRun(uint64_t key) { m_glyphRuns.Drop(key); }
+	static uint64_t HashGlyphRun(const char* text, size_t quadCount, double scale, double fontSizeMult, uint32_t flags, bool is3d, const CGxFont* fontObj);
 
 	static MSDFFont* Get(FT_Face face);
 	static void Register(FT_Face face, const FT_Byte* data, FT_Long size);
 	static void Unregister(FT_Face face);
 	static void ClearAllCache();
+	// snapshots every atlas before the device takes the textures down, the next use restores them
+	static void OnDeviceDestroy();
+	static void OnDeviceRelease() { s_pagesLost = true; }
+	// refills the pages recreated by the restore list from the glyph cache, glyphs that no longer load are dropped
+	static void OnDeviceRestore();
+	static constexpr uint32_t MAX_WARMUP_BUDGET_MS = 1000;
+	static constexpr uint32_t DEFAULT_WARMUP_BUDGET_MS = 50;
+
+	// milliseconds a font may spend filling its atlas from the warmup profile, 0 disables
+	static void SetWarmupBudget(uint32_t milliseconds) { s_warmupBudgetMs = milliseconds; }
+	// loads the glyph at the size of its tier and fills in the box GetGlyph stores it with, outWidth and outHeight stay 0 without an outline
+	static bool MeasureGlyph(FT_Face face, uint32_t codepoint, GlyphMetricsToStore& storage, FT_UInt& outGlyphIndex, uint16_t& outWidth, uint16_t& outHeight);
+	// safe on any thread that brings its own font handle, the geometry pass is counted in fontStats as well as the global stats
+	static bool GenerateMSDF(msdfgen::FontHandle* font, std::vector<uint8_t>& outData, uint32_t codepoint, int sdfW, int sdfH, uint32_t spread, MSDF::GeometryStats& fontStats);
+	// writes one archive per font binary, returns how many were written
+	static uint32_t PackArchives(uint32_t& outGlyphs);
+	// summed over the registered fonts of the family, on demand and by the background workers, false if none is registered
+	static bool GetGeometryStats(const char* familyName, MSDF::GeometryStats& outStats);
+	static void ResetGeometryStats();
 	static void Shutdown();
 
 private:
-	bool CreateAtlasPage();
-	bool UploadGlyphToAtlas(GlyphMetrics& metrics, uint32_t codepoint);
-	bool GenerateMSDF(std::vector<uint8_t>& outData, uint32_t codepoint, int sdfW, int sdfH) const;
+	static bool CreateAtlasPage(bool clear = true);
+	// places the pooled glyph, returns its pool entry again since recycling a page may have moved it
+	GlyphMetrics* UploadGlyphToAtlas(uint32_t codepoint);
+	static void EvictAtlasPage(size_t pageIndex);
+	// rebuilds the used rows of a page from shared memory or the disk caches, glyphs that no longer load are reported and left empty.
+	// with an owner only that font's glyphs are drawn
+	static void ComposePage(size_t pageIndex, uint32_t rows, uint8_t* dest, std::vector<PageGlyph>& outLost, const MSDFFont* owner = nullptr);
+	static uint32_t GetUsedRows(const AtlasPage& page);
+
+	// pages are written through one system memory surface shared by every font, staged regions reach the card on flush.
+	// outside a batch every region is flushed right away
+	static bool StageRegion(AtlasPage* page, int x, int y, int width, int height, const uint8_t* src, size_t srcPitch);
+	static bool FlushStaging();
+	static bool ClearAtlasPage(AtlasPage* page);
+	static void EndUploadBatch();
+	static void ReleaseStaging();
+
+	void WarmUp();
+	void SaveProfile() const;
+	// the whole pool and the placements of every font in one file, restored once while the pool is empty.
+	// fonts take their placements over on warmup, also when they register after the restore
+	static void SaveSnapshot();
+	static bool RestoreSnapshot();
+	void ClaimSnapshotGlyphs();
+	bool GenerateMSDF(std::vector<uint8_t>& outData, uint32_t codepoint, int sdfW, int sdfH, uint32_t spread = MSDF::SDF_SPREAD) { return GenerateMSDF(m_msdfFont, outData, codepoint, sdfW, sdfH, spread, m_geometryStats); }
 
 	static msdfgen::FontHandle* CreateMSDFHandle(const FT_Byte* data, FT_Long size);
 
+	static constexpr int16_t KERN_UNKNOWN = INT16_MIN;
+	static constexpr uint16_t KERN_NO_SLOT = 0xFFFF;
+
+	struct KerningPair {
+		int16_t x = KERN_UNKNOWN;
+		int16_t y = 0;
+	};
+
+	void InitKerning();
+	void SaveKerning() const;
+	KerningPair* FindKerningPair(FT_UInt leftGlyph, FT_UInt rightGlyph, bool create);
+
 	FT_Face m_ftFace;
 	msdfgen::FontHandle* m_msdfFont;
+	FontHash m_fontHash = 0;
 	bool m_isValid;
-	uint16_t m_oldestPage;
+	bool m_isCompatible = false;
 	uint32_t m_evictionCount;
 
 	std::unique_ptr<MSDFCache> m_cache;
-	std::vector<std::unique_ptr<AtlasPage>> m_atlasPages;
+	MSDF::GeometryStats m_geometryStats;
 
 	ankerl::unordered_dense::map<uint32_t, GlyphMetrics> m_glyphPool;
+	GlyphRunCache m_glyphRuns;
+
+	// kerning in font units: a dense slot x slot table for the Latin/Cyrillic glyphs, a hash map for everything else
+	bool m_kerningInit = false;
+	bool m_kerningDirty = false;
+	std::vector<uint16_t> m_kernSlotOf; // glyph index -> dense slot
+	std::vector<FT_UInt> m_kernSlotGlyph; // dense slot -> glyph index
+	std::vector<KerningPair> m_kernDense;
+	ankerl::unordered_dense::map<uint64_t, KerningPair> m_kernSparse;
+
+	// atlas snapshot chunks: SnapshotLayout, SnapshotPage[pageCount] and FontHash[fontCount], the used rows of each page, then SnapshotGlyph[] last
+	struct SnapshotLayout {
+		uint32_t atlasSize;
+		uint32_t gutter;
+		uint32_t format;
+		uint32_t renderSize;
+		uint32_t spread;
+		uint32_t pageCount;
+		uint32_t fontCount;
+		uint32_t pad;
+	};
+
+	struct SnapshotPage {
+		int32_t nextX;
+		int32_t nextY;
+		int32_t rowHeight;
+		uint32_t rows; // stored from the top, everything below is still empty
+	};
+
+	struct SnapshotGlyph {
+		uint32_t codepoint;
+		uint16_t x;
+		uint16_t y;
+		uint16_t width;
+		uint16_t height;
+		FT_Int bitmapTop;
+		FT_Int bitmapLeft;
+		uint16_t page;
+		uint8_t tier;
+		uint8_t font; // index into the font table
+	};
+
+	// restored placements of a font that has not warmed up yet
+	struct SnapshotFont {
+		FontHash fontHash;
+		std::vector<SnapshotGlyph> glyphs;
+	};
+
+	static_assert(sizeof(SnapshotLayout) == 32);
+	static_assert(sizeof(SnapshotPage) == 16);
+	static_assert(sizeof(SnapshotGlyph) == 24);
+
+	static constexpr size_t PROFILE_MAX_GLYPHS = 1024;
+	static constexpr float PROFILE_DECAY = 0.8f;      // per session the font is used in
+	static constexpr float PROFILE_MIN_SCORE = 0.05f; // a glyph seen once drops out after about a dozen sessions without it
+
+	static constexpr int STAGING_ROWS = 256;
+
+	struct StagedRegion {
+		AtlasPage* page;
+		RECT src;
+		POINT dest;
+	};
+
+	bool m_warmedUp = false;
+	inline static uint32_t s_warmupBudgetMs = DEFAULT_WARMUP_BUDGET_MS;
+
+	inline static std::vector<std::unique_ptr<AtlasPage>> s_atlasPages;
+	inline static uint64_t s_useTick = 0;
+	inline static uint64_t s_atlasVersion = 0; // bumped whenever a page is created, filled, recycled or dropped
+	inline static uint64_t s_snapshotVersion = 0; // s_atlasVersion the snapshot on disk matches
+	inline static bool s_snapshotTried = false;  // once per cleared pool, a missing or stale file is not read again
+	inline static std::vector<SnapshotFont> s_snapshotFonts;
+
+	inline static IDirect3DSurface9* s_staging = nullptr;
+	inline static D3DLOCKED_RECT s_stagingRect{}; // held locked until the next flush
+	inline static int s_stagingX = 0, s_stagingY = 0;
+	inline static int s_stagingRowHeight = 0;
+	inline static bool s_uploadBatch = false;
+	inline static bool s_pagesLost = false;
+	inline static std::vector<StagedRegion> s_staged;
 
 	inline static ankerl::unordered_dense::map<FT_Face, std::unique_ptr<MSDFFont>> s_fontHandles;
+	// one-entry memo, the detours resolve the same face over and over while a string is laid out
+	inline static FT_Face s_lastFace = nullptr;
+	inline static MSDFFont* s_lastFont = nullptr;
 
 	inline static thread_local VectorPool<float> m_msdfPool;
 };
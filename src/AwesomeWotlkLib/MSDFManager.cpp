@@ -19,92 +19,143 @@ void MSDFManager::MappedBlock::Close() {
 }
 
 MSDFManager::ArenaState::ArenaState() {
-	if (!MSDF::IS_WIN10) {
-		base = nullptr;
-		return;
-	}
-
-	constexpr uint32_t maxGlyphDim = MSDF::SDF_RENDER_SIZE + 2 * MSDF::SDF_SPREAD;
-	constexpr uint32_t maxPixelsPerGlyph = maxGlyphDim * maxGlyphDim;
-	constexpr uint32_t maxBytesPerGlyph = maxPixelsPerGlyph * 4;
-
-	constexpr size_t maxPayload = MSDFCache::BLOCK_SIZE * maxBytesPerGlyph;
-	constexpr size_t maxEntries = MSDFCache::BLOCK_SIZE * sizeof(MSDFCache::GlyphEntry);
-	constexpr size_t maxHashTable = MSDFCache::BLOCK_SIZE * sizeof(uint32_t);
-	constexpr size_t maxBlockSize = sizeof(MSDFCache::BlockFileHeader) + maxEntries + maxHashTable + maxPayload;
+	slotToBlockIndex.fill(0xFFFFFFFF);
 
 	SYSTEM_INFO si;
 	GetSystemInfo(&si);
-	const size_t gran = si.dwAllocationGranularity;
-	effectiveSlotSize = ((maxBlockSize + gran - 1) / gran) * gran;
-
-	slotToBlockIndex.fill(0xFFFFFFFF);
-
-	const size_t totalSize = effectiveSlotSize * MAX_ARENA_SLOTS;
-	base = VirtualAlloc2(GetCurrentProcess(), nullptr, totalSize, MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, nullptr, 0);
-	if (!base) return;
+	granularity = si.dwAllocationGranularity;
+}
 
-	for (size_t i = 0; i < MAX_ARENA_SLOTS; ++i) {
-		void* slotAddr = static_cast<char*>(base) + (i * effectiveSlotSize);
-		slotAddresses[i] = slotAddr;
-		VirtualFreeEx(GetCurrentProcess(), slotAddr, effectiveSlotSize, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER);
+MSDFManager::ArenaState::~ArenaState() { Release(); }
+
+bool MSDFManager::ArenaState::Reserve() {
+	if (base) return true;
+	if (reserveAttempted || !MSDF::IS_WIN10) return false;
+	reserveAttempted = true;
+
+	// a fragmented 32-bit address space may not have the whole budget in one piece, settle for less rather than nothing
+	constexpr size_t minReserve = MIN_ARENA_BUDGET_MB * 1024 * 1024 / 2;
+	for (size_t size = RoundUp(budgetSize); size >= minReserve; size = RoundUp(size / 2)) {
+		base = VirtualAlloc2(GetCurrentProcess(), nullptr, size, MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, nullptr, 0);
+		if (base) {
+			reservedSize = size;
+			freeRanges.clear();
+			freeRanges.emplace(0, size);
+			return true;
+		}
 	}
+	return false;
 }
 
-MSDFManager::ArenaState::~ArenaState() {
+void MSDFManager::ArenaState::Release() {
+	FlushAll();
 	if (base) {
 		VirtualFreeEx(GetCurrentProcess(), base, 0, MEM_RELEASE);
 		base = nullptr;
 	}
+	reservedSize = 0;
+	reserveAttempted = false;
+	freeRanges.clear();
 }
 
-void* MSDFManager::ArenaState::GetFreeSlot(uint32_t blockIndex, uint32_t& outSlotIndex) {
-	if (freeMask == 0) return nullptr;
+bool MSDFManager::ArenaState::CanFit(size_t size) const {
+	if (freeMask == 0) return false;
+	for (const auto& [offset, rangeSize] : freeRanges) { if (rangeSize >= size) return true; }
+	return false;
+}
+
+uint32_t MSDFManager::ArenaState::GetLeastRecentlyUsedSlot() const {
+	uint32_t lruSlot = 0xFFFFFFFF;
+	uint64_t oldest = UINT64_MAX;
+	for (uint32_t i = 0; i < MAX_ARENA_SLOTS; ++i) {
+		if (IsSlotOccupied(i) && slotLastUse[i] < oldest) {
+			oldest = slotLastUse[i];
+			lruSlot = i;
+		}
+	}
+	return lruSlot;
+}
+
+void* MSDFManager::ArenaState::GetFreeSlot(uint32_t blockIndex, size_t size, uint32_t& outSlotIndex) {
+	if (!base || freeMask == 0) return nullptr;
+	size = RoundUp(size);
+
+	// best fit keeps the big ranges intact for CJK blocks
+	auto best = freeRanges.end();
+	for (auto it = freeRanges.begin(); it != freeRanges.end(); ++it) { if (it->second >= size && (best == freeRanges.end() || it->second < best->second)) best = it; }
+	if (best == freeRanges.end()) return nullptr;
+
+	const size_t offset = best->first;
+	const size_t rangeSize = best->second;
+	void* slotAddr = static_cast<char*>(base) + offset;
+
+	// split the placeholder so the view can replace exactly [slotAddr, slotAddr + size)
+	if (rangeSize > size && !VirtualFreeEx(GetCurrentProcess(), slotAddr, size, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER)) return nullptr;
+
+	freeRanges.erase(best);
+	if (rangeSize > size) freeRanges.emplace(offset + size, rangeSize - size);
+
 	uint32_t slotIdx = static_cast<uint32_t>(std::countr_zero(freeMask));
 	freeMask &= ~(1ULL << slotIdx);
 	slotToBlockIndex[slotIdx] = blockIndex;
+	slotAddresses[slotIdx] = slotAddr;
+	slotSizes[slotIdx] = size;
 	outSlotIndex = slotIdx;
-	return slotAddresses[slotIdx];
+	return slotAddr;
 }
 
 void MSDFManager::ArenaState::FreeSlot(uint32_t slotIndex) {
 	if (slotIndex >= MAX_ARENA_SLOTS || !IsSlotOccupied(slotIndex)) return;
 
 	void* slotAddr = slotAddresses[slotIndex];
-	uintptr_t currentAddr = reinterpret_cast<uintptr_t>(slotAddr);
-	uintptr_t endAddr = currentAddr + effectiveSlotSize;
-
-	while (currentAddr < endAddr) {
-		MEMORY_BASIC_INFORMATION mbi;
-		if (VirtualQuery(reinterpret_cast<void*>(currentAddr), &mbi, sizeof(mbi)) == 0) break;
-		if (reinterpret_cast<uintptr_t>(mbi.BaseAddress) >= endAddr) break;
-
-		size_t regionSize = mbi.RegionSize;
-		if (mbi.State != MEM_FREE) {
-			if (mbi.Type == MEM_MAPPED) { UnmapViewOfFile2(GetCurrentProcess(), mbi.BaseAddress, 0); }
-			else { VirtualFree(mbi.BaseAddress, 0, MEM_RELEASE); }
+	const size_t slotSize = slotSizes[slotIndex];
+
+	// turn a still mapped view back into a placeholder
+	MEMORY_BASIC_INFORMATION mbi;
+	if (VirtualQuery(slotAddr, &mbi, sizeof(mbi)) != 0 && mbi.Type == MEM_MAPPED) { UnmapViewOfFile2(GetCurrentProcess(), slotAddr, MEM_PRESERVE_PLACEHOLDER); }
+
+	size_t offset = static_cast<size_t>(static_cast<char*>(slotAddr) - static_cast<char*>(base));
+	size_t size = slotSize;
+	auto next = freeRanges.lower_bound(offset);
+	if (next != freeRanges.begin()) {
+		auto prev = std::prev(next);
+		if (prev->first + prev->second == offset) {
+			offset = prev->first;
+			size += prev->second;
+			freeRanges.erase(prev);
 		}
-		currentAddr += regionSize;
 	}
-
-	VirtualFreeEx(GetCurrentProcess(), slotAddr, 0, MEM_RELEASE | MEM_COALESCE_PLACEHOLDERS);
-	VirtualAlloc2(GetCurrentProcess(), slotAddr, effectiveSlotSize, MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, nullptr, 0);
+	if (next != freeRanges.end() && offset + size == next->first) {
+		size += next->second;
+		freeRanges.erase(next);
+	}
+	freeRanges.emplace(offset, size);
+	if (size != slotSize) VirtualFreeEx(GetCurrentProcess(), static_cast<char*>(base) + offset, size, MEM_RELEASE | MEM_COALESCE_PLACEHOLDERS);
 
 	freeMask |= (1ULL << slotIndex);
-
 	slotToBlockIndex[slotIndex] = 0xFFFFFFFF;
+	slotAddresses[slotIndex] = nullptr;
+	slotSizes[slotIndex] = 0;
 }
 
 void MSDFManager::ArenaState::FlushAll() { for (uint32_t i = 0; i < MAX_ARENA_SLOTS; ++i) { if (IsSlotOccupied(i)) FreeSlot(i); } }
 
+void MSDFManager::SetArenaBudget(size_t bytes) {
+	if (bytes == s_arena.budgetSize) return;
+	FlushAll();
+	s_arena.Release();
+	s_arena.budgetSize = bytes;
+}
+
 void MSDFManager::FreeBlock(uint32_t blockIndex) {
 	if (blockIndex >= MAX_ARENA_SLOTS) return;
 
 	MappedBlock& block = s_mappedBlocks[blockIndex];
 	MSDFCache::BlockKey keyToErase = block.key;
 
-	if (block.slotIndex != 0xFFFFFFFF) { s_arena.FreeSlot(block.slotIndex); }
+	const uint32_t slotIndex = block.slotIndex;
 	block.Reset();
+	if (slotIndex != 0xFFFFFFFF) { s_arena.FreeSlot(slotIndex); }
 	s_blockCache.erase(keyToErase);
 
 	if (s_lastBlockIndex == blockIndex) {
@@ -114,6 +165,8 @@ void MSDFManager::FreeBlock(uint32_t blockIndex) {
 }
 
 void MSDFManager::FreeBlockByKey(MSDFCache::BlockKey key) {
+	// only called right before the block file is rewritten
+	s_verifiedBlocks.erase(key.pack());
 	auto it = s_blockCache.find(key);
 	if (it == s_blockCache.end()) return;
 	FreeBlock(it->second);
@@ -143,53 +196,58 @@ FontHash MSDFManager::GetFontHash(uint32_t fontId) {
 	return (it != s_fontIdToHash.end()) ? it->second : 0;
 }
 
-bool MSDFManager::LoadMappedBlock(const MSDFCache::BlockWrap& wrap, MappedBlock& outBlock, void* slotAddr, uint32_t slotIndex) {
-	outBlock.file.handle = CreateFileW(wrap.path.native().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
-	if (outBlock.file.handle == INVALID_HANDLE_VALUE) {
-		s_arena.FreeSlot(slotIndex);
-		return false;
+bool MSDFManager::LoadMappedBlock(const MSDFCache::BlockWrap& wrap, uint32_t& outSlotIndex) {
+	if (!s_arena.Reserve()) return false;
+
+	FileGuard file(CreateFileW(wrap.path.native().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr));
+	if (!file.IsValid()) return false;
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle(file, &info)) return false;
+	const uint64_t fileSize = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+	const VerifiedBlock identity{
+		.fileIndex = (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow,
+		.fileSize = fileSize,
+		.writeTime = (static_cast<uint64_t>(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime,
+		.volumeSerial = info.dwVolumeSerialNumber,
+	};
+	if (fileSize < sizeof(MSDFCache::BlockFileHeader) || fileSize > s_arena.reservedSize) return false;
+
+	// blocks are written padded to the allocation granularity, so the file size is header + tables + real payload
+	const size_t splitSize = s_arena.RoundUp(static_cast<size_t>(fileSize));
+	while (!s_arena.CanFit(splitSize)) {
+		const uint32_t lruSlot = s_arena.GetLeastRecentlyUsedSlot();
+		if (lruSlot == 0xFFFFFFFF) return false;
+		FreeBlock(lruSlot);
+		++MSDF::g_arenaStats.evictions;
 	}
 
-	LARGE_INTEGER fileSizeLI;
-	if (!GetFileSizeEx(outBlock.file.handle, &fileSizeLI)) {
-		s_arena.FreeSlot(slotIndex);
-		return false;
-	}
-	outBlock.fileSize = static_cast<uint64_t>(fileSizeLI.QuadPart);
+	uint32_t slotIndex = 0;
+	void* slotAddr = s_arena.GetFreeSlot(wrap.key.blockId, splitSize, slotIndex);
+	if (!slotAddr) return false;
 
-	const size_t allocGran = s_si.dwAllocationGranularity;
-	uint64_t splitSize = ((outBlock.fileSize + allocGran - 1) / allocGran) * allocGran;
-	if (splitSize < allocGran) splitSize = allocGran;
-	if (splitSize > s_arena.SlotSize()) {
-		s_arena.FreeSlot(slotIndex);
-		return false;
-	}
+	MappedBlock& outBlock = s_mappedBlocks[slotIndex];
+	outBlock.Reset();
 	outBlock.slotIndex = slotIndex;
+	outBlock.fileSize = fileSize;
+	outBlock.file.handle = file.Release();
 
-	if (!VirtualFreeEx(GetCurrentProcess(), slotAddr, splitSize, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER)) {
+	auto fail = [&]() {
+		outBlock.Reset();
 		s_arena.FreeSlot(slotIndex);
 		return false;
-	}
+	};
 
-	DWORD sizeHigh = static_cast<DWORD>(splitSize >> 32);
+	DWORD sizeHigh = static_cast<DWORD>(static_cast<uint64_t>(splitSize) >> 32);
 	DWORD sizeLow = static_cast<DWORD>(splitSize & 0xFFFFFFFF);
 	outBlock.mapping.handle = CreateFileMappingW(outBlock.file.handle, nullptr, PAGE_READONLY, sizeHigh, sizeLow, nullptr);
-	if (!outBlock.mapping.handle) {
-		s_arena.FreeSlot(slotIndex);
-		return false;
-	}
+	if (!outBlock.mapping.handle) return fail();
 
 	outBlock.view.ptr = MapViewOfFile3(outBlock.mapping.handle, nullptr, slotAddr, 0, splitSize, MEM_REPLACE_PLACEHOLDER, PAGE_READONLY, nullptr, 0);
-	if (!outBlock.view.ptr) {
-		s_arena.FreeSlot(slotIndex);
-		return false;
-	}
+	if (!outBlock.view.ptr) return fail();
 
 	outBlock.header = static_cast<const MSDFCache::BlockFileHeader*>(outBlock.view.ptr);
-	if (outBlock.header->magic != MSDFCache::BLOCK_MAGIC || outBlock.header->version != MSDFCache::CACHE_VERSION || outBlock.header->blockId != wrap.key.blockId || outBlock.header->entryCount > MSDFCache::BLOCK_SIZE) {
-		s_arena.FreeSlot(slotIndex);
-		return false;
-	}
+	if (outBlock.header->magic != MSDFCache::BLOCK_MAGIC || outBlock.header->version != MSDFCache::CACHE_VERSION || outBlock.header->blockId != wrap.key.blockId || outBlock.header->entryCount > MSDFCache::BLOCK_SIZE) return fail();
 
 	outBlock.entryCount = outBlock.header->entryCount;
 	outBlock.entries = reinterpret_cast<const MSDFCache::GlyphEntry*>(static_cast<const uint8_t*>(outBlock.view.ptr) + sizeof(MSDFCache::BlockFileHeader));
@@ -198,53 +256,59 @@ bool MSDFManager::LoadMappedBlock(const MSDFCache::BlockWrap& wrap, MappedBlock&
 	outBlock.hashTable = reinterpret_cast<const uint32_t*>(static_cast<const uint8_t*>(outBlock.view.ptr) + hashTableOffset);
 
 	size_t payloadOffset = hashTableOffset + (MSDFCache::BLOCK_SIZE * sizeof(uint32_t));
-	if (outBlock.fileSize < payloadOffset) {
-		s_arena.FreeSlot(slotIndex);
-		return false;
-	}
+	if (outBlock.fileSize < payloadOffset + outBlock.header->payloadSize) return fail();
 	outBlock.payload = static_cast<const uint8_t*>(outBlock.view.ptr) + payloadOffset;
 
-	size_t maxPayload = static_cast<size_t>(outBlock.fileSize - payloadOffset);
-	for (uint32_t i = 0; i < outBlock.entryCount; ++i) {
-		const MSDFCache::GlyphEntry& e = outBlock.entries[i];
-		if (e.dataSize > 0) {
-			if (e.dataOffset + e.dataSize > maxPayload) {
-				s_arena.FreeSlot(slotIndex);
-				return false;
-			}
+	// header checks above always run; the tables are checksummed once per file identity and session,
+	// and walked entry by entry only when the checksum does not match
+	auto verified = s_verifiedBlocks.find(wrap.key.pack());
+	if (verified != s_verifiedBlocks.end() && verified->second == identity) { ++MSDF::g_arenaStats.remaps; }
+	else if (Crc32C(outBlock.entries, payloadOffset - sizeof(MSDFCache::BlockFileHeader)) == outBlock.header->checksum) { s_verifiedBlocks[wrap.key.pack()] = identity; }
+	else {
+		++MSDF::g_arenaStats.checksumFailures;
+		const size_t maxPayload = outBlock.header->payloadSize;
+		for (uint32_t i = 0; i < outBlock.entryCount; ++i) {
+			const MSDFCache::GlyphEntry& e = outBlock.entries[i];
+			if (e.dataSize > 0) { if (e.dataOffset + e.dataSize > maxPayload) return fail(); }
 		}
 	}
 	outBlock.key = wrap.key;
+	outSlotIndex = slotIndex;
 
 	return true;
 }
 
 MSDFManager::MappedBlock* MSDFManager::GetOrLoadMappedBlock(const MSDFCache::BlockWrap& wrap) {
-	if (s_lastBlockIndex != 0xFFFFFFFF && s_lastBlockKey == wrap.key) { return &s_mappedBlocks[s_lastBlockIndex]; }
+	if (s_lastBlockIndex != 0xFFFFFFFF && s_lastBlockKey == wrap.key) {
+		++MSDF::g_arenaStats.hits;
+		s_arena.Touch(s_mappedBlocks[s_lastBlockIndex].slotIndex);
+		return &s_mappedBlocks[s_lastBlockIndex];
+	}
 
 	auto it = s_blockCache.find(wrap.key);
 	if (it != s_blockCache.end()) {
+		++MSDF::g_arenaStats.hits;
 		s_lastBlockIndex = it->second;
 		s_lastBlockKey = wrap.key;
+		s_arena.Touch(s_mappedBlocks[it->second].slotIndex);
 		return &s_mappedBlocks[it->second];
 	}
-	if (s_arena.freeMask == 0) FlushAll();
+	++MSDF::g_arenaStats.misses;
 
+	// only the coldest blocks are unmapped to make room, the rest of the working set stays mapped;
+	// if the block cannot be mapped at all the glyph is simply regenerated from the outline
 	uint32_t slotIndex = 0;
-	void* slotAddr = s_arena.GetFreeSlot(wrap.key.blockId, slotIndex);
-	if (slotAddr == nullptr) return nullptr;
-
-	MappedBlock& newBlock = s_mappedBlocks[slotIndex];
-	if (!LoadMappedBlock(wrap, newBlock, slotAddr, slotIndex)) return nullptr;
+	if (!LoadMappedBlock(wrap, slotIndex)) return nullptr;
+	s_arena.Touch(slotIndex);
 
 	s_lastBlockIndex = slotIndex;
 	s_lastBlockKey = wrap.key;
 
 	s_blockCache[wrap.key] = slotIndex;
-	return &newBlock;
+	return &s_mappedBlocks[slotIndex];
 }
 
-bool MSDFManager::LoadGlyph(const MSDFCache::BlockWrap& wrap, uint32_t codepoint, GlyphMetrics& outMetrics) {
+bool MSDFManager::LoadGlyph(const MSDFCache::BlockWrap& wrap, uint32_t codepoint, GlyphMetrics& outMetrics, const MSDFCache::GlyphEntry** outEntry) {
 	MappedBlock* blockPtr = GetOrLoadMappedBlock(wrap);
 	if (!blockPtr) return false;
 
@@ -258,7 +322,9 @@ bool MSDFManager::LoadGlyph(const MSDFCache::BlockWrap& wrap, uint32_t codepoint
 	outMetrics.height = ge.height;
 	outMetrics.bitmapTop = ge.bitmapTop;
 	outMetrics.bitmapLeft = ge.bitmapLeft;
+	outMetrics.tier = ge.tier < MSDF::QUALITY_TIER_COUNT ? ge.tier : 0;
 	outMetrics.pixelData = ge.dataSize > 0 ? blockPtr->payload + ge.dataOffset : nullptr;
+	if (outEntry) *outEntry = &ge;
 
 	return true;
 }
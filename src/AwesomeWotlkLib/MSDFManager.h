@@ -3,6 +3,7 @@
 #include "MSDFCache.h"
 #include "unordered_dense/include/ankerl/unordered_dense.h"
 #include <filesystem>
+#include <map>
 
 class MSDFCache;
 
@@ -17,8 +18,15 @@ public:
 	MSDFManager(MSDFManager&&) = delete;
 	MSDFManager& operator=(MSDFManager&&) = delete;
 
+	// address space reserved for mapped cache blocks, applied lazily on the next block load
+	static void SetArenaBudget(size_t bytes);
+
+	static constexpr size_t MIN_ARENA_BUDGET_MB = 8;
+	static constexpr size_t MAX_ARENA_BUDGET_MB = 256;
+	static constexpr size_t DEFAULT_ARENA_BUDGET_MB = 64;
+
 private:
-	static constexpr size_t MAX_ARENA_SLOTS = 16;
+	static constexpr size_t MAX_ARENA_SLOTS = 32;
 	static_assert(MAX_ARENA_SLOTS <= 64);
 	static_assert(MSDFCache::BLOCK_SIZE > 0 && (MSDFCache::BLOCK_SIZE & (MSDFCache::BLOCK_SIZE - 1)) == 0, "BLOCK_SIZE must be a power of 2");
 
@@ -52,29 +60,53 @@ private:
 
 	static_assert(sizeof(MappedBlock) == 128);
 
+	// one placeholder reservation carved into variable-size slots, free ranges are kept coalesced
 	struct ArenaState {
 		void* base = nullptr;
+		size_t reservedSize = 0;
+		size_t budgetSize = DEFAULT_ARENA_BUDGET_MB * 1024 * 1024;
+		size_t granularity = 0;
+		bool reserveAttempted = false;
 
-		size_t effectiveSlotSize = 0;
 		uint64_t freeMask = (1ULL << MAX_ARENA_SLOTS) - 1;
 
-		std::array<void*, MAX_ARENA_SLOTS> slotAddresses;
+		std::array<void*, MAX_ARENA_SLOTS> slotAddresses{};
+		std::array<size_t, MAX_ARENA_SLOTS> slotSizes{};
 		std::array<uint32_t, MAX_ARENA_SLOTS> slotToBlockIndex;
+		std::array<uint64_t, MAX_ARENA_SLOTS> slotLastUse{};
+		uint64_t useTick = 0;
+
+		std::map<size_t, size_t> freeRanges; // offset -> size
 
 		bool IsSlotOccupied(uint32_t i) const { return !(freeMask & (1ULL << i)); }
-		void* GetFreeSlot(uint32_t blockIndex, uint32_t& outSlotIndex);
+		void Touch(uint32_t slotIndex) { slotLastUse[slotIndex] = ++useTick; }
+		uint32_t GetLeastRecentlyUsedSlot() const;
+		bool Reserve();
+		void Release();
+		bool CanFit(size_t size) const;
+		void* GetFreeSlot(uint32_t blockIndex, size_t size, uint32_t& outSlotIndex);
 		void FreeSlot(uint32_t slotIndex);
 		void FlushAll();
 
 		ArenaState();
 		~ArenaState();
 
-		size_t SlotSize() const { return effectiveSlotSize; }
+		size_t RoundUp(size_t size) const { return ((size + granularity - 1) / granularity) * granularity; }
 	};
 
-	static bool LoadGlyph(const MSDFCache::BlockWrap& wrap, uint32_t codepoint, GlyphMetrics& outMetrics);
+	static bool LoadGlyph(const MSDFCache::BlockWrap& wrap, uint32_t codepoint, GlyphMetrics& outMetrics, const MSDFCache::GlyphEntry** outEntry = nullptr);
+
+	// identity of a block file whose tables were verified once this session, trusted on remap while it still matches
+	struct VerifiedBlock {
+		uint64_t fileIndex = 0;
+		uint64_t fileSize = 0;
+		uint64_t writeTime = 0;
+		uint32_t volumeSerial = 0;
+
+		bool operator==(const VerifiedBlock& other) const = default;
+	};
 
-	static bool LoadMappedBlock(const MSDFCache::BlockWrap& wrap, MappedBlock& outBlock, void* slotAddr, uint32_t slotIndex);
+	static bool LoadMappedBlock(const MSDFCache::BlockWrap& wrap, uint32_t& outSlotIndex);
 	static MappedBlock* GetOrLoadMappedBlock(const MSDFCache::BlockWrap& wrap);
 
 	static uint32_t GetSlotBlockIndex(uint32_t slotIndex) { return (slotIndex < MAX_ARENA_SLOTS) ? s_arena.slotToBlockIndex[slotIndex] : 0xFFFFFFFF; }
@@ -88,6 +120,7 @@ private:
 
 	inline static std::array<MappedBlock, MAX_ARENA_SLOTS> s_mappedBlocks;
 	inline static ankerl::unordered_dense::map<MSDFCache::BlockKey, uint32_t> s_blockCache;
+	inline static ankerl::unordered_dense::map<uint64_t, VerifiedBlock> s_verifiedBlocks;
 
 	inline static uint32_t s_lastBlockIndex = 0xFFFFFFFF;
 	inline static MSDFCache::BlockKey s_lastBlockKey;
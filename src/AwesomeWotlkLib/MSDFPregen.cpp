@@ -1,6 +1,5 @@
 #include "MSDFPregen.h"
 #include "MSDFFont.h"
-#include "MSDFValidator.h"
 
 void MSDFPregen::RegisterForPreGen(FT_Face face, const FT_Byte* data, FT_Long size, FT_Long faceIndex) {
 	if (!face || !data || size <= 0) return;
@@ -12,10 +11,12 @@ void MSDFPregen::RegisterForPreGen(FT_Face face, const FT_Byte* data, FT_Long si
 		if (r.faceIndex == faceIndex && r.familyName == name && r.styleName == style) {
 			r.data = data;
 			r.size = size;
+			r.fontHash = HashFont(data, size);
 			return;
 		}
 	}
-	s_pendingRequests.push_back({face, data, size, faceIndex, name, style});
+	// the caches are keyed by the font binary, the same fingerprint MSDFFont opens them with
+	s_pendingRequests.push_back({face, data, size, faceIndex, HashFont(data, size), name, style});
 }
 
 bool MSDFPregen::AcquirePreGenLock() {
@@ -64,7 +65,7 @@ void MSDFPregen::ExecutePreGeneration() {
 
 	for (size_t i = 0; i < s_pendingRequests.size(); ++i) {
 		auto it = MSDFFont::s_fontHandles.find(s_pendingRequests[i].face);
-		if (it == MSDFFont::s_fontHandles.end() || !MSDFValidator::IsFontMSDFCompatible(it->second->m_msdfFont)) { if (it->second) invalid.push_back(it->second->m_ftFace); }
+		if (it != MSDFFont::s_fontHandles.end() && it->second && !it->second->m_isCompatible) invalid.push_back(it->second->m_ftFace);
 	}
 	for (FT_Face face : invalid) MSDFFont::Unregister(face);
 
@@ -78,7 +79,7 @@ void MSDFPregen::ExecutePreGeneration() {
 
 			printf("%zu. %s %s", i + 1, req.familyName.c_str(), req.styleName.c_str());
 
-			MSDFCache probe(nullptr, 0, req.familyName.c_str(), req.styleName.c_str(), MSDF::SDF_RENDER_SIZE, MSDF::SDF_SPREAD);
+			MSDFCache probe(req.fontHash, req.familyName.c_str(), req.styleName.c_str(), MSDF::SDF_RENDER_SIZE, MSDF::SDF_SPREAD);
 			size_t count = probe.GetManifestSize();
 			if (count > 0) { printf(" (Cache found: %zu entries%s)", count, count >= MSDF::CJK_CACHE_THRESHOLD ? " [CJK-READY]" : ""); }
 			printf("\n");
@@ -105,33 +106,40 @@ void MSDFPregen::ExecutePreGeneration() {
 	}
 }
 
-bool MSDFPregen::GenerateFont(const PreGenRequest& req) {
-	std::string locale = MSDF::GetGameLocale();
-	const char* locale_str = locale.c_str();
-
-	uint32_t start = 0, end = 0;
-	auto rangeName = "Unknown";
-
-	if (strcmp(locale_str, "zhCN") == 0 || strcmp(locale_str, "zhTW") == 0) {
-		start = 0x0020;
-		end = 0x9FFF;
-		rangeName = "CJK Unified Ideographs (Chinese)";
-	}
-	else if (strcmp(locale_str, "koKR") == 0) {
-		start = 0x0020;
-		end = 0xD7AF;
-		rangeName = "Hangul Syllables (Korean)";
-	}
-	else if (strcmp(locale_str, "ruRU") == 0) {
-		start = 0x0020;
-		end = 0x04FF;
-		rangeName = "Cyrillic (Russian)";
-	}
-	else {
-		start = 0x0020;
-		end = 0x00FF;
-		rangeName = "Basic Latin / Extended ASCII";
+void MSDFPregen::PrintTierReport(const std::array<TierReport, MSDF::QUALITY_TIER_COUNT>& report) {
+	// generation time scales with the pixel count, so the base tier time is projected from the payload ratio
+	printf("\nTier  Size/Spread  Glyphs    Payload KB  Base KB     Saved   Time ms   Base ms   Saved\n");
+	uint64_t totalBytes = 0, totalBase = 0;
+	double totalMs = 0.0, totalBaseMs = 0.0;
+	for (uint32_t i = 0; i < MSDF::QUALITY_TIER_COUNT; ++i) {
+		const MSDF::QualityTier& tier = MSDF::GetTier(static_cast<uint8_t>(i));
+		const uint64_t glyphs = report[i].glyphs.load();
+		const uint64_t bytes = report[i].bytes.load();
+		const uint64_t baseBytes = report[i].baseBytes.load();
+		const double ms = report[i].micros.load() / 1000.0;
+		const double baseMs = bytes ? ms * static_cast<double>(baseBytes) / static_cast<double>(bytes) : 0.0;
+		totalBytes += bytes;
+		totalBase += baseBytes;
+		totalMs += ms;
+		totalBaseMs += baseMs;
+		printf("%-5u %3u/%-8u %-9llu %-11llu %-11llu %5.1f%%  %-9.0f %-9.0f %5.1f%%\n", i, tier.renderSize, tier.spread, glyphs, bytes / 1024, baseBytes / 1024, baseBytes ? 100.0 * (1.0 - static_cast<double>(bytes) / baseBytes) : 0.0, ms, baseMs, baseMs > 0.0 ? 100.0 * (1.0 - ms / baseMs) : 0.0);
 	}
+	printf("Total payload %llu KB (base %llu KB), cpu time %.0f ms (base %.0f ms)\n", totalBytes / 1024, totalBase / 1024, totalMs, totalBaseMs);
+
+	// what the simple outlines would have cost in Skia is projected from the ones that went through it
+	const MSDF::GeometryStats& geometry = MSDF::g_geometryStats;
+	const uint64_t simple = geometry.simple.load();
+	const uint64_t resolved = geometry.resolved.load();
+	if (simple + resolved == 0) return;
+	const double resolvedMs = geometry.resolvedMicros.load() / 1000.0;
+	const double savedMs = resolved ? simple * resolvedMs / resolved - geometry.simpleMicros.load() / 1000.0 : 0.0;
+	printf("Simple outlines %llu of %llu (%.1f%%) skipped Skia, est. %.0f ms saved, %.2fx faster\n", simple, simple + resolved, 100.0 * simple / (simple + resolved), savedMs, totalMs > 0.0 ? (totalMs + savedMs) / totalMs : 1.0);
+}
+
+bool MSDFPregen::GenerateFont(const PreGenRequest& req) {
+	const MSDF::CodepointRange range = MSDF::GetLocaleRange(MSDF::GetGameLocale());
+	uint32_t start = range.first, end = range.last;
+	const char* rangeName = range.name;
 
 	printf("\n=== Generating: %s %s ===\n", req.familyName.c_str(), req.styleName.c_str());
 	printf("Select Generation Depth:\n");
@@ -199,7 +207,7 @@ bool MSDFPregen::GenerateFont(const PreGenRequest& req) {
 		return false;
 	}
 
-	MSDFCache cache(req.data, req.size, req.familyName.c_str(), req.styleName.c_str(), MSDF::SDF_RENDER_SIZE, MSDF::SDF_SPREAD);
+	MSDFCache cache(req.fontHash, req.familyName.c_str(), req.styleName.c_str(), MSDF::SDF_RENDER_SIZE, MSDF::SDF_SPREAD);
 
 	unsigned int hw = std::thread::hardware_concurrency();
 	if (hw == 0) hw = 4;
@@ -224,7 +232,7 @@ bool MSDFPregen::GenerateFont(const PreGenRequest& req) {
 	}
 
 	std::vector<std::unique_ptr<MSDFFont>> threadMSDFFonts(numThreads);
-	if (allHandlesValid) { for (unsigned int i = 0; i < numThreads; ++i) { threadMSDFFonts[i] = std::make_unique<MSDFFont>(threadFaces[i], req.data, req.size, req.faceIndex); } }
+	if (allHandlesValid) { for (unsigned int i = 0; i < numThreads; ++i) { threadMSDFFonts[i] = std::make_unique<MSDFFont>(threadFaces[i], req.data, req.size); } }
 
 	if (!allHandlesValid) {
 		for (unsigned int i = 0; i < numThreads; ++i) {
@@ -240,6 +248,8 @@ bool MSDFPregen::GenerateFont(const PreGenRequest& req) {
 	std::atomic<uint32_t> doneCount(0);
 	std::atomic<bool> workerError(false);
 	std::mutex cacheMutex;
+	std::array<TierReport, MSDF::QUALITY_TIER_COUNT> tierReport;
+	MSDF::g_geometryStats.Reset();
 
 	std::thread progressThread([&]() {
 		while (!workerError.load(std::memory_order_acquire)) {
@@ -259,11 +269,8 @@ bool MSDFPregen::GenerateFont(const PreGenRequest& req) {
 			printf("ERROR: Invalid handles in worker %u\n", workerId);
 			return;
 		}
-		if (FT_Set_Pixel_Sizes(localFace, MSDF::SDF_RENDER_SIZE, MSDF::SDF_RENDER_SIZE) != 0) {
-			workerError.store(true, std::memory_order_release);
-			printf("ERROR: FT_Set_Pixel_Sizes failed in worker %u\n", workerId);
-			return;
-		}
+		uint8_t currentTier = 0xFF;
+		const MSDF::QualityTier& baseTier = MSDF::GetTier(0);
 
 		Throttle throttle(cpuLimit);
 		VectorPool<uint8_t> pool;
@@ -275,7 +282,19 @@ bool MSDFPregen::GenerateFont(const PreGenRequest& req) {
 			uint32_t cp = nextCp.fetch_add(1, std::memory_order_acq_rel);
 			if (cp > end) break;
 
+			const uint8_t tierIndex = MSDF::GetQualityTier(cp);
+			const MSDF::QualityTier& tier = MSDF::GetTier(tierIndex);
+			if (tierIndex != currentTier) {
+				if (FT_Set_Pixel_Sizes(localFace, tier.renderSize, tier.renderSize) != 0) {
+					workerError.store(true, std::memory_order_release);
+					printf("ERROR: FT_Set_Pixel_Sizes failed in worker %u\n", workerId);
+					break;
+				}
+				currentTier = tierIndex;
+			}
+
 			throttle.StartWork();
+			const auto genStart = std::chrono::steady_clock::now();
 
 			if (FT_Load_Glyph(localFace, FT_Get_Char_Index(localFace, cp), FT_LOAD_NO_BITMAP | FT_LOAD_NO_HINTING) != 0) {
 				doneCount.fetch_add(1, std::memory_order_relaxed);
@@ -302,16 +321,26 @@ bool MSDFPregen::GenerateFont(const PreGenRequest& req) {
 				int h = std::max(0, yMax - yMin);
 
 				if (w > 0 && h > 0) {
-					int sdfW = w + 2 * MSDF::SDF_SPREAD;
-					int sdfH = h + 2 * MSDF::SDF_SPREAD;
+					int sdfW = w + 2 * tier.spread;
+					int sdfH = h + 2 * tier.spread;
 
 					if (sdfW > 0 && sdfH > 0 && sdfW <= 512 && sdfH <= 512) {
 						msdfData.clear();
-						if (font->GenerateMSDF(msdfData, cp, sdfW, sdfH)) {
+						if (font->GenerateMSDF(msdfData, cp, sdfW, sdfH, tier.spread)) {
 							size_t expectedSize = static_cast<size_t>(sdfW) * sdfH * 4;
 							if (msdfData.size() == expectedSize) {
 								width = static_cast<uint16_t>(sdfW);
 								height = static_cast<uint16_t>(sdfH);
+
+								// what the same glyph would have cost at the base tier
+								const uint64_t baseW = (static_cast<uint64_t>(w) * baseTier.renderSize + tier.renderSize - 1) / tier.renderSize + 2 * baseTier.spread;
+								const uint64_t baseH = (static_cast<uint64_t>(h) * baseTier.renderSize + tier.renderSize - 1) / tier.renderSize + 2 * baseTier.spread;
+								const uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - genStart).count();
+								TierReport& report = tierReport[tierIndex];
+								report.glyphs.fetch_add(1, std::memory_order_relaxed);
+								report.bytes.fetch_add(expectedSize, std::memory_order_relaxed);
+								report.micros.fetch_add(micros, std::memory_order_relaxed);
+								report.baseBytes.fetch_add(baseW * baseH * 4, std::memory_order_relaxed);
 							}
 							else { printf("WARNING: Glyph U+%04X size mismatch: got %zu, expected %zu\n", cp, msdfData.size(), expectedSize); }
 						}
@@ -326,6 +355,7 @@ bool MSDFPregen::GenerateFont(const PreGenRequest& req) {
 			gm.height = height;
 			gm.bitmapLeft = bitmapLeft;
 			gm.bitmapTop = bitmapTop;
+			gm.tier = tierIndex;
 			gm.ownedPixelData.assign(msdfData.begin(), msdfData.end());
 			gm.dataSize = gm.ownedPixelData.size();
 
@@ -352,6 +382,8 @@ bool MSDFPregen::GenerateFont(const PreGenRequest& req) {
 	cache.FlushPendingWrites();
 	printf(" Done.\n");
 
+	PrintTierReport(tierReport);
+
 	threadMSDFFonts.clear();
 	for (auto face : threadFaces) { if (face) FT_Done_Face(face); }
 	if (ftLib) FT_Done_FreeType(ftLib);
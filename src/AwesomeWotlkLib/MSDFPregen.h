@@ -69,11 +69,19 @@ private:
 		size_t memoryUsed = 0;
 	};
 
+	struct TierReport {
+		std::atomic<uint64_t> glyphs{0};
+		std::atomic<uint64_t> bytes{0};
+		std::atomic<uint64_t> micros{0};
+		std::atomic<uint64_t> baseBytes{0}; // same glyphs at tier 0
+	};
+
 	struct PreGenRequest {
 		FT_Face face = nullptr;
 		const FT_Byte* data = nullptr;
 		FT_Long size = 0;
 		FT_Long faceIndex = 0;
+		FontHash fontHash = 0;
 		std::string familyName;
 		std::string styleName;
 	};
@@ -82,6 +90,7 @@ private:
 	static bool AcquirePreGenLock();
 	static void ReleasePreGenLock();
 	static bool GenerateFont(const PreGenRequest& req);
+	static void PrintTierReport(const std::array<TierReport, MSDF::QUALITY_TIER_COUNT>& report);
 
 	static void FlushStdin() {
 		int c;
@@ -0,0 +1,63 @@
+#pragma once
+#include <msdfgen.h>
+#include <msdfgen-ext.h>
+#include "MSDFUtils.h"
+#include "MSDFValidator.h"
+
+// every skip of resolveShapeGeometry has to leave the packed texels untouched, ShapeResolvedTest compares them byte for byte.
+// stays off until that comparison passes against the Skia build the DLL links
+inline constexpr bool MSDF_SKIP_RESOLVED_GEOMETRY = false;
+
+// the outline settled into what the generators expect, true when the Skia pass was skipped
+inline bool ResolveGlyphGeometry(msdfgen::Shape& shape, bool allowSkip) {
+	if (allowSkip && MSDFValidator::IsShapeResolved(shape)) {
+		shape.normalize();
+		shape.orientContours();
+		return true;
+	}
+	msdfgen::resolveShapeGeometry(shape);
+	return false;
+}
+
+// everything after the geometry pass: coloring, the msdf with its outline sdf in alpha, packed into sdfW * sdfH RGBA8 texels
+inline bool RasterizeGlyph(msdfgen::Shape& shape, std::vector<uint8_t>& outData, int sdfW, int sdfH, uint32_t spread, VectorPool<float>& pool) {
+	msdfgen::edgeColoringInkTrap(shape, 3.0, 0);
+
+	auto bounds = shape.getBounds();
+	double shapeW = bounds.r - bounds.l;
+	double shapeH = bounds.t - bounds.b;
+	if (shapeW <= 0 || shapeH <= 0) return false;
+
+	double usableW = static_cast<double>(sdfW) - 2.0 * spread;
+	double usableH = static_cast<double>(sdfH) - 2.0 * spread;
+	if (usableW <= 0 || usableH <= 0) return false;
+
+	double scale = std::min(usableW / shapeW, usableH / shapeH);
+	msdfgen::Projection projection(msdfgen::Vector2(scale, scale), msdfgen::Vector2(spread / scale - bounds.l, spread / scale - bounds.b));
+
+	auto msdfBuf = pool.AcquireSized(sdfW * sdfH * 3);
+	auto sdfBuf = pool.AcquireSized(sdfW * sdfH);
+
+	msdfgen::BitmapRef<float, 3> msdfBitmap(msdfBuf.data(), sdfW, sdfH);
+	msdfgen::BitmapRef<float, 1> sdfBitmap(sdfBuf.data(), sdfW, sdfH);
+
+	msdfgen::MSDFGeneratorConfig config;
+	config.overlapSupport = true;
+
+	msdfgen::Range msdfRange(spread / scale);
+	msdfgen::generateMSDF(msdfBitmap, shape, projection, msdfRange, config);
+	msdfgen::SDFTransformation msdfTransform(projection, msdfRange);
+	msdfgen::distanceSignCorrection(msdfBitmap, shape, msdfTransform, msdfgen::FillRule::FILL_NONZERO);
+
+	msdfgen::Range sdfRange(spread / scale * 5.0);
+	msdfgen::generateSDF(sdfBitmap, shape, projection, sdfRange);
+	msdfgen::SDFTransformation sdfTransform(projection, sdfRange);
+	msdfgen::distanceSignCorrection(sdfBitmap, shape, sdfTransform, msdfgen::FillRule::FILL_NONZERO);
+
+	// outData is the payload the cache stores and the atlas stages from, nothing else holds the packed texels
+	outData.resize(sdfW * sdfH * 4);
+	PackRGBA8(outData.data(), msdfBuf.data(), sdfBuf.data(), static_cast<size_t>(sdfW) * sdfH);
+	pool.Release(std::move(msdfBuf));
+	pool.Release(std::move(sdfBuf));
+	return true;
+}
@@ -14,7 +14,7 @@ inline auto* vertexShaderHLSL = R"(
 		float4 hpos : POSITION;
 		float4 col  : COLOR0;
 		float2 uv0  : TEXCOORD0;
-		float4 pageIdx : TEXCOORD1; // target page index
+		float4 pageIdx : TEXCOORD1; // target page index, glyph spread
 	};
 
 	VS_OUT main(VS_IN IN) {
@@ -26,11 +26,11 @@ inline auto* vertexShaderHLSL = R"(
 			OUT.uv0  = IN.uv0;
 			OUT.pageIdx = float4(0, 0, 0, 1.0f);
 		} else {
-			// encoded sign bits
-			float bit0 = (IN.uv0.x < 0.0f) ? 1.0f : 0.0f;
-			float bit1 = (IN.uv0.y < 0.0f) ? 2.0f : 0.0f;
-			OUT.pageIdx = float4(bit0 + bit1, 0, 0, 0);
-			OUT.uv0 = abs(IN.uv0);
+			// u carries the glyph tier's spread as an offset of 2 * spread, v the atlas page as an offset of 2 * page
+			float spread = floor(IN.uv0.x * 0.5f);
+			float page = floor(IN.uv0.y * 0.5f);
+			OUT.pageIdx = float4(page, spread, 0, 0);
+			OUT.uv0 = float2(IN.uv0.x - spread * 2.0f, IN.uv0.y - page * 2.0f);
 		}
 		return OUT;
 	}
@@ -39,17 +39,21 @@ inline auto* vertexShaderHLSL = R"(
 inline auto* pixelShaderHLSL = R"(
 	sampler2D gameTexture : register(s0);
 
-	sampler2D sdfAtlas0   : register(s12);
-	sampler2D sdfAtlas1   : register(s13);
-	sampler2D sdfAtlas2   : register(s14);
-	sampler2D sdfAtlas3   : register(s15);
+	sampler2D sdfAtlas0   : register(s8);
+	sampler2D sdfAtlas1   : register(s9);
+	sampler2D sdfAtlas2   : register(s10);
+	sampler2D sdfAtlas3   : register(s11);
+	sampler2D sdfAtlas4   : register(s12);
+	sampler2D sdfAtlas5   : register(s13);
+	sampler2D sdfAtlas6   : register(s14);
+	sampler2D sdfAtlas7   : register(s15);
 
 	float4 control : register(c23); // font size, outline mode, spread, atlas size
 
 	struct PS_IN {
 		float4 col : COLOR0;
 		float2 uv0 : TEXCOORD0;
-		float4 pageIdx : TEXCOORD1; // target page index
+		float4 pageIdx : TEXCOORD1; // target page index, glyph spread
 	};
 
 	float median(float r, float g, float b) {
@@ -77,10 +81,14 @@ inline auto* pixelShaderHLSL = R"(
 		if (atlasPage == 0) sample = tex2D(sdfAtlas0, uv);
 		else if (atlasPage == 1) sample = tex2D(sdfAtlas1, uv);
 		else if (atlasPage == 2) sample = tex2D(sdfAtlas2, uv);
-		else sample = tex2D(sdfAtlas3, uv);
+		else if (atlasPage == 3) sample = tex2D(sdfAtlas3, uv);
+		else if (atlasPage == 4) sample = tex2D(sdfAtlas4, uv);
+		else if (atlasPage == 5) sample = tex2D(sdfAtlas5, uv);
+		else if (atlasPage == 6) sample = tex2D(sdfAtlas6, uv);
+		else sample = tex2D(sdfAtlas7, uv);
 
 		float sd = median(sample.r, sample.g, sample.b);
-		float screenPxRange = (control.z / max(max(fwidth(uv.x), fwidth(uv.y)) * control.a, 1e-6)) * (1.0f - min(0.3f, fontSize * 0.0035f)); // smoother edges for larger text
+		float screenPxRange = (IN.pageIdx.y / max(max(fwidth(uv.x), fwidth(uv.y)) * control.a, 1e-6)) * (1.0f - min(0.3f, fontSize * 0.0035f)); // smoother edges for larger text
 		float opacity = saturate((sd - 0.5f) * screenPxRange + 0.5f);
 
 		if (outlinePx > 0.0f) {
@@ -0,0 +1,154 @@
+#include "MSDFSharedMemory.h"
+#include "unordered_dense/include/ankerl/unordered_dense.h"
+
+bool MSDFSharedMemory::Find(FontHash fontHash, uint32_t codepoint, GlyphMetrics& outMetrics) {
+	if (!Attach()) return false;
+
+	const uint32_t mask = s_header->slotCount - 1;
+	uint32_t index = GetSlotIndex(fontHash, codepoint);
+	for (uint32_t probe = 0; probe < MAX_PROBES; ++probe, index = (index + 1) & mask) {
+		const Slot& slot = s_slots[index];
+		// slots are never freed, so the first empty one ends the probe chain
+		const LONG state = ReadAcquire(&slot.state);
+		if (state == SLOT_EMPTY) return false;
+		if (state != SLOT_PUBLISHED || slot.fontHash != fontHash || slot.codepoint != codepoint) continue;
+		// written by other processes, a slot that would read outside the payload area or short of its box is a miss
+		if (slot.payloadSize != static_cast<uint32_t>(slot.width) * slot.height * 4 || static_cast<uint64_t>(slot.payloadOffset) + slot.payloadSize > s_header->payloadCapacity) return false;
+
+		outMetrics.width = slot.width;
+		outMetrics.height = slot.height;
+		outMetrics.bitmapTop = slot.bitmapTop;
+		outMetrics.bitmapLeft = slot.bitmapLeft;
+		outMetrics.tier = slot.tier < MSDF::QUALITY_TIER_COUNT ? slot.tier : 0;
+		outMetrics.pixelData = slot.payloadSize ? s_view + s_header->payloadOffset + slot.payloadOffset : nullptr;
+		++MSDF::g_sharedStats.hits;
+		return true;
+	}
+	return false;
+}
+
+void MSDFSharedMemory::Publish(FontHash fontHash, uint32_t codepoint, const GlyphMetrics& metrics) {
+	// a failed generation has nothing another client could use
+	if (!metrics.pixelData || !metrics.width || !metrics.height || !Attach()) return;
+
+	const uint32_t payloadSize = static_cast<uint32_t>(metrics.width) * metrics.height * 4;
+	uint32_t offset = 0;
+	bool allocated = false;
+	const uint32_t mask = s_header->slotCount - 1;
+	uint32_t index = GetSlotIndex(fontHash, codepoint);
+	for (uint32_t probe = 0; probe < MAX_PROBES; ++probe, index = (index + 1) & mask) {
+		Slot& slot = s_slots[index];
+		const LONG state = ReadAcquire(&slot.state);
+		if (state == SLOT_PUBLISHED && slot.fontHash == fontHash && slot.codepoint == codepoint) return;
+		if (state != SLOT_EMPTY) continue;
+
+		// reserved once and kept across lost races, a payload whose slot never comes is only wasted space
+		if (!allocated) {
+			if (!AllocatePayload(payloadSize, offset)) return;
+			allocated = true;
+		}
+		// another client took the slot first, it may be publishing the same glyph but a duplicate further down is harmless
+		if (InterlockedCompareExchange(&slot.state, SLOT_CLAIMED, SLOT_EMPTY) != SLOT_EMPTY) continue;
+
+		std::memcpy(s_view + s_header->payloadOffset + offset, metrics.pixelData, payloadSize);
+		slot.fontHash = fontHash;
+		slot.codepoint = codepoint;
+		slot.payloadOffset = offset;
+		slot.payloadSize = payloadSize;
+		slot.width = metrics.width;
+		slot.height = metrics.height;
+		slot.bitmapTop = metrics.bitmapTop;
+		slot.bitmapLeft = metrics.bitmapLeft;
+		slot.tier = metrics.tier;
+		InterlockedExchange(&slot.state, SLOT_PUBLISHED);
+		InterlockedIncrement(&s_header->glyphCount);
+		++MSDF::g_sharedStats.published;
+		return;
+	}
+}
+
+bool MSDFSharedMemory::AllocatePayload(uint32_t size, uint32_t& outOffset) {
+	const uint32_t aligned = (size + PAYLOAD_ALIGNMENT - 1) & ~(PAYLOAD_ALIGNMENT - 1);
+	LONG used = ReadAcquire(&s_header->payloadUsed);
+	while (true) {
+		if (static_cast<uint64_t>(static_cast<uint32_t>(used)) + aligned > s_header->payloadCapacity) return false;
+		const LONG seen = InterlockedCompareExchange(&s_header->payloadUsed, used + static_cast<LONG>(aligned), used);
+		if (seen == used) break;
+		used = seen;
+	}
+	outOffset = static_cast<uint32_t>(used);
+	return true;
+}
+
+uint64_t MSDFSharedMemory::GetUsedBytes() { return s_header ? static_cast<uint64_t>(s_header->payloadOffset) + static_cast<uint32_t>(ReadAcquire(&s_header->payloadUsed)) : 0; }
+
+uint64_t MSDFSharedMemory::GetSizeBytes() { return s_header ? s_header->totalSize : 0; }
+
+bool MSDFSharedMemory::Attach() {
+	if (s_view) return true;
+	if (s_attachFailed || s_sizeMB == 0) return false;
+	// one attempt per session, the per-process path works without it
+	s_attachFailed = true;
+
+	wchar_t name[64];
+	swprintf_s(name, L"Local\\AwesomeWotLK_MSDF_%u_%u_%u", VERSION, MSDF::SDF_RENDER_SIZE, MSDF::SDF_SPREAD);
+	const uint32_t size = std::clamp(s_sizeMB, MIN_SIZE_MB, MAX_SIZE_MB) * 1024 * 1024;
+
+	s_mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, size, name);
+	if (!s_mapping) return false;
+	const bool created = GetLastError() != ERROR_ALREADY_EXISTS;
+
+	FinalAction cleanup([&]() {
+		if (s_view) return;
+		CloseHandle(s_mapping);
+		s_mapping = nullptr;
+	});
+
+	auto* view = static_cast<uint8_t*>(MapViewOfFile(s_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+	if (!view) return false;
+
+	auto* hdr = reinterpret_cast<SharedHeader*>(view);
+	if (created) {
+		uint32_t slotCount = std::bit_floor(size / BYTES_PER_SLOT_BUDGET);
+		hdr->magic = MAGIC;
+		hdr->version = VERSION;
+		hdr->totalSize = size;
+		hdr->slotCount = slotCount;
+		hdr->payloadOffset = (sizeof(SharedHeader) + slotCount * sizeof(Slot) + PAYLOAD_ALIGNMENT - 1) & ~(PAYLOAD_ALIGNMENT - 1);
+		hdr->payloadCapacity = size - hdr->payloadOffset;
+		InterlockedExchange(&hdr->ready, 1);
+	}
+	else {
+		// the creating client may still be laying the store out
+		const ULONGLONG start = GetTickCount64();
+		while (!ReadAcquire(&hdr->ready) && GetTickCount64() - start < READY_TIMEOUT_MS) Sleep(1);
+
+		MEMORY_BASIC_INFORMATION mbi{};
+		const bool valid = ReadAcquire(&hdr->ready) && hdr->magic == MAGIC && hdr->version == VERSION && VirtualQuery(view, &mbi, sizeof(mbi)) && mbi.RegionSize >= hdr->totalSize && std::has_single_bit(hdr->slotCount) && sizeof(SharedHeader) + static_cast<uint64_t>(hdr->slotCount) * sizeof(Slot) <= hdr->payloadOffset && static_cast<uint64_t>(hdr->payloadOffset) + hdr->payloadCapacity <= hdr->totalSize;
+		if (!valid) {
+			UnmapViewOfFile(view);
+			return false;
+		}
+	}
+
+	s_view = view;
+	s_header = hdr;
+	s_slots = reinterpret_cast<Slot*>(view + sizeof(SharedHeader));
+	s_attachFailed = false;
+	return true;
+}
+
+uint32_t MSDFSharedMemory::GetSlotIndex(FontHash fontHash, uint32_t codepoint) {
+	const uint64_t key[2] = {fontHash, codepoint};
+	return static_cast<uint32_t>(ankerl::unordered_dense::detail::wyhash::hash(key, sizeof(key))) & (s_header->slotCount - 1);
+}
+
+void MSDFSharedMemory::Shutdown() {
+	if (s_view) UnmapViewOfFile(s_view);
+	if (s_mapping) CloseHandle(s_mapping);
+	s_view = nullptr;
+	s_header = nullptr;
+	s_slots = nullptr;
+	s_mapping = nullptr;
+	s_attachFailed = false;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include "MSDF.h"
+#include "MSDFUtils.h"
+
+// machine-wide glyph store in named shared memory, for several clients running side by side.
+// every client publishes the glyphs it loads or generates, slots and payload space are claimed with interlocked operations
+// and read without locking. published slots are immutable until the last client detaches, misses fall through to the per-process cache
+class MSDFSharedMemory {
+public:
+	static constexpr uint32_t MIN_SIZE_MB = 16;
+	static constexpr uint32_t MAX_SIZE_MB = 256;
+	static constexpr uint32_t DEFAULT_SIZE_MB = 0; // a single client gains nothing from it and would still give up the address space
+
+	// 0 disables, only the first client to attach decides the size. the view is mapped on the first glyph miss
+	static void SetSize(uint32_t megabytes) { s_sizeMB = megabytes; }
+
+	static bool Find(FontHash fontHash, uint32_t codepoint, GlyphMetrics& outMetrics);
+	// only glyphs with a payload are published, pixelData must hold width * height texels
+	static void Publish(FontHash fontHash, uint32_t codepoint, const GlyphMetrics& metrics);
+
+	static uint64_t GetUsedBytes();
+	static uint64_t GetSizeBytes();
+	static void Shutdown();
+
+private:
+	static constexpr uint32_t MAGIC = 0x4D53534D;
+	static constexpr uint32_t VERSION = 2; // bump whenever the layout or the payload format changes
+	static constexpr LONG SLOT_EMPTY = 0;
+	static constexpr LONG SLOT_PUBLISHED = 1;
+	static constexpr LONG SLOT_CLAIMED = 2; // a client is writing it, left for good if that client dies
+	static constexpr uint32_t MAX_PROBES = 64;
+	static constexpr uint32_t BYTES_PER_SLOT_BUDGET = 8 * 1024; // one slot per this much payload, roughly a Latin glyph
+	static constexpr uint32_t PAYLOAD_ALIGNMENT = 16;
+	static constexpr DWORD READY_TIMEOUT_MS = 200;
+
+	struct alignas(64) SharedHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t totalSize;
+		uint32_t slotCount;     // power of two
+		uint32_t payloadOffset; // from the start of the view
+		uint32_t payloadCapacity;
+		volatile LONG payloadUsed; // advanced by compare and swap, always a multiple of PAYLOAD_ALIGNMENT
+		volatile LONG glyphCount;
+		volatile LONG ready; // set once the creating client laid the store out
+	};
+
+	struct Slot {
+		FontHash fontHash;
+		uint32_t codepoint;
+		volatile LONG state; // claimed first and published last, everything else is immutable once it reads SLOT_PUBLISHED
+		uint32_t payloadOffset;
+		uint32_t payloadSize;
+		uint16_t width;
+		uint16_t height;
+		FT_Int bitmapTop;
+		FT_Int bitmapLeft;
+		uint8_t tier;
+	};
+
+	static_assert(sizeof(SharedHeader) == 64);
+
+	static bool Attach();
+	static bool AllocatePayload(uint32_t size, uint32_t& outOffset);
+	static uint32_t GetSlotIndex(FontHash fontHash, uint32_t codepoint);
+
+	inline static uint32_t s_sizeMB = DEFAULT_SIZE_MB;
+	inline static bool s_attachFailed = false;
+	inline static HANDLE s_mapping = nullptr;
+	inline static uint8_t* s_view = nullptr;
+	inline static SharedHeader* s_header = nullptr;
+	inline static Slot* s_slots = nullptr;
+};
@@ -1,13 +1,24 @@
 #pragma once
 #include <windows.h>
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <emmintrin.h>
+#include <intrin.h>
+#include <nmmintrin.h>
 #include <filesystem>
+#include <utility>
+#include <vector>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_BBOX_H
 #include FT_OUTLINE_H
 
+#include "unordered_dense/include/ankerl/unordered_dense.h"
+
 class ScopedFileLock {
 	HANDLE hFile = INVALID_HANDLE_VALUE;
 	OVERLAPPED ol{};
@@ -19,6 +30,9 @@ public:
 	bool AcquireExclusive(const std::filesystem::path& lockFilePath, DWORD timeoutMs = 2000) { return AcquireInternal(lockFilePath, LOCKFILE_EXCLUSIVE_LOCK, timeoutMs); }
 	bool AcquireShared(const std::filesystem::path& lockFilePath, DWORD timeoutMs = 2000) { return AcquireInternal(lockFilePath, 0, timeoutMs); }
 
+	// time spent waiting on locks held by other handles, this process or another client
+	inline static std::atomic<uint64_t> s_waitMs = 0;
+
 	void Release() noexcept {
 		if (locked && hFile != INVALID_HANDLE_VALUE) {
 			UnlockFileEx(hFile, 0, 1, 0, &ol);
@@ -41,12 +55,14 @@ private:
 			memset(&ol, 0, sizeof(ol));
 			if (LockFileEx(hFile, flags | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &ol)) {
 				locked = true;
+				s_waitMs += GetTickCount64() - start;
 				return true;
 			}
 			if (timeoutMs == 0) break;
 			Sleep(10);
 		}
 		while ((GetTickCount64() - start) < timeoutMs);
+		s_waitMs += GetTickCount64() - start;
 		CloseHandle(hFile);
 		hFile = INVALID_HANDLE_VALUE;
 		return false;
@@ -215,13 +231,338 @@ struct FinalAction {
 	FinalAction& operator=(const FinalAction&) = delete;
 };
 
+// drops the least recently used entries of a map whose values carry a lastUse stamp, keep of them are left
+template <typename Map>
+void TrimLeastRecentlyUsed(Map& map, size_t keep) {
+	if (map.size() <= keep) return;
+	std::vector<uint64_t> stamps;
+	stamps.reserve(map.size());
+	for (const auto& [key, value] : map) stamps.push_back(value.lastUse);
+	const auto cutoff = stamps.begin() + (map.size() - keep - 1);
+	std::nth_element(stamps.begin(), cutoff, stamps.end());
+	const uint64_t oldest = *cutoff;
+	std::vector<typename Map::key_type> stale;
+	stale.reserve(map.size() - keep);
+	for (const auto& [key, value] : map) { if (value.lastUse <= oldest) stale.push_back(key); }
+	for (const auto& key : stale) map.erase(key);
+}
+
+namespace Crc32CDetail {
+	inline constexpr uint32_t POLY = 0x82F63B78U; // Castagnoli, reflected
+
+	inline constexpr std::array<uint32_t, 256> TABLE = []() {
+		std::array<uint32_t, 256> table{};
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k) c = (c >> 1) ^ ((c & 1) ? POLY : 0);
+			table[i] = c;
+		}
+		return table;
+	}();
+
+	inline const bool HAS_SSE42 = []() {
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 20)) != 0;
+	}();
+
+	inline uint32_t Software(uint32_t crc, const uint8_t* p, size_t size) {
+		for (size_t i = 0; i < size; ++i) crc = TABLE[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+		return crc;
+	}
+
+	inline uint32_t Hardware(uint32_t crc, const uint8_t* p, size_t size) {
+		for (; size >= 4; p += 4, size -= 4) {
+			uint32_t v;
+			std::memcpy(&v, p, sizeof(v));
+			crc = _mm_crc32_u32(crc, v);
+		}
+		for (; size > 0; ++p, --size) crc = _mm_crc32_u8(crc, *p);
+		return crc;
+	}
+}
+
+// CRC32C with the SSE4.2 crc32 instruction when the CPU has it, table driven otherwise
+inline uint32_t Crc32C(const void* data, size_t size, uint32_t crc = 0) {
+	const auto* p = static_cast<const uint8_t*>(data);
+	crc = ~crc;
+	crc = Crc32CDetail::HAS_SSE42 ? Crc32CDetail::Hardware(crc, p, size) : Crc32CDetail::Software(crc, p, size);
+	return ~crc;
+}
+
+namespace PackDetail {
+	inline void Scalar(uint8_t* dest, const float* msdf, const float* sdf, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			dest[i * 4 + 0] = static_cast<uint8_t>(std::clamp(msdf[i * 3 + 0] * 255.f, 0.f, 255.f));
+			dest[i * 4 + 1] = static_cast<uint8_t>(std::clamp(msdf[i * 3 + 1] * 255.f, 0.f, 255.f));
+			dest[i * 4 + 2] = static_cast<uint8_t>(std::clamp(msdf[i * 3 + 2] * 255.f, 0.f, 255.f));
+			dest[i * 4 + 3] = static_cast<uint8_t>(std::clamp(sdf[i] * 255.f, 0.f, 255.f));
+		}
+	}
+
+	// same float multiply, clamp and truncation as Scalar, so both produce identical bytes
+	inline __m128i Quantize(__m128 v) {
+		const __m128 scale = _mm_set1_ps(255.f);
+		return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(v, scale), _mm_setzero_ps()), scale));
+	}
+}
+
+// interleaves an RGB float MSDF and a float SDF into RGBA8, four texels per iteration
+inline void PackRGBA8(uint8_t* dest, const float* msdf, const float* sdf, size_t count) {
+	using namespace PackDetail;
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		// r0 g0 b0 r1 | g1 b1 r2 g2 | b2 r3 g3 b3 | a0 a1 a2 a3
+		const __m128 m0 = _mm_loadu_ps(msdf + i * 3);
+		const __m128 m1 = _mm_loadu_ps(msdf + i * 3 + 4);
+		const __m128 m2 = _mm_loadu_ps(msdf + i * 3 + 8);
+		const __m128 a = _mm_loadu_ps(sdf + i);
+
+		const __m128 p0 = _mm_shuffle_ps(m0, _mm_shuffle_ps(m0, a, _MM_SHUFFLE(0, 0, 2, 2)), _MM_SHUFFLE(2, 0, 1, 0));
+		const __m128 p1 = _mm_shuffle_ps(_mm_shuffle_ps(m0, m1, _MM_SHUFFLE(0, 0, 3, 3)), _mm_shuffle_ps(m1, a, _MM_SHUFFLE(1, 1, 1, 1)), _MM_SHUFFLE(2, 0, 2, 0));
+		const __m128 p2 = _mm_shuffle_ps(_mm_shuffle_ps(m1, m2, _MM_SHUFFLE(0, 0, 3, 2)), _mm_shuffle_ps(m2, a, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 0, 1, 0));
+		const __m128 p3 = _mm_shuffle_ps(m2, _mm_shuffle_ps(m2, a, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(2, 0, 2, 1));
+
+		// every lane is already within 0..255, the saturating packs only narrow
+		const __m128i lo = _mm_packs_epi32(Quantize(p0), Quantize(p1));
+		const __m128i hi = _mm_packs_epi32(Quantize(p2), Quantize(p3));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 4), _mm_packus_epi16(lo, hi));
+	}
+	Scalar(dest + i * 4, msdf + i * 3, sdf + i, count - i);
+}
+
 using FontHash = uint64_t;
 
+// bump whenever HashFont changes, fingerprints persisted by older builds are then discarded
+inline constexpr uint32_t FONT_HASH_VERSION = 2;
+
+namespace FontHashDetail {
+	inline constexpr uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+	inline constexpr uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+	inline constexpr uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+	inline constexpr uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+	inline constexpr uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+	inline constexpr uint32_t PRIME32_1 = 0x9E3779B1U;
+	inline constexpr size_t STRIPE_SIZE = 64;
+	inline constexpr size_t STRIPES_PER_SCRAMBLE = 16;
+
+	alignas(16) inline constexpr uint64_t LANE_KEYS[8] = {
+		0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL, 0xDB979083E96DD4DEULL, 0x1F67B3B7A4A44072ULL,
+		0x78E5C0CC4EE679CBULL, 0x2172FFCC7DD05A82ULL, 0x8E2443F7744608B8ULL, 0x4C263A81E69035E0ULL,
+	};
+	alignas(16) inline constexpr uint64_t LANE_SEEDS[8] = {PRIME32_1, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_1 ^ 0xFFFFFFFFULL, PRIME64_5, PRIME32_1};
+
+	inline uint64_t Read64(const uint8_t* p) {
+		uint64_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	inline uint64_t Avalanche(uint64_t h) {
+		h ^= h >> 37;
+		h *= PRIME64_3;
+		h ^= h >> 32;
+		return h;
+	}
+}
+
+// eight 64-bit lanes fed 64 bytes at a time with SSE2 multiply-accumulate, scrambled every 1 KiB, tail folded in scalar
 inline FontHash HashFont(const FT_Byte* data, FT_Long size) {
-	uint64_t h = 0xcbf29ce484222325ULL;
-	for (FT_Long i = 0; i < size; ++i) {
-		h ^= data[i];
-		h *= 0x100000001b3ULL;
+	using namespace FontHashDetail;
+	const size_t len = size > 0 ? static_cast<size_t>(size) : 0;
+	const uint8_t* p = data;
+
+	const __m128i* keys = reinterpret_cast<const __m128i*>(LANE_KEYS);
+	const __m128i prime = _mm_set1_epi32(static_cast<int>(PRIME32_1));
+	__m128i acc[4];
+	for (int i = 0; i < 4; ++i) acc[i] = _mm_load_si128(reinterpret_cast<const __m128i*>(LANE_SEEDS) + i);
+
+	const uint8_t* const stripesEnd = p + (len & ~(STRIPE_SIZE - 1));
+	for (size_t stripe = 1; p < stripesEnd; p += STRIPE_SIZE, ++stripe) {
+		for (int i = 0; i < 4; ++i) {
+			const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p) + i);
+			const __m128i dk = _mm_xor_si128(d, _mm_load_si128(keys + i));
+			const __m128i product = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+			acc[i] = _mm_add_epi64(acc[i], _mm_add_epi64(product, _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2))));
+		}
+		if (stripe % STRIPES_PER_SCRAMBLE == 0) {
+			for (int i = 0; i < 4; ++i) {
+				__m128i a = _mm_xor_si128(acc[i], _mm_srli_epi64(acc[i], 47));
+				a = _mm_xor_si128(a, _mm_load_si128(keys + i));
+				const __m128i lo = _mm_mul_epu32(a, prime);
+				const __m128i hi = _mm_mul_epu32(_mm_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+				acc[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+			}
+		}
 	}
-	return h;
+
+	alignas(16) uint64_t lanes[8];
+	for (int i = 0; i < 4; ++i) _mm_store_si128(reinterpret_cast<__m128i*>(lanes) + i, acc[i]);
+
+	uint64_t h = static_cast<uint64_t>(len) * PRIME64_1;
+	for (int i = 0; i < 8; ++i) h = std::rotl(h ^ Avalanche(lanes[i] ^ LANE_KEYS[i]), 27) * PRIME64_1 + PRIME64_4;
+
+	const uint8_t* const end = data + len;
+	for (; p + 8 <= end; p += 8) h = std::rotl(h ^ Avalanche(Read64(p) * PRIME64_2), 27) * PRIME64_1 + PRIME64_4;
+	for (; p < end; ++p) h = std::rotl(h ^ (*p * PRIME64_5), 11) * PRIME64_1;
+	return Avalanche(h);
 }
+
+// deduplicating codepoint collector, a two-level bitmap over the BMP drains in ascending order without a sort.
+// ascending order is cache block order, so a drain touches each block file once
+class CodepointSet {
+public:
+	void Add(uint32_t codepoint) {
+		m_any = true;
+		if (codepoint > 0xFFFF) {
+			m_astral.push_back(codepoint);
+			return;
+		}
+		const uint32_t word = codepoint >> 6;
+		m_bits[word] |= 1ull << (codepoint & 63);
+		m_summary[word >> 6] |= 1ull << (word & 63);
+	}
+
+	// ASCII is let through 16 bytes at a time, malformed, overlong and surrogate sequences are dropped
+	void AddUtf8(const char* text, size_t length) {
+		const auto* p = reinterpret_cast<const uint8_t*>(text);
+		const uint8_t* const end = p + length;
+		while (p < end) {
+			if (end - p >= 16) {
+				const int nonAscii = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+				// the ASCII prefix of the chunk, all 16 bytes when there is no lead or continuation byte in it
+				const int ascii = nonAscii ? std::countr_zero(static_cast<uint32_t>(nonAscii)) : 16;
+				for (int i = 0; i < ascii; ++i) AddAscii(p[i]);
+				p += ascii;
+				if (ascii == 16) continue;
+			}
+			else if (*p < 0x80) {
+				AddAscii(*p++);
+				continue;
+			}
+			p = DecodeSequence(p, end);
+		}
+	}
+
+	bool Empty() const { return !m_any; }
+
+	template <typename F>
+	void Drain(F&& fn) {
+		if (!m_any) return;
+		m_any = false;
+		for (uint32_t s = 0; s < m_summary.size(); ++s) {
+			for (uint64_t words = std::exchange(m_summary[s], 0); words; words &= words - 1) {
+				const uint32_t word = s * 64 + std::countr_zero(words);
+				for (uint64_t bits = std::exchange(m_bits[word], 0); bits; bits &= bits - 1) fn(word * 64 + std::countr_zero(bits));
+			}
+		}
+		if (m_astral.empty()) return;
+		std::ranges::sort(m_astral);
+		m_astral.erase(std::ranges::unique(m_astral).begin(), m_astral.end());
+		for (uint32_t codepoint : m_astral) fn(codepoint);
+		m_astral.clear();
+	}
+
+	void Clear() { Drain([](uint32_t) {}); }
+
+private:
+	void AddAscii(uint8_t c) {
+		m_any = true;
+		m_bits[c >> 6] |= 1ull << (c & 63);
+		m_summary[0] |= 1ull << (c >> 6);
+	}
+
+	// p points at a byte >= 0x80, returns where decoding resumes
+	const uint8_t* DecodeSequence(const uint8_t* p, const uint8_t* end) {
+		const uint8_t lead = *p++;
+		const uint32_t extra = lead >= 0xF8 ? 0 : lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : 0;
+		if (!extra) return p; // stray continuation or invalid lead
+		uint32_t codepoint = lead & (0x3F >> extra);
+		for (uint32_t i = 0; i < extra; ++i, ++p) {
+			if (p == end || (*p & 0xC0) != 0x80) return p;
+			codepoint = (codepoint << 6) | (*p & 0x3F);
+		}
+		constexpr uint32_t MIN_CODEPOINT[] = {0, 0x80, 0x800, 0x10000};
+		if (codepoint < MIN_CODEPOINT[extra] || codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF)) return p;
+		Add(codepoint);
+		return p;
+	}
+
+	static constexpr uint32_t BMP_WORDS = 0x10000 / 64;
+
+	std::array<uint64_t, BMP_WORDS> m_bits{};
+	std::array<uint64_t, BMP_WORDS / 64> m_summary{}; // bit per non-empty m_bits word
+	std::vector<uint32_t> m_astral;
+	bool m_any = false;
+};
+
+// resolved per-quad layout of a string, relative to the engine's own vertex positions
+struct GlyphQuad {
+	uint32_t codepoint = 0; // 0 - quad is left untouched
+	double left = 0.0, top = 0.0, width = 0.0, height = 0.0;
+	float u0 = 0.0f, v0 = 0.0f, u1 = 0.0f, v1 = 0.0f; // spread and page index already encoded as offsets
+};
+
+struct GlyphRun {
+	uint32_t evictionCount = 0;
+	uint32_t pageMask = 0; // atlas pages the run samples from, kept warm on replay
+	uint64_t lastUse = 0;
+	std::vector<GlyphQuad> quads;
+};
+
+// everything a string's layout depends on besides its text. the bearing the layout is offset by comes from the engine font,
+// the same text at the same size may be drawn through several
+struct GlyphRunKey {
+	double scale;
+	double fontSizeMult;
+	uint64_t quadCount;
+	uint64_t fontObj;
+	uint32_t flags;
+	uint32_t is3d;
+	float fontHeight;
+	uint32_t styleFlags;
+	uint32_t pixelHeight;
+	uint32_t rasterSize;
+
+	uint64_t Hash(const char* text) const {
+		const uint64_t textHash = text ? ankerl::unordered_dense::detail::wyhash::hash(text, strlen(text)) : 0;
+		return ankerl::unordered_dense::detail::wyhash::mix(textHash, ankerl::unordered_dense::detail::wyhash::hash(this, sizeof(*this)));
+	}
+};
+static_assert(sizeof(GlyphRunKey) == 56, "padding would be hashed");
+
+// string layouts of one font, a run is only replayed while the font's eviction count is the one it was built under
+class GlyphRunCache {
+public:
+	static constexpr size_t MAX_RUNS = 4096;
+	static constexpr size_t TRIMMED_RUNS = MAX_RUNS * 3 / 4; // left after the least recently drawn runs are dropped
+
+	const GlyphRun* Find(uint64_t key, size_t quadCount, uint32_t evictionCount) {
+		auto it = m_runs.find(key);
+		if (it == m_runs.end()) return nullptr;
+		// runs built before a page eviction point at stale atlas rects
+		if (it->second.evictionCount != evictionCount || it->second.quads.size() != quadCount) return nullptr;
+		it->second.lastUse = ++m_tick;
+		return &it->second;
+	}
+
+	GlyphRun* Create(uint64_t key, uint32_t evictionCount) {
+		// only the runs nobody drew for a while go, the strings on screen keep replaying
+		if (m_runs.size() >= MAX_RUNS && !m_runs.contains(key)) TrimLeastRecentlyUsed(m_runs, TRIMMED_RUNS);
+		GlyphRun& run = m_runs[key];
+		run.evictionCount = evictionCount;
+		run.pageMask = 0;
+		run.lastUse = ++m_tick;
+		run.quads.clear();
+		return &run;
+	}
+
+	// a run with a quad that could not be resolved is never replayed, the next draw goes through the full path again
+	void Drop(uint64_t key) { m_runs.erase(key); }
+	void Clear() { m_runs.clear(); }
+	size_t Size() const { return m_runs.size(); }
+
+private:
+	ankerl::unordered_dense::map<uint64_t, GlyphRun> m_runs;
+	uint64_t m_tick = 0;
+};
@@ -2,19 +2,98 @@
 
 class MSDFValidator {
 public:
-	static bool IsFontMSDFCompatible(msdfgen::FontHandle* font) {
+	// bump whenever the verdict for the same font file could change, persisted verdicts are then discarded
+	static constexpr uint32_t VERSION = 2;
+
+	// ASCII must be fully valid; the rest of the locale range is sampled evenly, glyphs the font lacks are skipped
+	static bool IsFontMSDFCompatible(msdfgen::FontHandle* font, const MSDF::CodepointRange& range) {
 		if (!font) return false;
 
 		for (uint32_t cp = 32; cp < 127; ++cp) { if (!IsGlyphValid(font, cp)) { return false; } }
+
+		const uint32_t first = std::max<uint32_t>(range.first, 127);
+		if (range.last < first) return true;
+		const uint32_t stride = std::max<uint32_t>(1, (range.last - first + 1 + MAX_EXTENDED_GLYPHS - 1) / MAX_EXTENDED_GLYPHS);
+		for (uint32_t cp = first; cp <= range.last; cp += stride) {
+			msdfgen::GlyphIndex glyphIndex;
+			if (!msdfgen::getGlyphIndex(glyphIndex, font, cp)) continue;
+			if (!IsGlyphValid(font, cp)) return false;
+		}
+		return true;
+	}
+
+	// true when resolveShapeGeometry would have nothing to fix: no contour touches or crosses itself or another one,
+	// and every contour winds the way its nesting depth says, so nonzero and even-odd fill agree.
+	// curves are flattened to within a fraction of the glyph size and contours must keep twice that apart
+	static bool IsShapeResolved(const msdfgen::Shape& shape) {
+		if (shape.contours.empty() || !shape.validate()) return false;
+		const msdfgen::Shape::Bounds bounds = shape.getBounds();
+		const double tol = std::max(bounds.r - bounds.l, bounds.t - bounds.b) * RESOLVED_TOLERANCE;
+		if (!(tol > EPS) || !isValidCoord(bounds.l) || !isValidCoord(bounds.r) || !isValidCoord(bounds.b) || !isValidCoord(bounds.t)) return false;
+
+		// every contour flattened into one array, next[i] closes each contour back onto its first point
+		std::vector<Vec> pts;
+		std::vector<size_t> next;
+		std::vector<size_t> starts;
+		std::vector<double> areas;
+		std::vector<Vec> contour;
+		for (const msdfgen::Contour& c : shape.contours) {
+			contour.clear();
+			for (const msdfgen::EdgeHolder& edge : c.edges) {
+				const msdfgen::Point2* p = edge->controlPoints();
+				const Vec p0(p[0].x, p[0].y);
+				if (contour.empty()) contour.push_back(p0);
+				switch (edge->type()) {
+					case msdfgen::QuadraticSegment::EDGE_TYPE: flattenQuadratic(p0, Vec(p[1].x, p[1].y), Vec(p[2].x, p[2].y), contour, tol); break;
+					case msdfgen::CubicSegment::EDGE_TYPE: flattenCubic(p0, Vec(p[1].x, p[1].y), Vec(p[2].x, p[2].y), Vec(p[3].x, p[3].y), contour, tol); break;
+					default: contour.emplace_back(p[1].x, p[1].y); break;
+				}
+			}
+			// degenerate edges leave repeated points, the last one repeats the first
+			const auto dup = std::ranges::unique(contour, nearlyEqual);
+			contour.erase(dup.begin(), dup.end());
+			if (contour.size() > 1 && nearlyEqual(contour.front(), contour.back())) contour.pop_back();
+			if (contour.size() < MIN_CONTOUR_SIZE) return false;
+
+			double area = 0.0;
+			for (size_t i = 0; i < contour.size(); ++i) {
+				const Vec& a = contour[i];
+				const Vec& b = contour[(i + 1) % contour.size()];
+				area += a.x * b.y - b.x * a.y;
+			}
+			if (std::abs(area) * 0.5 <= tol * tol) return false;
+			areas.push_back(area);
+
+			const size_t start = pts.size();
+			starts.push_back(start);
+			for (size_t i = 0; i < contour.size(); ++i) next.push_back(i + 1 < contour.size() ? start + i + 1 : start);
+			pts.insert(pts.end(), contour.begin(), contour.end());
+		}
+
+		if (hasContactsWithin(pts, next, 2.0 * tol)) return false;
+
+		// with nothing touching, the first point of a contour is strictly inside or outside every other one
+		int expected = 0;
+		for (size_t c = 0; c < starts.size(); ++c) {
+			size_t depth = 0;
+			for (size_t other = 0; other < starts.size(); ++other) {
+				if (other != c && containsPoint(pts, next, starts[other], pts[starts[c]])) ++depth;
+			}
+			const int winding = ((areas[c] > 0.0) != (depth % 2 == 1)) ? 1 : -1;
+			if (expected && winding != expected) return false;
+			expected = winding;
+		}
 		return true;
 	}
 
 private:
+	static constexpr uint32_t MAX_EXTENDED_GLYPHS = 2048;
 	static constexpr double FLATTEN_EPS = 0.5;
 	static constexpr double EPS = 1e-9;
 	static constexpr double MAX_COORD = 1e9;
 	static constexpr int MIN_CONTOUR_SIZE = 3;
 	static constexpr int MAX_CURVE_SAMPLES = 10;
+	static constexpr double RESOLVED_TOLERANCE = 1.0 / 512.0; // of the larger outline dimension
 
 	static bool isnan_inf(double v) { return std::isnan(v) || std::isinf(v); }
 
@@ -120,33 +199,113 @@ private:
 		return false;
 	}
 
+	static bool nearlyEqual(const Vec& a, const Vec& b) { return Vec(a.x - b.x, a.y - b.y).lengthSq() <= EPS * EPS; }
+
+	struct SweepSegment {
+		double minX, maxX, minY, maxY;
+		size_t index;
+	};
+
+	// sweep over x: a segment is only tested against the still-open segments whose y extent overlaps its own,
+	// pairs with disjoint bounding boxes cannot intersect so the verdict matches the exhaustive pairwise test
 	static bool hasSelfIntersections(const std::vector<Vec>& pts) {
 		const size_t n = pts.size();
 		if (n < 4) return false;
 
+		std::vector<SweepSegment> segments;
+		segments.reserve(n);
 		for (size_t i = 0; i < n; ++i) {
-			const Vec& a1 = pts[i];
-			const Vec& a2 = pts[(i + 1) % n];
-
-			if (Vec(a2.x - a1.x, a2.y - a1.y).lengthSq() <= EPS * EPS) continue;
+			const Vec& a = pts[i];
+			const Vec& b = pts[(i + 1) % n];
+			if (nearlyEqual(a, b)) continue;
+			segments.push_back({std::min(a.x, b.x) - EPS, std::max(a.x, b.x) + EPS, std::min(a.y, b.y) - EPS, std::max(a.y, b.y) + EPS, i});
+		}
+		std::ranges::sort(segments, {}, &SweepSegment::minX);
 
-			for (size_t j = i + 2; j < n; ++j) {
-				if (i == 0 && j == n - 1) continue;
+		std::vector<const SweepSegment*> active;
+		for (const SweepSegment& seg : segments) {
+			std::erase_if(active, [&](const SweepSegment* open) { return open->maxX < seg.minX; });
 
-				const Vec& b1 = pts[j];
-				const Vec& b2 = pts[(j + 1) % n];
+			const Vec& a1 = pts[seg.index];
+			const Vec& a2 = pts[(seg.index + 1) % n];
+			for (const SweepSegment* open : active) {
+				if (open->maxY < seg.minY || open->minY > seg.maxY) continue;
 
-				if (Vec(b2.x - b1.x, b2.y - b1.y).lengthSq() <= EPS * EPS) continue;
+				// neighbouring edges share a vertex by construction
+				const size_t lo = std::min(seg.index, open->index);
+				const size_t hi = std::max(seg.index, open->index);
+				if (hi - lo < 2 || (lo == 0 && hi == n - 1)) continue;
 
+				const Vec& b1 = pts[open->index];
+				const Vec& b2 = pts[(open->index + 1) % n];
 				if (segsIntersectProper(a1, a2, b1, b2)) {
-					const bool shareEndpoint = (Vec(a1.x - b1.x, a1.y - b1.y).lengthSq() <= EPS * EPS) || (Vec(a1.x - b2.x, a1.y - b2.y).lengthSq() <= EPS * EPS) || (Vec(a2.x - b1.x, a2.y - b1.y).lengthSq() <= EPS * EPS) || (Vec(a2.x - b2.x, a2.y - b2.y).lengthSq() <= EPS * EPS);
+					const bool shareEndpoint = nearlyEqual(a1, b1) || nearlyEqual(a1, b2) || nearlyEqual(a2, b1) || nearlyEqual(a2, b2);
 					if (!shareEndpoint) return true;
 				}
 			}
+			active.push_back(&seg);
+		}
+		return false;
+	}
+
+	static double segmentDistance(const Vec& a1, const Vec& a2, const Vec& b1, const Vec& b2) {
+		if (segsIntersectProper(a1, a2, b1, b2)) return 0.0;
+		return std::min({distPointToLine(a1, b1, b2), distPointToLine(a2, b1, b2), distPointToLine(b1, a1, a2), distPointToLine(b2, a1, a2)});
+	}
+
+	// the same sweep as hasSelfIntersections over the segments of every contour at once, boxes padded by the clearance.
+	// segments sharing a vertex only fail when the outline doubles back on itself
+	static bool hasContactsWithin(const std::vector<Vec>& pts, const std::vector<size_t>& next, double clearance) {
+		const size_t n = pts.size();
+		std::vector<SweepSegment> segments;
+		segments.reserve(n);
+		for (size_t i = 0; i < n; ++i) {
+			const Vec& a = pts[i];
+			const Vec& b = pts[next[i]];
+			segments.push_back({std::min(a.x, b.x) - clearance, std::max(a.x, b.x) + clearance, std::min(a.y, b.y) - clearance, std::max(a.y, b.y) + clearance, i});
+		}
+		std::ranges::sort(segments, {}, &SweepSegment::minX);
+
+		std::vector<const SweepSegment*> active;
+		for (const SweepSegment& seg : segments) {
+			std::erase_if(active, [&](const SweepSegment* open) { return open->maxX < seg.minX; });
+
+			const Vec& a1 = pts[seg.index];
+			const Vec& a2 = pts[next[seg.index]];
+			for (const SweepSegment* open : active) {
+				if (open->maxY < seg.minY || open->minY > seg.maxY) continue;
+
+				const Vec& b1 = pts[open->index];
+				const Vec& b2 = pts[next[open->index]];
+				if (next[seg.index] == open->index || next[open->index] == seg.index) {
+					const bool segFirst = next[seg.index] == open->index;
+					const Vec& shared = segFirst ? a2 : b2;
+					const Vec& from = segFirst ? a1 : b1;
+					const Vec& to = segFirst ? b2 : a2;
+					const bool foldsBack = orient(from, shared, to) == 0 && (shared.x - from.x) * (to.x - shared.x) + (shared.y - from.y) * (to.y - shared.y) < 0.0;
+					if (foldsBack) return true;
+					continue;
+				}
+				if (segmentDistance(a1, a2, b1, b2) < clearance) return true;
+			}
+			active.push_back(&seg);
 		}
 		return false;
 	}
 
+	// crossing number of a ray cast along +x against the contour starting at pts[start]
+	static bool containsPoint(const std::vector<Vec>& pts, const std::vector<size_t>& next, size_t start, const Vec& p) {
+		bool inside = false;
+		size_t i = start;
+		do {
+			const Vec& a = pts[i];
+			const Vec& b = pts[next[i]];
+			if ((a.y > p.y) != (b.y > p.y) && p.x < a.x + (p.y - a.y) * (b.x - a.x) / (b.y - a.y)) inside = !inside;
+			i = next[i];
+		} while (i != start);
+		return inside;
+	}
+
 	struct DecomposeCtx {
 		std::vector<std::vector<Vec>> contours;
 		std::vector<Vec> current;
@@ -0,0 +1,17 @@
+#pragma once
+#include <cstdio>
+
+inline int g_checkFailures = 0;
+
+#define CHECK(expr) \
+	do { \
+		if (!(expr)) { \
+			std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #expr); \
+			++g_checkFailures; \
+		} \
+	} while (0)
+
+inline int CheckResult() {
+	if (g_checkFailures) std::printf("%d check(s) failed\n", g_checkFailures);
+	return g_checkFailures ? 1 : 0;
+}
@@ -0,0 +1,138 @@
+#include "Check.h"
+#include "MSDFUtils.h"
+#include <random>
+#include <set>
+#include <string>
+
+namespace {
+	void AppendUtf8(std::string& out, uint32_t cp) {
+		if (cp < 0x80) out += static_cast<char>(cp);
+		else if (cp < 0x800) {
+			out += static_cast<char>(0xC0 | (cp >> 6));
+			out += static_cast<char>(0x80 | (cp & 0x3F));
+		}
+		else if (cp < 0x10000) {
+			out += static_cast<char>(0xE0 | (cp >> 12));
+			out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+			out += static_cast<char>(0x80 | (cp & 0x3F));
+		}
+		else {
+			out += static_cast<char>(0xF0 | (cp >> 18));
+			out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+			out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+			out += static_cast<char>(0x80 | (cp & 0x3F));
+		}
+	}
+
+	std::set<uint32_t> Drained(CodepointSet& set) {
+		std::set<uint32_t> out;
+		uint32_t last = 0;
+		bool ordered = true;
+		set.Drain([&](uint32_t cp) {
+			ordered = ordered && (out.empty() || cp > last);
+			last = cp;
+			out.insert(cp);
+		});
+		CHECK(ordered);
+		CHECK(set.Empty());
+		return out;
+	}
+
+	// chat-like lines, "[Name]: " in ASCII followed by words drawn from the script, skewed towards its common letters
+	std::vector<std::string> MakeLog(uint32_t first, uint32_t count, uint32_t wordMin, uint32_t wordMax, bool spaces, uint32_t seed, std::set<uint32_t>& outCodepoints) {
+		std::mt19937 rng(seed);
+		std::geometric_distribution<uint32_t> letter(3.0 / count);
+		std::uniform_int_distribution<uint32_t> wordLength(wordMin, wordMax);
+		std::uniform_int_distribution<uint32_t> words(3, 12);
+		std::vector<std::string> lines;
+		for (int i = 0; i < 400; ++i) {
+			std::string line = "[Player" + std::to_string(i % 7) + "]: ";
+			for (const char c : line) outCodepoints.insert(static_cast<uint8_t>(c));
+			for (uint32_t w = words(rng); w; --w) {
+				for (uint32_t n = wordLength(rng); n; --n) {
+					const uint32_t cp = first + letter(rng) % count;
+					AppendUtf8(line, cp);
+					outCodepoints.insert(cp);
+				}
+				if (spaces) {
+					line += ' ';
+					outCodepoints.insert(' ');
+				}
+			}
+			lines.push_back(std::move(line));
+		}
+		return lines;
+	}
+
+	// share of distinct glyphs a frame draws that were prefetched before it drew them, decoded vs the raw bytes the hook used to queue
+	void PrefetchCoverage(const char* name, const std::vector<std::string>& lines, const std::set<uint32_t>& drawn) {
+		CodepointSet decoded;
+		std::set<uint32_t> raw;
+		for (const std::string& line : lines) {
+			decoded.AddUtf8(line.data(), line.size());
+			for (const char c : line) raw.insert(static_cast<uint8_t>(c));
+		}
+		const std::set<uint32_t> prefetched = Drained(decoded);
+		CHECK(prefetched == drawn);
+
+		size_t rawHits = 0;
+		for (uint32_t cp : drawn) rawHits += raw.contains(cp);
+		std::printf("%s: %zu glyphs drawn, prefetched decoded %zu (%.1f%%), raw bytes %zu (%.1f%%)\n", name, drawn.size(), prefetched.size(), 100.0 * prefetched.size() / drawn.size(), rawHits, 100.0 * rawHits / drawn.size());
+	}
+
+	void CyrillicLog() {
+		std::set<uint32_t> drawn;
+		const auto lines = MakeLog(0x0410, 64, 2, 9, true, 1, drawn);
+		PrefetchCoverage("cyrillic", lines, drawn);
+	}
+
+	void CjkLog() {
+		std::set<uint32_t> drawn;
+		const auto lines = MakeLog(0x4E00, 3000, 1, 6, false, 2, drawn);
+		PrefetchCoverage("cjk", lines, drawn);
+	}
+
+	void AstralAndDuplicates() {
+		std::string text;
+		for (int i = 0; i < 3; ++i) {
+			AppendUtf8(text, 0x1F600);
+			AppendUtf8(text, 0x20000);
+			AppendUtf8(text, 'a');
+		}
+		CodepointSet set;
+		set.AddUtf8(text.data(), text.size());
+		CHECK((Drained(set) == std::set<uint32_t>{'a', 0x1F600, 0x20000}));
+	}
+
+	void MalformedSequencesAreDropped() {
+		// stray continuation, truncated lead, overlong '/', encoded surrogate, past U+10FFFF, invalid lead, then one good letter
+		const std::string text = "\x80" "\xE4\xB8" "\xC0\xAF" "\xED\xA0\x80" "\xF4\x90\x80\x80" "\xFF" "\xD0\x96";
+		CodepointSet set;
+		set.AddUtf8(text.data(), text.size());
+		CHECK((Drained(set) == std::set<uint32_t>{0x0416}));
+	}
+
+	void ChunkBoundaries() {
+		// multi-byte sequences straddling the 16 byte ASCII scan at every offset
+		for (size_t prefix = 0; prefix < 40; ++prefix) {
+			std::string text(prefix, 'x');
+			AppendUtf8(text, 0x4E2D);
+			AppendUtf8(text, 0x0416);
+			text += "tail";
+			CodepointSet set;
+			set.AddUtf8(text.data(), text.size());
+			std::set<uint32_t> expected{0x4E2D, 0x0416, 't', 'a', 'i', 'l'};
+			if (prefix) expected.insert('x');
+			CHECK(Drained(set) == expected);
+		}
+	}
+}
+
+int main() {
+	CyrillicLog();
+	CjkLog();
+	AstralAndDuplicates();
+	MalformedSequencesAreDropped();
+	ChunkBoundaries();
+	return CheckResult();
+}
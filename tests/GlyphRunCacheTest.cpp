@@ -0,0 +1,157 @@
+#include "Check.h"
+#include "MSDFUtils.h"
+
+namespace {
+	struct Run {
+		uint64_t lastUse = 0;
+	};
+
+	using RunMap = ankerl::unordered_dense::map<uint64_t, Run>;
+
+	RunMap MakeRuns(size_t count) {
+		RunMap runs;
+		for (uint64_t key = 0; key < count; ++key) runs[key].lastUse = key + 1;
+		return runs;
+	}
+
+	void TrimKeepsMostRecent() {
+		RunMap runs = MakeRuns(100);
+		TrimLeastRecentlyUsed(runs, 75);
+		CHECK(runs.size() == 75);
+		for (uint64_t key = 0; key < 25; ++key) CHECK(!runs.contains(key));
+		for (uint64_t key = 25; key < 100; ++key) CHECK(runs.contains(key));
+	}
+
+	void TrimKeepsTouchedRuns() {
+		// strings still on screen are replayed every frame, the oldest insertions must survive once they are drawn again
+		RunMap runs = MakeRuns(100);
+		uint64_t tick = 100;
+		for (uint64_t key = 0; key < 10; ++key) runs[key].lastUse = ++tick;
+		TrimLeastRecentlyUsed(runs, 50);
+		CHECK(runs.size() == 50);
+		for (uint64_t key = 0; key < 10; ++key) CHECK(runs.contains(key));
+		for (uint64_t key = 10; key < 60; ++key) CHECK(!runs.contains(key));
+		for (uint64_t key = 60; key < 100; ++key) CHECK(runs.contains(key));
+	}
+
+	void TrimBelowLimitIsNoop() {
+		RunMap runs = MakeRuns(10);
+		TrimLeastRecentlyUsed(runs, 10);
+		CHECK(runs.size() == 10);
+		TrimLeastRecentlyUsed(runs, 64);
+		CHECK(runs.size() == 10);
+		RunMap empty;
+		TrimLeastRecentlyUsed(empty, 0);
+		CHECK(empty.empty());
+	}
+
+	void TrimToZero() {
+		RunMap runs = MakeRuns(16);
+		TrimLeastRecentlyUsed(runs, 0);
+		CHECK(runs.empty());
+	}
+
+	GlyphRun* AddRun(GlyphRunCache& cache, uint64_t key, size_t quadCount, uint32_t evictionCount) {
+		GlyphRun* run = cache.Create(key, evictionCount);
+		run->quads.resize(quadCount);
+		return run;
+	}
+
+	void RunsReplayUntilEviction() {
+		GlyphRunCache cache;
+		AddRun(cache, 1, 3, 5);
+		CHECK(cache.Find(1, 3, 5) != nullptr);
+		CHECK(cache.Find(2, 3, 5) == nullptr);
+		// a page the font had glyphs on was recycled since, the run points at stale rects
+		CHECK(cache.Find(1, 3, 6) == nullptr);
+		// the engine laid the string out with another number of quads
+		CHECK(cache.Find(1, 4, 5) == nullptr);
+
+		// rebuilt under the new count it replays again, with nothing left of the old layout
+		GlyphRun* run = cache.Create(1, 6);
+		CHECK(run->quads.empty() && run->pageMask == 0);
+		run->quads.resize(3);
+		CHECK(cache.Find(1, 3, 6) == run);
+		CHECK(cache.Find(1, 3, 5) == nullptr);
+		CHECK(cache.Size() == 1);
+	}
+
+	void EvictedMidStringNeverReplays() {
+		// the hook marks a run built across an eviction, no count the font reaches afterwards may match it
+		GlyphRunCache cache;
+		AddRun(cache, 1, 2, 7)->evictionCount = ~0u;
+		for (uint32_t count = 7; count < 64; ++count) CHECK(cache.Find(1, 2, count) == nullptr);
+	}
+
+	void UnresolvedRunsAreDropped() {
+		GlyphRunCache cache;
+		AddRun(cache, 1, 2, 0);
+		AddRun(cache, 2, 2, 0);
+		cache.Drop(1);
+		CHECK(cache.Find(1, 2, 0) == nullptr);
+		CHECK(cache.Find(2, 2, 0) != nullptr);
+		CHECK(cache.Size() == 1);
+		cache.Drop(1);
+		CHECK(cache.Size() == 1);
+		cache.Clear();
+		CHECK(cache.Find(2, 2, 0) == nullptr);
+	}
+
+	void FullCacheKeepsReplayedRuns() {
+		GlyphRunCache cache;
+		for (uint64_t key = 0; key < GlyphRunCache::MAX_RUNS; ++key) AddRun(cache, key, 1, 0);
+		for (uint64_t key = 0; key < 10; ++key) CHECK(cache.Find(key, 1, 0) != nullptr);
+		// rebuilding a run that is already there never trims
+		AddRun(cache, 20, 1, 0);
+		CHECK(cache.Size() == GlyphRunCache::MAX_RUNS);
+
+		AddRun(cache, GlyphRunCache::MAX_RUNS, 1, 0);
+		CHECK(cache.Size() == GlyphRunCache::TRIMMED_RUNS + 1);
+		for (uint64_t key = 0; key < 10; ++key) CHECK(cache.Find(key, 1, 0) != nullptr);
+		CHECK(cache.Find(20, 1, 0) != nullptr);
+		CHECK(cache.Find(GlyphRunCache::MAX_RUNS, 1, 0) != nullptr);
+		CHECK(cache.Find(10, 1, 0) == nullptr);
+	}
+
+	void KeysSeparateFontObjects() {
+		const GlyphRunKey base{.scale = 12.0, .fontSizeMult = 1.0, .quadCount = 5, .fontObj = 0x1000, .flags = 1, .is3d = 0, .fontHeight = 12.0f, .styleFlags = 0, .pixelHeight = 12, .rasterSize = 12};
+		const uint64_t key = base.Hash("Hello");
+		CHECK(GlyphRunKey(base).Hash("Hello") == key);
+		CHECK(base.Hash("hello") != key);
+		CHECK(base.Hash(nullptr) != key);
+
+		// two engine fonts on the same face and size offset the layout by their own bearings
+		GlyphRunKey other = base;
+		other.fontObj = 0x2000;
+		CHECK(other.Hash("Hello") != key);
+		// and so does what the layout reads from the engine font
+		other = base;
+		other.fontHeight = 14.0f;
+		CHECK(other.Hash("Hello") != key);
+		other = base;
+		other.styleFlags = 8;
+		CHECK(other.Hash("Hello") != key);
+		other = base;
+		other.pixelHeight = 13;
+		CHECK(other.Hash("Hello") != key);
+		other = base;
+		other.rasterSize = 16;
+		CHECK(other.Hash("Hello") != key);
+		other = base;
+		other.is3d = 1;
+		CHECK(other.Hash("Hello") != key);
+	}
+}
+
+int main() {
+	TrimKeepsMostRecent();
+	TrimKeepsTouchedRuns();
+	TrimBelowLimitIsNoop();
+	TrimToZero();
+	RunsReplayUntilEviction();
+	EvictedMidStringNeverReplays();
+	UnresolvedRunsAreDropped();
+	FullCacheKeepsReplayedRuns();
+	KeysSeparateFontObjects();
+	return CheckResult();
+}
@@ -0,0 +1,86 @@
+#include "Check.h"
+#include "MSDFUtils.h"
+#include <cmath>
+#include <limits>
+#include <random>
+
+namespace {
+	// both packers over the same input, byte for byte
+	bool PacksMatch(const std::vector<float>& msdf, const std::vector<float>& sdf, size_t count, size_t destOffset) {
+		std::vector<uint8_t> packed(count * 4 + destOffset, 0xCD), scalar(count * 4 + destOffset, 0xCD);
+		PackRGBA8(packed.data() + destOffset, msdf.data(), sdf.data(), count);
+		PackDetail::Scalar(scalar.data() + destOffset, msdf.data(), sdf.data(), count);
+		return packed == scalar;
+	}
+
+	void RandomFields() {
+		std::mt19937 rng(1);
+		// a little past both ends, distance fields overshoot the range near the spread
+		std::uniform_real_distribution<float> value(-0.5f, 1.5f);
+		for (size_t count = 0; count <= 67; ++count) {
+			for (int round = 0; round < 32; ++round) {
+				std::vector<float> msdf(count * 3), sdf(count);
+				for (float& v : msdf) v = value(rng);
+				for (float& v : sdf) v = value(rng);
+				CHECK(PacksMatch(msdf, sdf, count, round % 4));
+			}
+		}
+	}
+
+	void QuantizationEdges() {
+		// every step boundary and its neighbours, where the truncation of either packer would show first
+		std::vector<float> edges = {0.0f, -0.0f, 1.0f, -1.0f, 2.0f, 1e30f, -1e30f, std::numeric_limits<float>::denorm_min(), -std::numeric_limits<float>::denorm_min(), std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity()};
+		for (int step = 0; step <= 255; ++step) {
+			const float v = step / 255.0f;
+			edges.push_back(v);
+			edges.push_back(std::nextafter(v, 0.0f));
+			edges.push_back(std::nextafter(v, 1.0f));
+		}
+		const size_t count = edges.size();
+		std::vector<float> msdf(count * 3), sdf(count);
+		for (size_t i = 0; i < count; ++i) {
+			// each value lands in every channel across the rotations
+			msdf[i * 3 + 0] = edges[i];
+			msdf[i * 3 + 1] = edges[(i + 1) % count];
+			msdf[i * 3 + 2] = edges[(i + 2) % count];
+			sdf[i] = edges[(i + 3) % count];
+		}
+		CHECK(PacksMatch(msdf, sdf, count, 0));
+	}
+
+	void UnalignedSources() {
+		// glyph rows start anywhere in the pooled buffers
+		std::mt19937 rng(2);
+		std::uniform_real_distribution<float> value(0.0f, 1.0f);
+		std::vector<float> msdf(3 * 64 + 3), sdf(64 + 3);
+		for (float& v : msdf) v = value(rng);
+		for (float& v : sdf) v = value(rng);
+		for (size_t offset = 0; offset < 3; ++offset) {
+			const size_t count = 61;
+			std::vector<uint8_t> packed(count * 4), scalar(count * 4);
+			PackRGBA8(packed.data(), msdf.data() + offset, sdf.data() + offset, count);
+			PackDetail::Scalar(scalar.data(), msdf.data() + offset, sdf.data() + offset, count);
+			CHECK(packed == scalar);
+		}
+	}
+
+	void ChannelOrder() {
+		const std::vector<float> msdf = {0.0f, 1.0f / 255.0f, 2.0f / 255.0f, 4.0f / 255.0f, 5.0f / 255.0f, 6.0f / 255.0f, 8.0f / 255.0f, 9.0f / 255.0f, 10.0f / 255.0f, 12.0f / 255.0f, 13.0f / 255.0f, 14.0f / 255.0f};
+		const std::vector<float> sdf = {3.0f / 255.0f, 7.0f / 255.0f, 11.0f / 255.0f, 15.0f / 255.0f};
+		// one step above each so the truncation lands on the intended byte
+		std::vector<float> m = msdf, s = sdf;
+		for (float& v : m) v = std::nextafter(v, 1.0f);
+		for (float& v : s) v = std::nextafter(v, 1.0f);
+		uint8_t packed[16];
+		PackRGBA8(packed, m.data(), s.data(), 4);
+		for (uint8_t i = 0; i < 16; ++i) CHECK(packed[i] == i);
+	}
+}
+
+int main() {
+	RandomFields();
+	QuantizationEdges();
+	UnalignedSources();
+	ChannelOrder();
+	return CheckResult();
+}
@@ -0,0 +1,180 @@
+#include "Check.h"
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_OUTLINE_H
+#include <msdfgen.h>
+#include <msdfgen-ext.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <ranges>
+#include <utility>
+#include <vector>
+
+// MSDFValidator.h only needs the range type from MSDF.h, which drags in the game client
+namespace MSDF {
+	struct CodepointRange {
+		uint32_t first;
+		uint32_t last;
+		const char* name;
+	};
+}
+#include "MSDFRaster.h"
+
+namespace {
+	using msdfgen::Point2;
+
+	void AddPolygon(msdfgen::Shape& shape, std::vector<Point2> points, bool ccw) {
+		if (!ccw) std::ranges::reverse(points);
+		msdfgen::Contour& contour = shape.addContour();
+		for (size_t i = 0; i < points.size(); ++i) contour.addEdge(msdfgen::EdgeHolder(points[i], points[(i + 1) % points.size()]));
+	}
+
+	void AddRect(msdfgen::Shape& shape, double x0, double y0, double x1, double y1, bool ccw) { AddPolygon(shape, {{x0, y0}, {x1, y0}, {x1, y1}, {x0, y1}}, ccw); }
+
+	// four cubic quarter arcs, the way fonts draw bowls and dots
+	void AddEllipse(msdfgen::Shape& shape, double cx, double cy, double rx, double ry, bool ccw) {
+		constexpr double k = 0.5522847498;
+		const Point2 p[4] = {{cx + rx, cy}, {cx, cy + ry}, {cx - rx, cy}, {cx, cy - ry}};
+		const Point2 c[8] = {{cx + rx, cy + k * ry}, {cx + k * rx, cy + ry}, {cx - k * rx, cy + ry}, {cx - rx, cy + k * ry}, {cx - rx, cy - k * ry}, {cx - k * rx, cy - ry}, {cx + k * rx, cy - ry}, {cx + rx, cy - k * ry}};
+		msdfgen::Contour& contour = shape.addContour();
+		for (int i = 0; i < 4; ++i) contour.addEdge(msdfgen::EdgeHolder(p[i], c[2 * i], c[2 * i + 1], p[(i + 1) % 4]));
+		if (!ccw) contour.reverse();
+	}
+
+	// glyph-like outlines that need no resolution, drawn both ways round
+	std::vector<std::pair<const char*, msdfgen::Shape>> SimpleGlyphs(bool ccw) {
+		std::vector<std::pair<const char*, msdfgen::Shape>> glyphs;
+		auto add = [&glyphs](const char* name) -> msdfgen::Shape& { return glyphs.emplace_back(name, msdfgen::Shape()).second; };
+
+		AddRect(add("I"), 200, 0, 320, 700, ccw);
+		AddPolygon(add("L"), {{100, 0}, {500, 0}, {500, 110}, {220, 110}, {220, 700}, {100, 700}}, ccw);
+		AddPolygon(add("V"), {{0, 700}, {250, 0}, {370, 0}, {620, 700}, {500, 700}, {310, 140}, {120, 700}}, ccw);
+		msdfgen::Shape& o = add("O");
+		AddEllipse(o, 350, 350, 300, 360, ccw);
+		AddEllipse(o, 350, 350, 190, 250, !ccw);
+		msdfgen::Shape& i = add("i");
+		AddRect(i, 100, 0, 200, 500, ccw);
+		AddEllipse(i, 150, 640, 60, 60, ccw);
+		msdfgen::Shape& d = add("D");
+		msdfgen::Contour& outer = d.addContour();
+		const Point2 a(100, 0), b(300, 0), c(300, 700), e(100, 700);
+		outer.addEdge(msdfgen::EdgeHolder(a, b));
+		outer.addEdge(msdfgen::EdgeHolder(b, Point2(650, 350), c));
+		outer.addEdge(msdfgen::EdgeHolder(c, e));
+		outer.addEdge(msdfgen::EdgeHolder(e, a));
+		if (!ccw) outer.reverse();
+		AddRect(d, 210, 110, 290, 590, !ccw);
+		return glyphs;
+	}
+
+	void SimpleOutlinesAreResolved() {
+		for (const bool ccw : {true, false}) {
+			for (const auto& [name, shape] : SimpleGlyphs(ccw)) {
+				if (!MSDFValidator::IsShapeResolved(shape)) std::printf("%s (%s) not resolved\n", name, ccw ? "ccw" : "cw");
+				CHECK(MSDFValidator::IsShapeResolved(shape));
+			}
+		}
+		msdfgen::Shape disjoint;
+		AddRect(disjoint, 0, 0, 10, 10, true);
+		AddRect(disjoint, 12, 0, 20, 10, true);
+		CHECK(MSDFValidator::IsShapeResolved(disjoint));
+	}
+
+	void OverlappingOutlinesAreNot() {
+		msdfgen::Shape crossing;
+		AddRect(crossing, 0, 0, 10, 10, true);
+		AddRect(crossing, 5, 5, 15, 15, true);
+		CHECK(!MSDFValidator::IsShapeResolved(crossing));
+
+		// a stroke drawn across the bowl, the way some fonts build the crossbar of a Ø
+		msdfgen::Shape slashed;
+		AddEllipse(slashed, 350, 350, 300, 360, true);
+		AddPolygon(slashed, {{0, -50}, {80, -50}, {700, 750}, {620, 750}}, true);
+		CHECK(!MSDFValidator::IsShapeResolved(slashed));
+
+		msdfgen::Shape bowtie;
+		AddPolygon(bowtie, {{0, 0}, {10, 10}, {10, 0}, {0, 10}}, true);
+		CHECK(!MSDFValidator::IsShapeResolved(bowtie));
+	}
+
+	void TouchingOutlinesAreNot() {
+		msdfgen::Shape sharedEdge;
+		AddRect(sharedEdge, 0, 0, 10, 10, true);
+		AddRect(sharedEdge, 10, 0, 20, 10, true);
+		CHECK(!MSDFValidator::IsShapeResolved(sharedEdge));
+
+		msdfgen::Shape sharedCorner;
+		AddRect(sharedCorner, 0, 0, 10, 10, true);
+		AddRect(sharedCorner, 10, 10, 20, 20, true);
+		CHECK(!MSDFValidator::IsShapeResolved(sharedCorner));
+
+		// a counter whose corner sits on the outer contour
+		msdfgen::Shape touchingHole;
+		AddRect(touchingHole, 0, 0, 10, 10, true);
+		AddPolygon(touchingHole, {{0, 5}, {5, 2}, {5, 8}}, false);
+		CHECK(!MSDFValidator::IsShapeResolved(touchingHole));
+	}
+
+	void InvertedOutlinesAreNot() {
+		// a counter wound like its outer contour fills under nonzero and stays empty under even-odd
+		msdfgen::Shape sameWinding;
+		AddRect(sameWinding, 0, 0, 10, 10, true);
+		AddRect(sameWinding, 2, 2, 8, 8, true);
+		CHECK(!MSDFValidator::IsShapeResolved(sameWinding));
+
+		msdfgen::Shape invertedBowl;
+		AddEllipse(invertedBowl, 350, 350, 300, 360, true);
+		AddEllipse(invertedBowl, 350, 350, 190, 250, true);
+		CHECK(!MSDFValidator::IsShapeResolved(invertedBowl));
+
+		// two separate parts wound against each other
+		msdfgen::Shape mixed;
+		AddRect(mixed, 0, 0, 10, 10, true);
+		AddRect(mixed, 12, 0, 20, 10, false);
+		CHECK(!MSDFValidator::IsShapeResolved(mixed));
+	}
+
+	// the texels GenerateMSDF stores for the outline, through either geometry pass
+	std::vector<uint8_t> Rasterize(msdfgen::Shape shape, int size, bool skip) {
+		constexpr uint32_t spread = 8;
+		VectorPool<float> pool;
+		std::vector<uint8_t> texels;
+		CHECK(ResolveGlyphGeometry(shape, skip) == skip);
+		CHECK(RasterizeGlyph(shape, texels, size, size, spread, pool));
+		return texels;
+	}
+
+	// the skip may only go live once it changes no byte of the cached payload, see MSDF_SKIP_RESOLVED_GEOMETRY
+	void SkipPathMatchesSkia() {
+		size_t differing = 0;
+		for (const bool ccw : {true, false}) {
+			for (const auto& [name, shape] : SimpleGlyphs(ccw)) {
+				for (const int size : {24, 48, 80}) {
+					const std::vector<uint8_t> skipped = Rasterize(shape, size, true);
+					const std::vector<uint8_t> resolved = Rasterize(shape, size, false);
+					CHECK(skipped.size() == resolved.size());
+					size_t bytes = 0, worst = 0;
+					for (size_t i = 0; i < std::min(skipped.size(), resolved.size()); ++i) {
+						if (skipped[i] == resolved[i]) continue;
+						++bytes;
+						worst = std::max<size_t>(worst, std::abs(skipped[i] - resolved[i]));
+					}
+					if (bytes) std::printf("%s (%s) at %d: %zu of %zu bytes differ, by up to %zu\n", name, ccw ? "ccw" : "cw", size, bytes, resolved.size(), worst);
+					differing += bytes;
+				}
+			}
+		}
+		if constexpr (MSDF_SKIP_RESOLVED_GEOMETRY) CHECK(differing == 0);
+		else if (differing) std::printf("skip path not byte-identical, keep MSDF_SKIP_RESOLVED_GEOMETRY off\n");
+	}
+}
+
+int main() {
+	SimpleOutlinesAreResolved();
+	OverlappingOutlinesAreNot();
+	TouchingOutlinesAreNot();
+	InvertedOutlinesAreNot();
+	SkipPathMatchesSkia();
+	return CheckResult();
+}